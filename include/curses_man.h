@@ -3,11 +3,78 @@
 
 #include <ncurses.h>
 #include "structs.h"
+#include "disk.h"
+#include "snapshot.h"
+#include "watch.h"
+#include "rm_queue.h"
+
+#define VIEW_FORMATS_NUM 256 /* Power of two */
+#define FSIZE_STR_SIZE 16
+#define MTIME_STR_SIZE 16
+
+/*
+ * An entry's formatted size and age. They're formatted again only when
+ * the entry's size or mtime changes, or when the age is out of date.
+ */
+struct entry_format {
+	const struct dtree *node; /* NULL marks an empty slot */
+	off_t fsize;
+	time_t mtime;
+	time_t stale; /* When the age is out of date */
+	char fsize_str[FSIZE_STR_SIZE];
+	char mtime_str[MTIME_STR_SIZE];
+};
+
+/*
+ * What a row of the viewport was drawn with, a row is drawn again only 
+ * when it doesn't match its entry anymore. Just the highlight's change
+ * is redrawn by dyeing the row.
+ */
+struct view_row {
+	bool drawn; /* False when the row's content isn't known */
+	const struct dtree *node; /* NULL for a blank row */
+	off_t fsize;
+	time_t mtime;
+	time_t stale; /* Of the drawn age */
+	bool pending;
+	bool top_view; /* Drawn with its whole path */
+	bool highlighted;
+};
+
+/*
+ * The browsed level as an indexed array of its entries, only the rows 
+ * from the top entry on are displayed. Scrolling just moves the top, 
+ * so it costs the displayed rows whatever the level's size is.
+ */
+struct viewport {
+	struct dtree **entries;
+	size_t num;
+	size_t cap;
+	/* Whose level is loaded, NULL in the largest entries' view */
+	const struct dtree *dir;
+	size_t top; /* The first displayed entry */
+	size_t cursor; /* The highlighted entry */
+	/* The tops of the levels above, restored on the way back out */
+	size_t *tops;
+	size_t depth;
+	size_t tops_cap;
+	/* The displayed entries' formats, direct mapped by their nodes */
+	struct entry_format formats[VIEW_FORMATS_NUM];
+	time_t now; /* Taken once for each display of the entries */
+	struct view_row *rows;
+	size_t rows_num; /* Of the window the rows were drawn on */
+	size_t rows_cap;
+};
 
 extern bool COLORED_OUTPUT;
 
 int nc_init_setup();
 int nc_initial_display(WINDOW *, struct dtree *, const char *);
 int nc_man_input(WINDOW *);
+void nc_set_bg_scan(struct bg_scan *);
+void nc_set_snap_view(struct snap_view *);
+void nc_set_watch(struct dtree_watch *);
+void nc_set_rm_queue(struct rm_queue *, struct arena *);
+void nc_set_rescan(const struct scan_opts *, struct arena *);
 
 #endif
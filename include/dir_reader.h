@@ -0,0 +1,35 @@
+#ifndef _DIR_READER_H
+#define _DIR_READER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Big enough to read most directories with a single system call */
+#define DIR_READER_BUF_SIZE (256 * 1024)
+
+/* The entries' layout as written by the getdents64 system call */
+struct linux_dirent64 {
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+
+/*
+ * Reader of an already opened directory. The entries are read in bulk 
+ * into a caller owned buffer, that can be reused for other directories 
+ * once the reader is done.
+ */
+struct dir_reader {
+	int fd;
+	char *buf;
+	size_t bufsize;
+	size_t pos;
+	size_t len;
+};
+
+void init_dir_reader(struct dir_reader *, int, char *, size_t);
+struct linux_dirent64 *read_dir_reader(struct dir_reader *);
+
+#endif
@@ -1,6 +1,8 @@
 #ifndef _DISK_H
 #define _DISK_H
 
+#include <pthread.h>
+#include <stdbool.h>
 #include "structs.h"
 
 enum COLOR_PAIRS {
@@ -13,10 +15,46 @@ enum COLOR_PAIRS {
 	RED_PAIR = 6
 };
 
-struct dtree *get_dir_tree(const char *);
+/* A scan that runs in its own thread while its tree is browsed */
+struct bg_scan {
+	pthread_t thread;
+	const char *path;
+	struct scan_opts opts;
+	struct arena *arena;
+	struct scan_progress progress;
+	struct dtree *begin; /* The scan's result, once it's done */
+	int error; /* ERROR of the failed scan */
+	bool done;
+};
+
+/* The removal's progress, updated by its threads as they go */
+struct rm_progress {
+	unsigned long entries; /* The removed entries */
+	off_t bytes; /* The charged size of the removed files */
+};
+
+short get_proper_cpair(mode_t);
+char get_proper_eos(const struct dtree *);
+struct dtree *get_dir_tree(const char *, const struct scan_opts *, 
+			   struct arena *);
+int start_bg_scan(struct bg_scan *, const char *, 
+		  const struct scan_opts *, struct arena *);
+bool is_bg_scan_done(const struct bg_scan *);
+struct dtree *get_published_child(const struct dtree *);
+const struct dtree *get_next_dtree(const struct dtree *, 
+				   const struct dtree *);
+struct dtree *wait_bg_scan_level(const struct bg_scan *);
+struct dtree *join_bg_scan(struct bg_scan *);
+struct dtree *get_new_entry(const char *, const char *, 
+			    const struct scan_opts *, dev_t, 
+			    const struct dtree *, struct arena *);
+bool release_dtree_links(struct link_set *, const struct dtree *);
+void recharge_dtree_links(struct link_set *, struct dtree *);
+int restat_entry(struct dtree *, const char *);
+struct dtree *rescan_dtree(struct dtree *, const struct scan_opts *,
+			   struct arena *);
+int rm_dtree(struct dtree *, int, struct rm_progress *);
 int rm_entry(struct dtree *);
-void correct_dirs_fsize(struct dtree *);
 off_t get_dtree_disk_usage(const struct dtree *);
-void purge_node(struct dtree *);
 
 #endif
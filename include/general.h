@@ -9,9 +9,9 @@
 void free_and_null(void **);
 bool is_dot_entry(const char *);
 struct size_format get_proper_size_format(off_t);
-char *get_mtime_str(time_t);
+time_t format_mtime(char *, size_t, time_t, time_t);
 int efficient_strcmp(const char *, const char *);
 size_t get_strsize(const char *);
-char *extract_dir_path(const char *);
+int reserve_array(void **, size_t *, size_t, size_t);
 
 #endif
@@ -2,22 +2,47 @@
 #define _INFORMATIVE_H
 
 #include <time.h>
+#include <pthread.h>
 #include <stdio.h>
+#include <stdbool.h>
 #include <dirent.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 
-extern int ERROR;
+extern __thread int ERROR;
+
+void hold_errors(bool);
+unsigned long get_held_errors(char *, size_t);
+void report_error(int, const char *, ...);
 
 void *malloc_inf(size_t);
+void *calloc_inf(size_t, size_t);
 int lstat_inf(const char *, struct stat *);
+int fstatat_inf(int, const char *, struct stat *, int);
+#ifdef STATX_BASIC_STATS
+int statx_inf(int, const char *, int, unsigned int, struct statx *);
+int statx_res_inf(int, const char *);
+#endif
 DIR *opendir_inf(const char *);
 int closedir_inf(DIR *);
 struct dirent *readdir_inf(DIR *);
+int open_dir_inf(const char *);
+int close_inf(int);
+long getdents64_inf(int, void *, size_t);
+int io_uring_enter_inf(int, unsigned int, unsigned int, unsigned int);
 int unlink_inf(const char *);
 int rmdir_inf(const char *);
+int unlinkat_inf(int, const char *, int);
 FILE *fopen_inf(const char *path, const char *mode);
 int fclose_inf(FILE *fp);
+size_t fwrite_inf(const void *, size_t, size_t, FILE *);
+int open_file_inf(const char *);
+int fstat_inf(int, struct stat *);
+void *mmap_file_inf(int, size_t);
+int munmap_inf(void *, size_t);
+ssize_t read_inf(int, void *, size_t);
+int inotify_init_inf();
 time_t time_inf(time_t *);
+int pthread_create_inf(pthread_t *, void *(*)(void *), void *);
 
 #endif
@@ -0,0 +1,50 @@
+#ifndef _LINK_SET_H
+#define _LINK_SET_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+struct dtree;
+
+/* Must be a power of two */
+#define LINK_SET_SHARDS 64
+
+struct link_key {
+	uint64_t dev;
+	uint64_t ino; /* Zero marks an empty slot */
+	/* The node its blocks are charged to, NULL once it's released */
+	const struct dtree *owner;
+};
+
+/*
+ * Open addressing table (with linear probing) of a part of the 
+ * keys. Each shard has its own lock, so the threads that insert
+ * into different shards don't wait for each other.
+ */
+struct link_shard {
+	pthread_mutex_t lock;
+	struct link_key *keys;
+	size_t cap; /* Power of two, zero until the first insert */
+	size_t count;
+};
+
+/*
+ * Set of the (device, inode) pairs of the already seen hard links, 
+ * each with the node that its blocks are charged to.
+ */
+struct link_set {
+	struct link_shard shards[LINK_SET_SHARDS];
+};
+
+int init_link_set(struct link_set *);
+void destroy_link_set(struct link_set *);
+int link_set_charge(struct link_set *, uint64_t, uint64_t,
+		    const struct dtree *, const struct dtree *);
+bool link_set_release(struct link_set *, uint64_t, uint64_t,
+		      const struct dtree *);
+bool link_set_take_over(struct link_set *, uint64_t, uint64_t,
+			const struct dtree *);
+
+#endif
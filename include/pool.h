@@ -0,0 +1,54 @@
+#ifndef _POOL_H
+#define _POOL_H
+
+#include <pthread.h>
+#include <stddef.h>
+
+struct pool_worker;
+
+/* A job handler returns zero on success and non-zero on failure */
+typedef int (*job_handler)(struct pool_worker *, void *);
+
+/*
+ * Double ended queue of pending jobs. The owner pushes and pops
+ * from the bottom while the other workers steal from the top.
+ */
+struct job_deque {
+	pthread_mutex_t lock;
+	void **jobs;
+	size_t cap;
+	size_t head;
+	size_t count;
+};
+
+struct pool_worker {
+	struct job_deque deque;
+	struct pool *pool;
+	pthread_t thread;
+	unsigned int seed;
+	int id;
+};
+
+/*
+ * A work-stealing pool of threads. Each worker owns a deque of
+ * jobs and steals from the others when it runs dry.
+ */
+struct pool {
+	struct pool_worker *workers;
+	int workers_num;
+	job_handler handler;
+	void *arg;
+	long pending; /* Pushed jobs that are not handled yet */
+	int failed; /* ERROR value of the first failed job */
+	pthread_mutex_t idle_lock;
+	pthread_cond_t idle_cond;
+	int idle;
+};
+
+int get_online_cpus();
+struct pool *alloc_pool(int, job_handler, void *);
+void free_pool(struct pool *);
+int pool_push(struct pool_worker *, void *);
+int pool_run(struct pool *);
+
+#endif
@@ -0,0 +1,56 @@
+#ifndef _RM_QUEUE_H
+#define _RM_QUEUE_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "structs.h"
+#include "disk.h"
+
+/* An entry's removal, from its queueing until it's settled */
+struct rm_job {
+	struct rm_job *next;
+	struct dtree *entry;
+	struct rm_progress progress;
+	int error; /* ERROR of the failed removal, else 0 */
+	/*
+	 * What is left of the entry after a failed removal, rescanned into
+	 * the job's arena. NULL when nothing is left or it can't be told.
+	 */
+	struct dtree *left;
+	int rescan_error; /* ERROR of the failed rescan, else 0 */
+	struct arena arena;
+};
+
+/*
+ * Removes the queued entries one after the other in its own thread,
+ * each one with rm_dtree(). The finished removals are left for the
+ * owner to settle into the dtree, the thread never touches the dtree
+ * itself apart from reading the queued entries' trees.
+ */
+struct rm_queue {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct rm_job *waiting; /* In the queueing order */
+	struct rm_job **waiting_tail;
+	struct rm_job *running; /* NULL when there's nothing to remove */
+	struct rm_job *done; /* Finished but not settled yet */
+	bool stop;
+	int threads; /* Of each removal */
+	struct scan_opts opts; /* Of the failed removals' rescans */
+	dev_t root_dev;
+	struct path_buf path_buf; /* The thread's own */
+};
+
+int init_rm_queue(struct rm_queue *, const struct scan_opts *, dev_t);
+void destroy_rm_queue(struct rm_queue *);
+int queue_rm_entry(struct rm_queue *, struct dtree *);
+const struct dtree *get_running_rm_progress(struct rm_queue *,
+					   struct rm_progress *);
+bool is_removing_under(struct rm_queue *, const struct dtree *);
+struct rm_job *get_done_rm_job(struct rm_queue *);
+void settle_rm_job(struct rm_queue *, struct rm_job *, struct arena *);
+void free_rm_job(struct rm_job *);
+
+#endif
@@ -0,0 +1,31 @@
+#ifndef _SEARCH_H
+#define _SEARCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "structs.h"
+
+#define NAME_INDEX_BITS 20
+#define NAME_INDEX_BUCKETS (1 << NAME_INDEX_BITS)
+#define NAME_QUERY_SIZE 256
+
+/*
+ * Trigram index of the tree's names. Each name's trigrams (case folded)
+ * are hashed into buckets, whose posting lists hold the ids of the names
+ * with any of the bucket's trigrams. A query's candidates are the ids in
+ * all of its trigrams' lists, they're matched against the query then, so
+ * the buckets' collisions don't matter.
+ */
+struct name_index {
+	struct dtree **nodes; /* In pre-order, a node's id is its index */
+	size_t num;
+	size_t *offsets; /* Of each bucket's list in the postings */
+	uint32_t *postings; /* Each bucket's ids, in ascending order */
+};
+
+int build_name_index(struct name_index *, const struct dtree *);
+void free_name_index(struct name_index *);
+size_t search_name_index(const struct name_index *, const char *,
+			 struct dtree **, size_t);
+
+#endif
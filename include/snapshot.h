@@ -0,0 +1,141 @@
+#ifndef _SNAPSHOT_H
+#define _SNAPSHOT_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include "structs.h"
+
+/*
+ * The snapshot's layout (all the integers are little endian):
+ *
+ *     header:  magic, u32 version
+ *     levels:  the directories' levels, every level is written after
+ *              the levels of its sub-directories (post-order)
+ *     strings: u32 count, u32 offsets[count + 1], the names' blob
+ *     footer:  u64 root level offset, u64 strings offset, magic
+ *
+ * A level is a varint entries count followed by its entries, which are
+ * stored contiguously and pre-sorted (the dot entries first and then by
+ * size in descending order). An entry is varints of its name's index,
+ * mode, size in 512 bytes blocks and zigzag encoded mtime, then a flags
+ * byte. A directory's entry goes on with varints of its files and sub-
+ * directories count and of its own level's offset plus one (zero when
+ * it has none), and then with its stamp (since version 2): varints of
+ * its device, inode, mtime's nanoseconds, zigzag encoded ctime and its
+ * nanoseconds, all zeros when it has none. A file with more than one
+ * hard link (DTREE_LINKED) goes on with varints of its device and inode
+ * (since version 3). The root's level only holds the root, whose name
+ * is the scanned path.
+ */
+#define SNAPSHOT_MAGIC "NCDASNAP"
+#define SNAPSHOT_MAGIC_LEN 8
+#define SNAPSHOT_VERSION 3
+#define SNAPSHOT_HEADER_SIZE (SNAPSHOT_MAGIC_LEN + 4)
+#define SNAPSHOT_FOOTER_SIZE (8 + 8 + SNAPSHOT_MAGIC_LEN)
+#define SNAPSHOT_BUF_SIZE (64 * 1024)
+
+/* The distinct names of the snapshot, every name is stored once */
+struct name_table {
+	const char **names; /* By index, pointing to the nodes' names */
+	uint32_t *slots; /* Open addressing of the indexes plus one */
+	size_t slots_num; /* Power of two */
+	uint32_t num;
+	uint64_t blob_size;
+};
+
+/* The levels' offsets (plus one) of the sub-directories */
+struct off_stack {
+	uint64_t *offs;
+	size_t num;
+	size_t cap;
+};
+
+/*
+ * Streaming writer, the levels are written out as soon as they're
+ * encoded so only the names are kept until the end.
+ */
+struct snapshot_writer {
+	FILE *fp;
+	uint64_t off; /* The offset of the next byte */
+	unsigned char buf[SNAPSHOT_BUF_SIZE];
+	size_t len;
+	struct name_table names;
+	struct off_stack offs;
+	/* The levels' entries in the written order */
+	const struct dtree **sorted;
+	size_t sorted_num;
+	size_t sorted_cap;
+};
+
+/* A mapped snapshot file */
+struct snapshot {
+	const char *path;
+	uint32_t version;
+	const unsigned char *base;
+	size_t size;
+	uint64_t root_off;
+	const unsigned char *name_offs;
+	const char *blob;
+	uint32_t names_num;
+	uint64_t blob_size;
+};
+
+/* A decoded entry of a level */
+struct snap_entry {
+	const char *name; /* Points into the mapped snapshot */
+	size_t name_len; /* Including the null byte */
+	uint64_t mode;
+	uint64_t blocks;
+	int64_t mtime;
+	unsigned char flags;
+	uint64_t files_num;
+	uint64_t dirs_num;
+	uint64_t child_off; /* Plus one, zero when there's no level */
+	/* All zeros when there's none, only the inode's for a linked file */
+	struct dtree_stamp stamp;
+};
+
+/* Bounds checked decoding position */
+struct snap_cursor {
+	const unsigned char *pos;
+	const unsigned char *end;
+};
+
+/* Sequential reader of a mapped snapshot's level */
+struct snap_iter {
+	const struct snapshot *snap;
+	struct snap_cursor cur;
+	uint64_t left; /* The entries that are not read yet */
+};
+
+/* A level of a mapped snapshot that is materialised while it's browsed */
+struct snap_level {
+	struct arena arena;
+	struct dtree *begin;
+	struct off_stack offs; /* By the entries' index */
+};
+
+/*
+ * Browser of a mapped snapshot. Only the levels from the root to the
+ * browsed directory are materialised, each out of its own arena.
+ */
+struct snap_view {
+	struct snapshot snap;
+	struct snap_level *levels;
+	size_t depth;
+	size_t cap;
+};
+
+int save_snapshot(const char *, const struct dtree *);
+struct dtree *load_snapshot(const char *, struct arena *);
+int open_snapshot(struct snapshot *, const char *);
+int close_snapshot(struct snapshot *);
+int init_snap_iter(struct snap_iter *, const struct snapshot *, uint64_t);
+int snap_iter_next(struct snap_iter *, struct snap_entry *);
+struct dtree *open_snap_view(struct snap_view *, const char *);
+struct dtree *snap_view_inward(struct snap_view *, struct dtree *);
+void snap_view_outward(struct snap_view *);
+void close_snap_view(struct snap_view *);
+
+#endif
@@ -0,0 +1,60 @@
+#ifndef _SORT_H
+#define _SORT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "structs.h"
+
+enum sort_key {
+	SORT_BY_SIZE = 0,
+	SORT_BY_NAME = 1,
+	SORT_BY_MTIME = 2,
+	SORT_BY_ITEMS = 3,
+	SORT_KEYS_NUM = 4
+};
+
+/* An entry with its sorting key, so the key isn't loaded from its node */
+struct sort_item {
+	uint64_t key;
+	struct dtree *node;
+};
+
+/*
+ * A directory's level in ascending order of each key, sorted only when
+ * it's first needed. The dot entries are left first in every order.
+ */
+struct sorted_level {
+	const struct dtree *dir; /* NULL marks an empty slot */
+	struct dtree **orders[SORT_KEYS_NUM];
+	size_t nums[SORT_KEYS_NUM];
+	size_t caps[SORT_KEYS_NUM];
+	/* The cache's generation each order was sorted in */
+	unsigned long gens[SORT_KEYS_NUM];
+};
+
+/*
+ * Open addressing table (with linear probing) of the sorted levels by
+ * their directories. Bumping the generation marks all the orders dirty,
+ * they're sorted again the next time they're needed.
+ */
+struct sort_cache {
+	struct sorted_level *levels;
+	size_t cap; /* Power of two */
+	size_t num;
+	unsigned long gen;
+	/* Reused for sorting */
+	struct sort_item *items;
+	struct sort_item *tmp;
+	size_t items_cap;
+	size_t tmp_cap;
+};
+
+int init_sort_cache(struct sort_cache *);
+void destroy_sort_cache(struct sort_cache *);
+const struct sorted_level *get_sorted_level(struct sort_cache *, 
+					    const struct dtree *, 
+					    enum sort_key);
+void forget_sorted_level(struct sort_cache *, const struct dtree *);
+void dirty_sort_cache(struct sort_cache *);
+
+#endif
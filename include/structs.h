@@ -1,40 +1,120 @@
 #ifndef _STRUCTS_H
 #define _STRUCTS_H
 
+#include <stdbool.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <time.h>
 
-/* File's data */
-struct fdata {
-        char *fname;
-        char *fpath;
-	off_t fsize;
-        struct stat *fstatus;
-};
-
-/* Ncurses data */
-struct cdata {
-	short cpair;
-	int y;
-	char eos; /* Equivalent to end of string */
-};
-
-struct entry_data {
-	struct fdata *file;
-	struct cdata *curses;
+/*
+ * The identity and the change times of a scanned directory, they tell
+ * whether its entries have changed since it was scanned.
+ */
+struct dtree_stamp {
+	dev_t dev;
+	ino_t ino;
+	struct timespec mtime;
+	struct timespec ctime;
 };
 
 /*
  * An data structure for the directories' tree.
  * It is some kind of a doubly linked list but with
  * an additional dtree structure as a child node.
+ *
+ * Every node is a single compact record with only the entry's 
+ * fields that ncda uses, followed by the entry's name. The color 
+ * pair and the end of string are derived from the mode. Paths are
+ * not stored, they are rebuilt from the parents when needed. The
+ * root node (the only one without a parent) holds the scanned path
+ * as its name.
  */
 struct dtree {
 	struct dtree *prev;
 	struct dtree *parent;
-	struct entry_data *data;
 	struct dtree *child;
 	struct dtree *next;
+	/* Scanned directories and DTREE_LINKED files only, else NULL */
+	struct dtree_stamp *stamp;
+	off_t fsize; /* The whole tree's size for directories */
+	time_t mtime;
+	mode_t mode;
+	unsigned int files_num; /* Number of files in a directory's tree */
+	unsigned int dirs_num; /* Number of sub-directories in its tree */
+	unsigned char flags;
+	char fname[];
+};
+
+/* Another file system's mount point, left unscanned */
+#define DTREE_MOUNT_POINT 0x01
+/* A hard link whose blocks were already charged through another link */
+#define DTREE_UNCHARGED 0x02
+/* Taken out of the tree after the scan, it's left in the arena */
+#define DTREE_DETACHED 0x04
+/* Queued for removal, its part of the totals is taken off already */
+#define DTREE_PENDING 0x08
+/* A file with more than one hard link, its stamp holds its inode */
+#define DTREE_LINKED 0x10
+
+/*
+ * The running scan's progress. It's updated by the scanner's workers 
+ * as the levels are read, and it can be polled by another thread.
+ */
+struct scan_progress {
+	struct dtree *root; /* NULL until the root is stat'ed */
+	unsigned long entries; /* The read entries, the dot entries aside */
+	off_t bytes; /* The charged size of the read files */
+};
+
+/* Directories' scanner options */
+struct scan_opts {
+	int threads; /* Zero or less means a thread per online CPU */
+	/* 
+	 * Number of statx requests each thread keeps in flight through 
+	 * io_uring, zero means stat'ing the entries one by one instead.
+	 */
+	unsigned int uring_depth;
+	/* Charge the blocks of a file with many hard links only once */
+	bool links_once;
+	/*
+	 * The hard links seen so far, kept by the caller across the scans
+	 * of the same tree so the later ones (of the new entries and the
+	 * rescans) don't charge a file twice. NULL means each scan keeps
+	 * its own.
+	 */
+	struct link_set *links;
+	/* Stay on the root's file system, like du -x */
+	bool one_fs;
+	/*
+	 * A previous snapshot of the same path, the directories that didn't
+	 * change since are taken from it instead of being read again. NULL
+	 * means a full scan.
+	 */
+	const char *prev_snap;
+	/* Updated as the scan goes, NULL when nobody follows it */
+	struct scan_progress *progress;
+};
+
+struct arena_chunk {
+	struct arena_chunk *next;
+	size_t size;
+	size_t used;
+	char data[];
+};
+
+/*
+ * Scan scoped memory. The nodes and their strings are carved out of
+ * big chunks, so they are freed all at once with the whole arena.
+ */
+struct arena {
+	struct arena_chunk *head; /* The chunk that is being carved */
+	struct arena_chunk *tail;
+};
+
+/* Reusable buffer for rebuilding the nodes' paths */
+struct path_buf {
+	char *buf;
+	size_t size;
 };
 
 struct size_format {
@@ -42,7 +122,21 @@ struct size_format {
 	char *unit;
 };
 
-void *alloc_dtree(size_t, size_t);
-void free_dtree(struct dtree *);
+void init_arena(struct arena *);
+void *arena_alloc(struct arena *, size_t);
+void merge_arena(struct arena *, struct arena *);
+void free_arena(struct arena *);
+void *alloc_dtree(struct arena *, size_t);
+void init_path_buf(struct path_buf *);
+void free_path_buf(struct path_buf *);
+const char *build_dtree_path(struct path_buf *, const struct dtree *);
+const char *build_entry_path(struct path_buf *, const struct dtree *, 
+			     const char *);
+bool is_flagged_dtree(const struct dtree *, unsigned char);
+bool is_detached_dtree(const struct dtree *);
+void add_dtree_totals(struct dtree *, const struct dtree *, int);
+void detach_dtree(struct dtree *);
+void insert_dtree(struct dtree *, struct dtree *, struct dtree *);
+void resize_dtree(struct dtree *, off_t);
 
 #endif
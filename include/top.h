@@ -0,0 +1,27 @@
+#ifndef _TOP_H
+#define _TOP_H
+
+#include <stddef.h>
+#include "structs.h"
+
+enum top_kind {
+	TOP_FILES = 0,
+	TOP_LEAF_DIRS = 1 /* The directories without sub-directories */
+};
+
+/*
+ * Bounded min-heap of the largest entries. The smallest kept entry is
+ * at the root, so a bigger one just replaces it when the heap is full.
+ */
+struct top_heap {
+	struct dtree **nodes;
+	size_t num;
+	size_t cap; /* The number of the kept entries */
+};
+
+int init_top_heap(struct top_heap *, size_t);
+void free_top_heap(struct top_heap *);
+void collect_top_entries(struct top_heap *, const struct dtree *,
+			 enum top_kind);
+
+#endif
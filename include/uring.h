@@ -0,0 +1,42 @@
+#ifndef _URING_H
+#define _URING_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <linux/io_uring.h>
+
+struct statx;
+
+/*
+ * A minimal io_uring instance. It's set up with the raw system calls,
+ * so ncda doesn't depend on liburing. Only a single thread may use it.
+ */
+struct uring {
+	int fd;
+	unsigned int sq_entries;
+	unsigned int sqe_tail; /* Prepared but not submitted yet */
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int *sq_mask;
+	unsigned int *sq_array;
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_ring;
+	void *cq_ring;
+	size_t sq_ring_size;
+	size_t cq_ring_size;
+};
+
+int init_uring(struct uring *, unsigned int, int);
+void destroy_uring(struct uring *);
+struct io_uring_sqe *uring_get_sqe(struct uring *);
+void uring_prep_statx(struct io_uring_sqe *, int, const char *, int, 
+		      unsigned int, struct statx *, uint64_t);
+int uring_submit_and_wait(struct uring *, unsigned int);
+struct io_uring_cqe *uring_peek_cqe(struct uring *);
+void uring_cqe_seen(struct uring *);
+
+#endif
@@ -0,0 +1,64 @@
+#ifndef _WATCH_H
+#define _WATCH_H
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <sys/statfs.h>
+#include "structs.h"
+
+#define WATCH_BUF_SIZE (64 * 1024)
+
+/*
+ * A watched directory. It's keyed by its inotify watch descriptor,
+ * or by its file system's id and its file handle with fanotify.
+ */
+struct watch_slot {
+	const unsigned char *key; /* NULL when the slot is empty */
+	size_t len;
+	struct dtree *node; /* NULL when it's not watched anymore */
+};
+
+/* Open addressing of the watched directories */
+struct watch_table {
+	struct watch_slot *slots;
+	size_t cap; /* Power of two */
+	size_t num;
+};
+
+/* A file system that fanotify marks as a whole, once */
+struct watch_fs {
+	dev_t dev;
+	fsid_t fsid;
+};
+
+/*
+ * Keeps the scanned tree up to date with the file system's changes.
+ * The events are applied to the affected directories' levels and
+ * their size deltas are added up to the root.
+ */
+struct dtree_watch {
+	int fd;
+	bool fanotify; /* Or inotify when fanotify isn't available */
+	bool lost; /* Events were lost, the tree might be stale */
+	/* The gone entries released hard links' charges (see apply_event()) */
+	bool released;
+	struct dtree *root;
+	dev_t root_dev;
+	struct scan_opts opts; /* Of the new directories' scans */
+	struct arena *arena; /* Of the new entries' nodes */
+	struct arena keys;
+	struct watch_table table;
+	struct watch_fs *fss;
+	size_t fss_num;
+	size_t fss_cap;
+	struct path_buf path_buf;
+	unsigned char *buf; /* The events' reading buffer */
+};
+
+int init_dtree_watch(struct dtree_watch *, struct dtree *,
+		     const struct scan_opts *, struct arena *);
+int apply_watch_events(struct dtree_watch *);
+void rewatch_dtree(struct dtree_watch *, struct dtree *);
+void destroy_dtree_watch(struct dtree_watch *);
+
+#endif
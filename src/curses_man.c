@@ -7,15 +7,33 @@
 ---------------------------------------------------------
 */
 
+/*
+ * Defining _GNU_SOURCE macro since it achives all the desired
+ * feature test macro requirements, which are:
+ *     1) _POSIX_C_SOURCE >= 199309L for clock_gettime()
+ */
+#define _GNU_SOURCE
+#include <time.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdint.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdbool.h>
 #include "disk.h"
 #include "general.h"
+#include "informative.h"
+#include "snapshot.h"
+#include "watch.h"
+#include "sort.h"
+#include "top.h"
+#include "rm_queue.h"
+#include "search.h"
 #include "curses_man.h"
 
 #define EOL -1
 #define NONE 0
+#define ESC 27
 
 
 /* Constant parameters */
@@ -31,8 +49,59 @@ const int _fname_init_x = 27;
 const int _max_fsize_len = 8;
 const int _max_mtime_len = 11;
 const int _min_y = 2;
-
-struct dtree *_highligted_node; 
+const int _watch_timeout_ms = 500;
+const int _scan_timeout_ms = 250;
+const int _rm_timeout_ms = 250;
+const int _top_entries_num = 100;
+const double _top_scan_refresh_secs = 3;
+const size_t _search_hits_num = 1000;
+
+/* The browsed level */
+struct viewport _view;
+/* The levels' cached orders, the browsed level is in the order of _sort_key */
+struct sort_cache _sort_cache;
+enum sort_key _sort_key = SORT_BY_SIZE;
+bool _sort_descending = true;
+/* The largest entries' view, the browsed level is left for it meanwhile */
+bool _top_view;
+enum top_kind _top_kind;
+struct top_heap _top_heap;
+struct dtree *_top_root;
+struct path_buf _top_path_buf; /* The listed entries' paths */
+/* Where the browser was, it's restored when the view is left */
+struct dtree *_top_prev;
+size_t _top_prev_top;
+size_t _top_prev_depth;
+/* The names' search, its hits are listed in the largest entries' view */
+bool _search_view;
+struct name_index _name_index;
+bool _name_index_stale; /* The dtree has changed since it was indexed */
+struct dtree **_search_hits;
+/* Reused for rebuilding the displayed directories' paths */
+struct path_buf _path_buf;
+/* The browsed snapshot, NULL when the dtree is fully materialised */
+struct snap_view *_snap_view;
+/* Keeps the dtree up to date, NULL when the dtree is frozen */
+struct dtree_watch *_watch;
+/* The scan of the browsed dtree, NULL once it's done */
+struct bg_scan *_bg_scan;
+/* The scan's progress when it was last displayed */
+unsigned long _last_entries;
+struct timespec _last_tick;
+/* The scan's progress when the largest entries were last collected */
+unsigned long _top_entries;
+struct timespec _top_tick;
+/* Removes the marked entries, NULL when nothing can be removed */
+struct rm_queue *_rm_queue;
+struct arena *_rm_arena; /* Of what's left of the failed removals */
+size_t _rm_jobs_num; /* The unsettled removals */
+/* The last settled removal's outcome, until it's displayed over */
+char _rm_report[256];
+/* Of the rescanned entries, NULL arena when nothing can be rescanned */
+struct scan_opts _rescan_opts;
+struct arena *_rescan_arena;
+/* The held back errors (see hold_errors()) that were displayed */
+unsigned long _errors_num;
 
 
 static inline int print_separator(WINDOW *wp, int y, int x)
@@ -62,13 +131,9 @@ static inline int dye_fsize(WINDOW *wp, int y)
 	return dye_val(wp, y, _fsize_init_x, max_val_len);
 }
 
-static int print_fsize(WINDOW *wp, int y, off_t bytes)
+static int print_fsize(WINDOW *wp, int y, const char *fsize_str)
 {
-	struct size_format format;
-
-	format = get_proper_size_format(bytes);
-
-	if (mvwprintw(wp, y, _fsize_init_x, "%5.1f %s", format.val, format.unit) == ERR)
+	if (mvwaddstr(wp, y, _fsize_init_x, fsize_str) == ERR)
 		return -1;
 	if (COLORED_OUTPUT)
 		if (dye_fsize(wp, y))
@@ -83,24 +148,9 @@ static inline int dye_mtime(WINDOW *wp, int y)
 	return dye_val(wp, y, _mtime_init_x, max_val_len);
 }
 
-static int print_mtime_buffer(WINDOW *wp, int y, char *buffer)
-{
-	int ret;
-
-	ret = mvwprintw(wp, y, _mtime_init_x, "%s", buffer);
-	free(buffer);
-
-	return (ret == ERR) ? -1 : 0;
-}
-
-static int print_mtime(WINDOW *wp, int y, time_t mtime)
+static int print_mtime(WINDOW *wp, int y, const char *mtime_str)
 {
-	char *buffer;
-
-	if(!(buffer = get_mtime_str(mtime)))
-		return -1;
-	/* print_mtime_buffer() will take care of freeing the buffer */
-	if (print_mtime_buffer(wp, y, buffer))
+	if (mvwaddstr(wp, y, _mtime_init_x, mtime_str) == ERR)
 		return -1;
 	if (COLORED_OUTPUT)
 		if (dye_mtime(wp, y))
@@ -115,7 +165,11 @@ static inline int dye_fname(WINDOW *wp, int y, short cpair)
 
 static int print_fname(WINDOW *wp, int y, const char *name, char eos, short cpair)
 {
-	if (mvwprintw(wp, y, _fname_init_x, "%s%c", name, eos) == ERR)
+	/* Cut at the line's end, the next row isn't always drawn again */
+	const int len = getmaxx(wp) - _fname_init_x - 1;
+
+	if (len > 0 && (mvwaddnstr(wp, y, _fname_init_x, name, len) == ERR ||
+			waddch(wp, eos) == ERR))
 		return -1;
 	if (COLORED_OUTPUT)
 		if (dye_fname(wp, y, cpair))
@@ -134,32 +188,82 @@ static int print_separators_only(WINDOW *wp, int y)
 	return (print_separator(wp, y, x1) || print_separator(wp, y, x2)) ? -1 : 0;
 }
 
-static inline int print_entry_size(WINDOW *wp, const struct dtree *node, int y)
+static inline size_t get_format_i(const struct dtree *node)
 {
-	const off_t size = node->data->file->fsize;
+	uint64_t h;
 
-	return print_fsize(wp, y, size);
+	/* The nodes are at least 8 bytes aligned */
+	h = ((uintptr_t) node >> 3) * 0x9e3779b97f4a7c15ULL;
+
+	return (h >> 32) & (VIEW_FORMATS_NUM - 1);
 }
 
-static inline int print_entry_mtime(WINDOW *wp, const struct dtree *node, int y)
+/*
+ * Get the node's formatted size and age, they're formatted 
+ * only when the cached ones don't match the node anymore.
+ */
+static const struct entry_format *get_entry_format(const struct dtree *node)
 {
-	const time_t mtime = node->data->file->fstatus->st_mtim.tv_sec;
+	struct entry_format *format;
+	struct size_format size;
+	bool is_same_node;
+
+	format = &_view.formats[get_format_i(node)];
+	is_same_node = (format->node == node);
+
+	if (!is_same_node || format->fsize != node->fsize) {
+		size = get_proper_size_format(node->fsize);
+		snprintf(format->fsize_str, FSIZE_STR_SIZE, "%5.1f %s", 
+			 size.val, size.unit);
+		format->fsize = node->fsize;
+	}
+	if (!is_same_node || format->mtime != node->mtime || 
+	    _view.now >= format->stale) {
+		format->stale = format_mtime(format->mtime_str, MTIME_STR_SIZE,
+					     node->mtime, _view.now);
+		format->mtime = node->mtime;
+	}
+	format->node = node;
+
+	return format;
+}
 
-	return print_mtime(wp, y, mtime);
+static inline int print_entry_mtime(WINDOW *wp, const struct dtree *node, 
+				    const struct entry_format *format, int y)
+{
+	/* A pending removal is shown in place of the mtime */
+	if (node->flags & DTREE_PENDING)
+		return (mvwprintw(wp, y, _mtime_init_x, "%-*s", 
+				  _max_mtime_len, "deleting") == ERR) ? -1 : 0;
+	return print_mtime(wp, y, format->mtime_str);
 }
 
 static int print_entry_info(WINDOW *wp, const struct dtree *node, int y)
 {
-	return (print_entry_size(wp, node, y) || print_entry_mtime(wp, node, y)) ? -1 : 0;
+	const struct entry_format *format;
+
+	format = get_entry_format(node);
+
+	return (print_fsize(wp, y, format->fsize_str) || 
+		print_entry_mtime(wp, node, format, y)) ? -1 : 0;
+}
+
+/*
+ * The largest entries' view lists the entries by their whole paths
+ */
+static inline const char *get_displayed_name(const struct dtree *node)
+{
+	return _top_view ? build_dtree_path(&_top_path_buf, node) : node->fname;
 }
 
-static int display_entries_info(WINDOW *wp, const struct dtree *node)
+static int display_entries_info(WINDOW *wp, const struct dtree *node, int y)
 {
-	const short color_pair = node->data->curses->cpair;
-	const char *const name = node->data->file->fname;
-	const char eos = node->data->curses->eos;
-	const int y = node->data->curses->y;
-	
+	const short color_pair = get_proper_cpair(node->mode);
+	const char eos = get_proper_eos(node);
+	const char *name;
+
+	if (!(name = get_displayed_name(node)))
+		return -1;
 	if (!is_dot_entry(name)) {
 		if (print_entry_info(wp, node, y))
 			return -1;
@@ -177,25 +281,16 @@ static int get_max_practical_y(WINDOW *wp)
 	return (getmaxy(wp) - skipped_lines);
 }
 
-static bool is_between_page_borders(WINDOW *wp, int current_y)
+static inline size_t get_rows_num(WINDOW *wp)
 {
-	return (_min_y <= current_y) && (get_max_practical_y(wp) >= current_y);
+	const int rows = get_max_practical_y(wp) - _min_y + 1;
+
+	return (rows > 0) ? rows : 1;
 }
 
-int display_entries(WINDOW *wp, const struct dtree *ptr) 
+static inline struct dtree *get_highlighted_node()
 {
-	const struct dtree *current;
-	int retval;
-
-	retval = 0;
-
-	for (current=ptr; current; current=current->next) {
-		if (!is_between_page_borders(wp, current->data->curses->y))
-			break;
-		if ((retval = display_entries_info(wp, current)))
-			break;
-	}
-	return retval;
+	return _view.entries[_view.cursor];
 }
 
 static int init_color_pairs()
@@ -225,7 +320,8 @@ static int start_color_if_supported()
 
 static int init_local_setup(WINDOW *wp)
 {
-	return (keypad(wp, TRUE) == ERR || 
+	/* idlok() lets the scrolled rows be moved by the terminal itself */
+	return (keypad(wp, TRUE) == ERR || idlok(wp, TRUE) == ERR ||
 		wattrset(wp, _def_attrs) == ERR) ? -1 : 0;
 }
 
@@ -239,7 +335,10 @@ static int invisibilize_cursor()
 
 int nc_init_setup()
 {
-	return (start_color_if_supported() || 
+	hold_errors(true);
+
+	return (init_sort_cache(&_sort_cache) ||
+		start_color_if_supported() || 
 		cbreak() == ERR || noecho() == ERR || 
 		invisibilize_cursor() || 
 		init_local_setup(stdscr)) ? -1 : 0;
@@ -287,7 +386,7 @@ static int print_usage_summary(WINDOW *wp, int y, int max_x, const struct dtree
 	struct size_format format;
 	size_t len;
 
-	format = get_proper_size_format(get_dtree_disk_usage(begin));
+	format = get_proper_size_format(get_dtree_disk_usage(begin->parent));
 	/* The 1 is because I added another digit after the floating point */
 	len = strlen(message) + _blank + (_max_fsize_len + 1);
 
@@ -321,13 +420,25 @@ static int display_summary_message(WINDOW *wp,
 		return dye_bg(wp, max_y, begin_x, EOL, _def_attrs, cpair);
 }
 
+static const char *get_name_label()
+{
+	if (!_top_view)
+		return "Entry's name";
+	else if (_search_view)
+		return "Matching entries";
+	else if (_top_kind == TOP_FILES)
+		return "Largest files";
+	else
+		return "Largest leaf directories";
+}
+
 static int print_lables(WINDOW *wp, int y)
 {
 	const int begin_x = 3;
 
 	return (mvwprintw(wp, y, begin_x, "Size") == ERR ||
 		mvwprintw(wp, y, _mtime_init_x, "Modification") == ERR ||
-		mvwprintw(wp, y, _fname_init_x, "Entry's name") == ERR) ? -1 : 0;
+		mvwprintw(wp, y, _fname_init_x, "%s", get_name_label()) == ERR) ? -1 : 0;
 }
 
 static int print_labels_colorful(WINDOW *wp, int y)
@@ -385,10 +496,12 @@ static inline int undye_bg(WINDOW *wp, int y, int x, int len)
 	return (mvwchgat(wp, y, x, len, _def_attrs, DEFAULT_PAIR, NULL) == ERR) ? -1 : 0;
 }
 
-static int restore_prev_entry_design(WINDOW *wp)
+/*
+ * Restore the design of the node's row after it was highlighted 
+ */
+static int restore_entry_design(WINDOW *wp, const struct dtree *node, int y)
 {
-	const short cpair = _highligted_node->prev->data->curses->cpair;
-	const int y = _highligted_node->prev->data->curses->y;
+	const short cpair = get_proper_cpair(node->mode);
 	const int begin_x = 0;
 	
 	if (undye_bg(wp, y, begin_x, EOL))
@@ -399,60 +512,198 @@ static int restore_prev_entry_design(WINDOW *wp)
 		return 0;
 }
 
-static int restore_next_entry_design(WINDOW *wp)
+/*
+ * What the r'th row should be drawn with now
+ */
+static struct view_row get_view_row(size_t r)
+{
+	const size_t i = _view.top + r;
+	const struct entry_format *format;
+	struct view_row row;
+
+	memset(&row, 0, sizeof(row));
+	row.drawn = true;
+
+	if (i >= _view.num)
+		return row;
+	row.node = _view.entries[i];
+	format = get_entry_format(row.node);
+	row.fsize = format->fsize;
+	row.mtime = format->mtime;
+	row.stale = format->stale;
+	row.pending = row.node->flags & DTREE_PENDING;
+	row.top_view = _top_view;
+	row.highlighted = (i == _view.cursor);
+
+	return row;
+}
+
+static inline bool is_same_content(const struct view_row *a, 
+				   const struct view_row *b)
+{
+	return a->node == b->node && a->fsize == b->fsize && 
+	       a->mtime == b->mtime && a->stale == b->stale && 
+	       a->pending == b->pending && a->top_view == b->top_view;
+}
+
+static inline int clear_line(WINDOW *wp, int y)
 {
-	const short cpair = _highligted_node->next->data->curses->cpair;
-	const int y = _highligted_node->next->data->curses->y;
 	const int begin_x = 0;
-	
-	if (undye_bg(wp, y, begin_x, EOL))
-		return -1;
-	if (COLORED_OUTPUT)
-		return restore_entry_colors(wp, y, cpair);
-	else 
-		return 0;
+
+	return (wmove(wp, y, begin_x) == ERR || wclrtoeol(wp) == ERR) ? -1 : 0;
 }
 
-static inline int restore_entry_design(WINDOW *wp, int key)
+/*
+ * Draw the row at y again, only the highlight is changed 
+ * when the row's content is the same as the drawn one.
+ */
+static int draw_row(WINDOW *wp, int y, const struct view_row *drawn,
+		    const struct view_row *row)
 {
-	if (key == KEY_DOWN)
-		return restore_prev_entry_design(wp);
+	const int begin_x = 0;
+
+	if (!drawn->drawn || !is_same_content(drawn, row)) {
+		if (clear_line(wp, y))
+			return -1;
+		if (!row->node)
+			return 0;
+		if (display_entries_info(wp, row->node, y))
+			return -1;
+	}
+	if (row->highlighted)
+		return dye_bg(wp, y, begin_x, EOL, _def_attrs, DEFAULT_PAIR);
+	else if (drawn->drawn && drawn->highlighted && row->node)
+		return restore_entry_design(wp, row->node, y);
 	else
-		return restore_next_entry_design(wp);
+		return 0;
 }
 
 /*
- * Manage highlight operation
+ * Forget what the rows were drawn with, e.g. once the window is erased
  */
-static int man_highlight_operation(WINDOW *wp, int key)
+static inline void forget_view_rows()
 {
-	const int y = _highligted_node->data->curses->y;
-	const int begin_x = 0;
+	_view.rows_num = 0;
+}
+
+/*
+ * Display the rows of the viewport from its top entry, only the rows
+ * that don't match their entries anymore are drawn again.
+ */
+static int display_entries(WINDOW *wp) 
+{
+	const size_t rows = get_rows_num(wp);
+	struct view_row row;
+	size_t r;
 
-	if (dye_bg(wp, y, begin_x, EOL, _def_attrs, DEFAULT_PAIR))
+	/* The entries' ages are all taken at the same time */
+	if ((_view.now = time_inf(NULL)) == -1)
 		return -1;
-	if (restore_entry_design(wp, key))
+	if (reserve_array((void **) &_view.rows, &_view.rows_cap, 
+			  rows, sizeof(struct view_row)))
 		return -1;
-	else
-		return (wrefresh(wp) == ERR) ? -1 : 0;
+	if (_view.rows_num != rows) {
+		memset(_view.rows, 0, rows * sizeof(struct view_row));
+		_view.rows_num = rows;
+	}
+	for (r=0; r<rows; r++) {
+		row = get_view_row(r);
+
+		if (_view.rows[r].drawn && 
+		    is_same_content(&_view.rows[r], &row) &&
+		    _view.rows[r].highlighted == row.highlighted)
+			continue;
+		if (draw_row(wp, _min_y + r, &_view.rows[r], &row))
+			return -1;
+		_view.rows[r] = row;
+	}
+	return 0;
 }
 
-static int highlight_entry(WINDOW *wp, struct dtree *node)
+/*
+ * Scroll the drawn rows by n rows (up when n is positive), the rows
+ * that are scrolled in are left to be drawn. With idlok() the terminal
+ * scrolls its region instead of having all the rows sent again.
+ */
+static int scroll_view_rows(WINDOW *wp, long n)
 {
-	const int y = node->data->curses->y;
-	const int begin_x = 0;
+	const size_t rows = _view.rows_num;
+	const size_t shift = (n < 0) ? -n : n;
 
-	if (dye_bg(wp, y, begin_x, EOL, _def_attrs, DEFAULT_PAIR))
+	/* Nothing to keep, all the rows are drawn anyway */
+	if (rows != get_rows_num(wp) || shift >= rows)
+		return 0;
+	if (wsetscrreg(wp, _min_y, _min_y + rows - 1) == ERR || 
+	    scrollok(wp, TRUE) == ERR || wscrl(wp, n) == ERR || 
+	    scrollok(wp, FALSE) == ERR)
 		return -1;
-	else
-		return (wrefresh(wp) == ERR) ? -1 : 0;
+
+	if (n > 0) {
+		memmove(_view.rows, _view.rows + shift, 
+			(rows - shift) * sizeof(struct view_row));
+		memset(_view.rows + rows - shift, 0, 
+		       shift * sizeof(struct view_row));
+	} else {
+		memmove(_view.rows + shift, _view.rows, 
+			(rows - shift) * sizeof(struct view_row));
+		memset(_view.rows, 0, shift * sizeof(struct view_row));
+	}
+	return 0;
 }
 
-static inline int init_highlight(WINDOW *wp, struct dtree *begin)
+/*
+ * Index the directory's level into the viewport in the current order, 
+ * the viewport's top and cursor are left to the caller. The cached 
+ * ascending order is copied, or reversed apart from the dot entries.
+ * The rows are forgotten when it's another level, since its nodes might
+ * be where the previous level's nodes were (e.g. a snapshot's levels are
+ * freed once they're left).
+ */
+static int load_view_level(const struct dtree *dir)
 {
-	_highligted_node = begin;
-	
-	return highlight_entry(wp, begin);
+	const struct sorted_level *level;
+	struct dtree *const *order;
+	size_t i, dots_num;
+
+	if (!(level = get_sorted_level(&_sort_cache, dir, _sort_key)))
+		return -1;
+	order = level->orders[_sort_key];
+	_view.num = level->nums[_sort_key];
+
+	if (dir != _view.dir) {
+		forget_view_rows();
+		_view.dir = dir;
+	}
+
+	if (reserve_array((void **) &_view.entries, &_view.cap,
+			  _view.num, sizeof(struct dtree *)))
+		return -1;
+	for (dots_num=0; dots_num<_view.num; dots_num++)
+		if (!is_dot_entry(order[dots_num]->fname))
+			break;
+	for (i=0; i<_view.num; i++)
+		_view.entries[i] = (_sort_descending && i >= dots_num) ? 
+				   order[_view.num - 1 - (i - dots_num)] :
+				   order[i];
+	return 0;
+}
+
+/*
+ * The summary is of the highlighted node's directory, or of 
+ * the whole tree in the largest entries' view.
+ */
+static inline const struct dtree *get_summary_entry()
+{
+	return _top_view ? _top_root->child : get_highlighted_node();
+}
+
+static int redisplay_view(WINDOW *wp, const char *current_path)
+{
+	return (display_opening_message(wp) || print_borders(wp) ||
+		display_labels(wp) || display_entries(wp) || 
+		display_summary_message(wp, get_summary_entry(), 
+					current_path) ||
+		wrefresh(wp) == ERR) ? -1 : 0;
 }
 
 /*
@@ -460,10 +711,13 @@ static inline int init_highlight(WINDOW *wp, struct dtree *begin)
  */
 int nc_initial_display(WINDOW *wp, struct dtree *begin, const char *current_path)
 {
-	return (display_opening_message(wp) || print_borders(wp) ||
-		display_labels(wp) || display_entries(wp, begin) || 
-		display_summary_message(wp, begin, current_path) ||
-		init_highlight(wp, begin)) ? -1 : 0;
+	if (load_view_level(begin->parent))
+		return -1;
+	_view.top = 0;
+	_view.cursor = 0;
+	forget_view_rows();
+
+	return redisplay_view(wp, current_path);
 }
 
 static int del_and_null_win(WINDOW **wp)
@@ -489,229 +743,454 @@ WINDOW *nc_newwin(int lines_num, int cols_num, int begin_y, int begin_x)
 	return wp;
 }
 
+/*
+ * Get the directory that contains the node, unless it's the root 
+ * which only holds the scanned path and can't be displayed.
+ */
 static struct dtree *get_parent(struct dtree *ptr)
 {
-	struct dtree *current, *node; 
+	struct dtree *parent;
 
-	node = NULL;
+	parent = ptr->parent;
 
-	for (current=ptr; current; current=current->prev)
-		node = current;
-	return node->parent;
+	return (parent && parent->parent) ? parent : NULL;
 }
 
 /*
- * Returns the address of the node with the minumum y that can be displayed 
+ * Get the index of the node in the viewport's level, 
+ * the level's beginning when it's not there.
  */
-static struct dtree *decrease_prev_y()
+static size_t get_entry_index(const struct dtree *node)
 {
-	struct dtree *current, *retval;
+	size_t i;
 
-	retval = NULL;
-
-	for (current=_highligted_node->prev; current; current=current->prev) {
-		current->data->curses->y -= 1;
-		
-		if (current->data->curses->y == _min_y)
-			retval = current;
-	}
-	return retval;
+	for (i=0; i<_view.num; i++)
+		if (_view.entries[i] == node)
+			return i;
+	return 0;
 }
 
-static inline void decrease_next_y()
+/*
+ * Move the viewport's top the least so that the cursor is displayed, 
+ * returns true if the top has moved.
+ */
+static bool scroll_to_cursor(WINDOW *wp)
 {
-	struct dtree *current;
+	const size_t rows = get_rows_num(wp);
+	const size_t top = _view.top;
 
-	for (current=_highligted_node->next; current; current=current->next)
-		current->data->curses->y -= 1;
+	if (_view.cursor < _view.top)
+		_view.top = _view.cursor;
+	else if (_view.cursor - _view.top >= rows)
+		_view.top = _view.cursor - rows + 1;
+
+	return _view.top != top;
 }
 
 /*
- * Returns the fisrt node then needs to be displayed on the screen
+ * Highlight the level's i'th entry instead, the drawn rows are scrolled
+ * along with the top so only the rows scrolled in are drawn.
  */
-static struct dtree *decrease_nodes_y()
+static int move_cursor(WINDOW *wp, size_t i)
+{
+	const size_t prev_top = _view.top;
+
+	_view.cursor = i;
+
+	if (scroll_to_cursor(wp) && 
+	    scroll_view_rows(wp, (long) _view.top - (long) prev_top))
+		return -1;
+
+	return (display_entries(wp) || wrefresh(wp) == ERR) ? -1 : 0;
+}
+
+static int navigate_upward(WINDOW *wp)
+{
+	return _view.cursor ? move_cursor(wp, _view.cursor - 1) : 0;
+}
+
+static int navigate_downward(WINDOW *wp)
+{
+	return (_view.cursor + 1 < _view.num) ? 
+		move_cursor(wp, _view.cursor + 1) : 0;
+}
+
+static int navigate_page_up(WINDOW *wp)
 {
-	/* Decrease the currently highlighted node's y*/
-	_highligted_node->data->curses->y -= 1;
-	decrease_next_y();
+	const size_t rows = get_rows_num(wp);
 
-	return decrease_prev_y();
+	return move_cursor(wp, (_view.cursor > rows) ? _view.cursor - rows : 0);
 }
 
-static inline void increase_prev_y()
+static int navigate_page_down(WINDOW *wp)
 {
-	struct dtree *current;
+	const size_t rows = get_rows_num(wp);
+	const size_t last_i = _view.num - 1;
 
-	for (current=_highligted_node->prev; current; current=current->prev)
-		current->data->curses->y += 1;
+	return move_cursor(wp, (last_i - _view.cursor > rows) ? 
+			   _view.cursor + rows : last_i);
 }
 
-static inline void increase_next_y()
+static inline int navigate_home(WINDOW *wp)
 {
-	struct dtree *current;
+	return move_cursor(wp, 0);
+}
 
-	for (current=_highligted_node->next; current; current=current->next)
-		current->data->curses->y += 1;
+static inline int navigate_end(WINDOW *wp)
+{
+	return move_cursor(wp, _view.num - 1);
 }
 
 /*
- * Returns the fisrt node then needs to be displayed on the screen
+ * Remember the left level's top, it's restored on the way back out
  */
-static struct dtree *increase_nodes_y()
+static int push_view_top()
 {
-	/* Increase the currently highlighted node's y*/
-	_highligted_node->data->curses->y += 1;
-	increase_prev_y();
-	increase_next_y();
+	if (reserve_array((void **) &_view.tops, &_view.tops_cap,
+			  _view.depth + 1, sizeof(size_t)))
+		return -1;
+	_view.tops[_view.depth++] = _view.top;
 
-	return _highligted_node;;
+	return 0;
 }
 
-static int clear_displayed_entries(WINDOW *wp)
+static inline size_t pop_view_top()
 {
-	const char blank = ' ';
-	const int begin_x = 0;
-	int y, retval;
-	
-	retval = 0;
-
-	for (y=_min_y; y<=get_max_practical_y(wp); y++)
-		if ((retval = mvwhline(wp, y, begin_x , blank, getmaxx(wp))) == ERR)
-			break;
-	return retval;
+	return _view.depth ? _view.tops[--_view.depth] : 0;
 }
 
 /*
- * Get the entry with the minimum displayed y i.e 2
+ * Clear the lines around the viewport's rows
  */
-static struct dtree *get_first_displayed_entry(struct dtree *ptr)
+static int clear_frame(WINDOW *wp)
 {
-	struct dtree *current;
+	const int max_y = getmaxy(wp);
 
-	for (current=ptr; current; current=current->prev)
-		if (current->data->curses->y == _min_y)
-			break;
-	return current;
+	return (clear_line(wp, 0) || clear_line(wp, 1) || 
+		clear_line(wp, max_y - 2) || clear_line(wp, max_y - 1)) ? -1 : 0;
 }
 
-static inline int recreate_prev_display(WINDOW *wp, 
-				 	const struct dtree *first_entry, 
-				 	const char *path)
+/*
+ * Display the viewport's level again. The frame is drawn from scratch,
+ * but only the rows that changed are, so e.g. navigating into a level 
+ * doesn't have the whole screen sent again.
+ */
+static int recreate_prev_display(WINDOW *wp)
 {
-	return (display_opening_message(wp) || print_borders(wp) ||
-		display_labels(wp) || display_entries(wp, first_entry) || 
-		display_summary_message(wp, first_entry, path) ||
-		highlight_entry(wp, _highligted_node)) ? -1 : 0;
+	const char *path;
+
+	if (clear_frame(wp))
+		return -1;
+	if (!(path = build_dtree_path(&_path_buf, 
+				      get_summary_entry()->parent)))
+		return -1;
+
+	return redisplay_view(wp, path);
 }
 
-static inline bool is_available_node(const struct dtree *node)
+/*
+ * Find the nearest node that is still in the tree. A detached node's
+ * previous node is where it was, at least the level's dot entry.
+ */
+static struct dtree *get_attached_node(struct dtree *node)
 {
-	return node ? 1 : 0;
+	struct dtree *current, *detached;
+
+	do {
+		detached = NULL;
+
+		/* The highest detached one, its level is still there */
+		for (current=node; current; current=current->parent)
+			if (current->flags & DTREE_DETACHED)
+				detached = current;
+		if (detached)
+			node = detached->prev;
+	} while (detached);
+
+	return node;
 }
 
-static int _navigate_upward(WINDOW *wp)
+/*
+ * The number of levels above the node's level
+ */
+static size_t get_level_depth(const struct dtree *node)
 {
-	struct dtree *begin;
-	
-	begin = _highligted_node = _highligted_node->prev;
+	size_t depth;
 
-	if (!is_between_page_borders(wp, _highligted_node->data->curses->y)) {
-		begin = increase_nodes_y();
-		
-		if (clear_displayed_entries(wp) || display_entries(wp, begin))
-			return -1;
-	}
-	return man_highlight_operation(wp, KEY_UP);
+	/* The first level's parent is the root */
+	for (depth=0; node->parent->parent; node=node->parent)
+		depth++;
+	return depth;
 }
 
-static int navigate_upward(WINDOW *wp)
+/*
+ * Browse the node's level with the node highlighted, in the current
+ * order and with its entries' current keys.
+ */
+static int show_node(WINDOW *wp, struct dtree *node)
 {
-	int retval;
+	if (load_view_level(node->parent))
+		return -1;
+	_view.cursor = get_entry_index(node);
+	scroll_to_cursor(wp);
 
-	if ((retval = is_available_node(_highligted_node->prev)))
-		retval = _navigate_upward(wp);
-	return retval;
+	return recreate_prev_display(wp);
 }
 
-static int _navigate_downward(WINDOW *wp)
+static struct dtree *get_root_node(struct dtree *node)
 {
-	struct dtree *begin;
-	
-	begin = _highligted_node = _highligted_node->next;
+	while (node->parent)
+		node = node->parent;
+	return node;
+}
 
-	if (!is_between_page_borders(wp, _highligted_node->data->curses->y)) {
-		begin = decrease_nodes_y();
-		
-		if (clear_displayed_entries(wp) || display_entries(wp, begin))
-			return -1;
+/*
+ * Keep where the browser is, unless it's already kept for the view
+ */
+static void keep_browser_place()
+{
+	if (!_top_view) {
+		_top_prev = get_highlighted_node();
+		_top_prev_top = _view.top;
+		_top_prev_depth = _view.depth;
 	}
-	return man_highlight_operation(wp, KEY_DOWN);
 }
 
-static int navigate_downward(WINDOW *wp)
+/*
+ * Index the largest entries into the viewport, in descending order
+ */
+static int load_top_entries()
 {
-	int retval;
+	if (reserve_array((void **) &_view.entries, &_view.cap,
+			  _top_heap.num, sizeof(struct dtree *)))
+		return -1;
+	memcpy(_view.entries, _top_heap.nodes, 
+	       _top_heap.num * sizeof(struct dtree *));
+	_view.num = _top_heap.num;
 
-	if ((retval = is_available_node(_highligted_node->next)))
-		retval = _navigate_downward(wp);
-	return retval;
+	return 0;
 }
 
-static int _navigate_outward(WINDOW *wp)
+/*
+ * List the largest entries of the kind in the whole tree instead of 
+ * the browsed level. A snapshot's view isn't searched, since only its
+ * browsed levels are materialised. Nothing happens without any entry.
+ */
+static int open_top_view(WINDOW *wp, enum top_kind kind)
 {
-	struct dtree *begin;
-	char *path;
-	int retval;
+	struct dtree *root;
 
-	begin = _highligted_node = get_parent(_highligted_node);
+	if (_snap_view)
+		return 0;
+	if (!_top_heap.nodes && init_top_heap(&_top_heap, _top_entries_num))
+		return -1;
 
-	if (begin->data->curses->y != _min_y)
-		begin = get_first_displayed_entry(_highligted_node);
-	if (werase(wp) == ERR)
+	root = get_root_node(get_highlighted_node());
+	collect_top_entries(&_top_heap, root, kind);
+
+	if (!_top_heap.num)
+		return 0;
+	keep_browser_place();
+	_view.dir = NULL;
+	_top_view = true;
+	_search_view = false;
+	_top_kind = kind;
+	_top_root = root;
+
+	if (load_top_entries())
 		return -1;
-	if (!(path = extract_dir_path(begin->data->file->fpath)))
+	_view.top = 0;
+	_view.cursor = 0;
+
+	return recreate_prev_display(wp);
+}
+
+/*
+ * Go back to where the browser was, or as near as the tree allows
+ */
+static int leave_top_view(WINDOW *wp)
+{
+	struct dtree *node;
+	size_t depth;
+
+	_top_view = false;
+	_search_view = false;
+	node = get_attached_node(_top_prev);
+	_view.top = _top_prev_top;
+	_view.depth = _top_prev_depth;
+
+	if ((depth = get_level_depth(node)) < _view.depth) {
+		_view.top = _view.tops[depth];
+		_view.depth = depth;
+	}
+	return show_node(wp, node);
+}
+
+static int toggle_top_view(WINDOW *wp, enum top_kind kind)
+{
+	if (_top_view && !_search_view && _top_kind == kind)
+		return leave_top_view(wp);
+	else
+		return open_top_view(wp, kind);
+}
+
+/*
+ * Browse the highlighted entry's level, the levels above it 
+ * are displayed from their tops on the way out.
+ */
+static int jump_to_top_entry(WINDOW *wp)
+{
+	struct dtree *node;
+	size_t depth;
+
+	node = get_highlighted_node();
+	depth = get_level_depth(node);
+
+	if (reserve_array((void **) &_view.tops, &_view.tops_cap,
+			  depth, sizeof(size_t)))
 		return -1;
-		
-	retval = recreate_prev_display(wp, begin, path);
-	free(path);
+	for (_view.depth=0; _view.depth<depth; _view.depth++)
+		_view.tops[_view.depth] = 0;
+	_view.top = 0;
+	_top_view = false;
+	_search_view = false;
 
-	return retval;
+	return show_node(wp, node);
 }
 
-static int navigate_outward(WINDOW *wp)
+/*
+ * Drop the hits that aren't in the tree anymore, keeping the highlighted
+ * one highlighted if it's still there. The new entries are only found 
+ * by the next search.
+ */
+static int refresh_search_view(WINDOW *wp)
 {
-	int retval;
+	struct dtree *node;
+	size_t i, num;
 
-	if ((retval = is_available_node(get_parent(_highligted_node))))
-		retval = _navigate_outward(wp);
-	return retval;
+	node = get_highlighted_node();
+
+	for (i=0, num=0; i<_view.num; i++)
+		if (!is_flagged_dtree(_view.entries[i], 
+				      DTREE_DETACHED | DTREE_PENDING))
+			_view.entries[num++] = _view.entries[i];
+	if (!(_view.num = num))
+		return leave_top_view(wp);
+	_view.cursor = get_entry_index(node);
+	scroll_to_cursor(wp);
+
+	return recreate_prev_display(wp);
 }
 
-static int _navigate_inward(WINDOW *wp)
+/*
+ * Collect the largest entries again, keeping the highlighted 
+ * one highlighted if it's still among them.
+ */
+static int refresh_top_view(WINDOW *wp)
 {
-	char *path;
-	int retval;
+	struct dtree *node;
 
-	_highligted_node = _highligted_node->child;
+	if (_search_view)
+		return refresh_search_view(wp);
+	node = get_highlighted_node();
+	collect_top_entries(&_top_heap, _top_root, _top_kind);
 
-	if (werase(wp) == ERR)
-		return -1; 
-	if (!(path = extract_dir_path(_highligted_node->data->file->fpath)))
+	if (!_top_heap.num)
+		return leave_top_view(wp);
+	if (load_top_entries())
 		return -1;
+	_view.cursor = get_entry_index(node);
+	scroll_to_cursor(wp);
+
+	return recreate_prev_display(wp);
+}
 
-	retval = nc_initial_display(wp, _highligted_node, path);
-	free(path);
+static int navigate_outward(WINDOW *wp)
+{
+	struct dtree *dir;
 
-	return retval;
+	if (_top_view)
+		return leave_top_view(wp);
+	if (!(dir = get_parent(get_highlighted_node())))
+		return 0;
+
+	/* The left level isn't needed anymore */
+	if (_snap_view) {
+		snap_view_outward(_snap_view);
+		forget_sorted_level(&_sort_cache, dir);
+	}
+	if (load_view_level(dir->parent))
+		return -1;
+	_view.cursor = get_entry_index(dir);
+	_view.top = pop_view_top();
+	scroll_to_cursor(wp);
+
+	return recreate_prev_display(wp);
+}
+
+/*
+ * Get the node's child, a snapshot's level is 
+ * materialised only when it's entered.
+ */
+static struct dtree *get_child(struct dtree *node)
+{
+	/* A level that's still being scanned isn't there yet */
+	if (_bg_scan)
+		return get_published_child(node);
+	if (node->child || !_snap_view || !S_ISDIR(node->mode) ||
+	    is_dot_entry(node->fname))
+		return node->child;
+	else
+		return snap_view_inward(_snap_view, node);
 }
 
 static int navigate_inward(WINDOW *wp)
 {
-	int retval;
+	struct dtree *child;
 
-	if ((retval = is_available_node(_highligted_node->child)))
-		retval = _navigate_inward(wp);
-	return retval;
+	if (_top_view)
+		return jump_to_top_entry(wp);
+
+	/* Tell a failed materialisation apart from a childless node */
+	ERROR = 0;
+
+	if (!(child = get_child(get_highlighted_node())))
+		return ERROR ? -1 : 0;
+	if (push_view_top() || load_view_level(child->parent))
+		return -1;
+	_view.top = 0;
+	_view.cursor = 0;
+
+	return recreate_prev_display(wp);
+}
+
+/*
+ * Sort by the key, or in the opposite order if it's the current key
+ */
+static int change_sort(WINDOW *wp, enum sort_key key)
+{
+	if (key == _sort_key) {
+		_sort_descending = !_sort_descending;
+	} else {
+		_sort_key = key;
+		/* The names read better from a to z, the rest from the biggest */
+		_sort_descending = (key != SORT_BY_NAME);
+	}
+	return show_node(wp, get_highlighted_node());
+}
+
+static int perform_sorting(WINDOW *wp, int c)
+{
+	if (c == 's')
+		return change_sort(wp, SORT_BY_SIZE);
+	else if (c == 'n')
+		return change_sort(wp, SORT_BY_NAME);
+	else if (c == 'm')
+		return change_sort(wp, SORT_BY_MTIME);
+	else if (c == 'i')
+		return change_sort(wp, SORT_BY_ITEMS);
+	else
+		return 0;
 }
 
 static int perform_navigation(WINDOW *wp, int c)
@@ -724,29 +1203,648 @@ static int perform_navigation(WINDOW *wp, int c)
 		return navigate_inward(wp);
 	else if (c == KEY_BACKSPACE || c == KEY_LEFT || c == 'h' || c == '\b')
 		return navigate_outward(wp);
+	else if (c == KEY_PPAGE)
+		return navigate_page_up(wp);
+	else if (c == KEY_NPAGE)
+		return navigate_page_down(wp);
+	else if (c == KEY_HOME || c == 'g')
+		return navigate_home(wp);
+	else if (c == KEY_END || c == 'G')
+		return navigate_end(wp);
 	else 
 		return 0;
 }
 
+/*
+ * Display the highlighted node's level again after the dtree has 
+ * changed, the level might have changed or even been left.
+ */
+static int refresh_changed_dtree(WINDOW *wp)
+{
+	struct dtree *node;
+	size_t depth;
+
+	dirty_sort_cache(&_sort_cache);
+	_name_index_stale = true;
+	if (_top_view)
+		return refresh_top_view(wp);
+
+	node = get_attached_node(get_highlighted_node());
+	if ((depth = get_level_depth(node)) < _view.depth) {
+		_view.top = _view.tops[depth];
+		_view.depth = depth;
+	}
+	return show_node(wp, node);
+}
+
+/*
+ * Poll the input while there's anything to refresh in between
+ */
+static void update_input_timeout(WINDOW *wp)
+{
+	if (_bg_scan)
+		wtimeout(wp, _scan_timeout_ms);
+	else if (_rm_jobs_num)
+		wtimeout(wp, _rm_timeout_ms);
+	else if (_watch)
+		wtimeout(wp, _watch_timeout_ms);
+	else
+		wtimeout(wp, -1);
+}
+
+/*
+ * Display the note at the end of the opening message's line
+ */
+static int display_top_note(WINDOW *wp, const char *note)
+{
+	const int begin_y = 0;
+	const int begin_x = 0;
+	short cpair;
+	int len;
+
+	cpair = COLORED_OUTPUT ? _borders_cpair : DEFAULT_PAIR;
+	len = strlen(note);
+
+	/* Clear the previous note, it might have been longer */
+	if (wmove(wp, begin_y, begin_x) == ERR || wclrtoeol(wp) == ERR ||
+	    display_opening_message(wp))
+		return -1;
+	/* It's left out of a too narrow window */
+	if (len < getmaxx(wp) && 
+	    mvwprintw(wp, begin_y, getmaxx(wp)-len, "%s", note) == ERR)
+		return -1;
+	if (dye_bg(wp, begin_y, begin_x, EOL, NONE, cpair))
+		return -1;
+	else
+		return (wrefresh(wp) == ERR) ? -1 : 0;
+}
+
+/*
+ * Ask before removing the entry, on the opening message's line. 
+ * Returns 1 when it's confirmed, 0 when it's not and -1 on failure.
+ */
+static int confirm_removal(WINDOW *wp, const struct dtree *node)
+{
+	const int begin_y = 0;
+	const int begin_x = 0;
+	const char *name;
+	short cpair;
+	int c;
+
+	cpair = COLORED_OUTPUT ? RED_PAIR : DEFAULT_PAIR;
+
+	if (!(name = get_displayed_name(node)))
+		return -1;
+	if (wmove(wp, begin_y, begin_x) == ERR || wclrtoeol(wp) == ERR ||
+	    mvwprintw(wp, begin_y, begin_x, "Delete %s? (y/N)", name) == ERR)
+		return -1;
+	if (dye_bg(wp, begin_y, begin_x, EOL, NONE, cpair) || wrefresh(wp) == ERR)
+		return -1;
+
+	/* The input might time out meanwhile */
+	while ((c = wgetch(wp)) == ERR)
+		;
+	return (c == 'y' || c == 'Y');
+}
+
+/*
+ * Queue the highlighted entry's removal once it's confirmed, it stays
+ * displayed as pending until it's removed. Nothing is removed while the
+ * tree is still scanned (its trees are still being built) or from a 
+ * snapshot's view (its levels are recycled as they're left).
+ */
+static int mark_for_removal(WINDOW *wp)
+{
+	struct dtree *node;
+	int confirmed;
+
+	node = get_highlighted_node();
+
+	if (!_rm_queue || _bg_scan || _snap_view || 
+	    is_dot_entry(node->fname) || is_flagged_dtree(node, DTREE_PENDING))
+		return 0;
+	if ((confirmed = confirm_removal(wp, node)) == -1)
+		return -1;
+	if (!confirmed)
+		return recreate_prev_display(wp);
+	if (queue_rm_entry(_rm_queue, node))
+		return -1;
+
+	_rm_jobs_num++;
+	_rm_report[0] = '\0';
+	update_input_timeout(wp);
+
+	dirty_sort_cache(&_sort_cache);
+	return _top_view ? refresh_top_view(wp) : show_node(wp, node);
+}
+
+/*
+ * Rescan the highlighted entry in place, or the browsed directory on 
+ * its dot entry. Nothing is rescanned while the tree is still scanned
+ * or in a snapshot's view, nor anything that is pending removal or has
+ * a removal under it that isn't settled yet.
+ */
+static int rescan_highlighted(WINDOW *wp)
+{
+	struct dtree *node, *new_node;
+	char note[256];
+	bool browsed;
+
+	node = get_highlighted_node();
+
+	if ((browsed = is_dot_entry(node->fname)))
+		node = node->parent;
+	if (!_rescan_arena || _bg_scan || _snap_view || !node->parent ||
+	    is_flagged_dtree(node, DTREE_PENDING) ||
+	    (_rm_queue && is_removing_under(_rm_queue, node)))
+		return 0;
+
+	snprintf(note, sizeof(note), "Rescanning %s... ", node->fname);
+	if (display_top_note(wp, note))
+		return -1;
+
+	/* A gone entry is detached, the nearest attached one is shown then */
+	if (!(new_node = rescan_dtree(node, &_rescan_opts, _rescan_arena))) {
+		if (ERROR != ENOENT)
+			return -1;
+		ERROR = 0;
+		return refresh_changed_dtree(wp);
+	}
+	if (_watch)
+		rewatch_dtree(_watch, new_node);
+
+	dirty_sort_cache(&_sort_cache);
+	_name_index_stale = true;
+	if (_top_view)
+		return refresh_top_view(wp);
+	else
+		return show_node(wp, (browsed && new_node->child) ? 
+				 new_node->child : new_node);
+}
+
+static int index_names(WINDOW *wp, const struct dtree *root)
+{
+	if (display_top_note(wp, "Indexing the names... "))
+		return -1;
+
+	free_name_index(&_name_index);
+	if (build_name_index(&_name_index, root))
+		return -1;
+
+	_name_index_stale = false;
+	return 0;
+}
+
+/*
+ * Display the query in place of the opening message, 
+ * with the number of its hits at the line's end.
+ */
+static int display_search_prompt(WINDOW *wp, const char *query,
+				 size_t hits_num)
+{
+	const int begin_y = 0;
+	const int begin_x = 0;
+	char note[64];
+	short cpair;
+	int len;
+
+	cpair = COLORED_OUTPUT ? _borders_cpair : DEFAULT_PAIR;
+
+	if (!*query)
+		note[0] = '\0';
+	else if (!hits_num)
+		snprintf(note, sizeof(note), "No matches ");
+	else
+		snprintf(note, sizeof(note), "%lu%s matches ", 
+			 (unsigned long) hits_num, 
+			 (hits_num == _search_hits_num) ? "+" : "");
+	len = strlen(note);
+
+	if (clear_line(wp, begin_y) ||
+	    mvwprintw(wp, begin_y, begin_x, "Search: %s", query) == ERR)
+		return -1;
+	if (len && len < getmaxx(wp) && 
+	    mvwprintw(wp, begin_y, getmaxx(wp)-len, "%s", note) == ERR)
+		return -1;
+	if (dye_bg(wp, begin_y, begin_x, EOL, NONE, cpair))
+		return -1;
+	else
+		return (wrefresh(wp) == ERR) ? -1 : 0;
+}
+
+/*
+ * List the entries whose names match the query in the largest entries'
+ * view, the browser's place is kept the same way. The browser is shown 
+ * again when nothing matches.
+ */
+static int show_search_hits(WINDOW *wp, const char *query, size_t *hits_num)
+{
+	size_t num;
+
+	num = *query ? search_name_index(&_name_index, query, _search_hits,
+					 _search_hits_num) : 0;
+	*hits_num = num;
+
+	if (!num)
+		return _search_view ? leave_top_view(wp) : 0;
+	if (reserve_array((void **) &_view.entries, &_view.cap,
+			  num, sizeof(struct dtree *)))
+		return -1;
+	keep_browser_place();
+	_view.dir = NULL;
+	_top_view = true;
+	_search_view = true;
+	_top_root = get_root_node(_search_hits[0]);
+
+	memcpy(_view.entries, _search_hits, num * sizeof(struct dtree *));
+	_view.num = num;
+	_view.top = 0;
+	_view.cursor = 0;
+
+	return recreate_prev_display(wp);
+}
+
+static inline bool is_query_char(int c)
+{
+	/* The keypad's keys are above the bytes */
+	return c >= ' ' && c <= 0xff && c != 127;
+}
+
+/*
+ * Search the names incrementally as the query is typed. Enter keeps the 
+ * hits listed, they're jumped to like the largest entries, and escape 
+ * goes back to the browser. The dtree is indexed on the first search
+ * once it's scanned, and again if it has changed since. Neither a tree
+ * that is still scanned nor a snapshot's view is searched.
+ */
+static int search_names(WINDOW *wp)
+{
+	char query[NAME_QUERY_SIZE];
+	size_t len, hits_num;
+	int c;
+
+	if (_bg_scan || _snap_view)
+		return 0;
+	if ((!_name_index.nodes || _name_index_stale) &&
+	    index_names(wp, get_root_node(get_highlighted_node())))
+		return -1;
+	if (!_search_hits && 
+	    !(_search_hits = malloc_inf(_search_hits_num * 
+					sizeof(struct dtree *))))
+		return -1;
+	query[0] = '\0';
+	len = 0;
+	hits_num = 0;
+
+	while (true) {
+		if (display_search_prompt(wp, query, hits_num))
+			return -1;
+		/* Nothing is refreshed meanwhile */
+		if ((c = wgetch(wp)) == ERR)
+			continue;
+		if (c == '\n' || c == KEY_ENTER)
+			return recreate_prev_display(wp);
+		if (c == ESC)
+			return _search_view ? leave_top_view(wp) : 
+					      recreate_prev_display(wp);
+
+		if (c == KEY_BACKSPACE || c == 127 || c == '\b') {
+			if (!len)
+				continue;
+			query[--len] = '\0';
+		} else if (is_query_char(c) && len < NAME_QUERY_SIZE - 1) {
+			query[len++] = c;
+			query[len] = '\0';
+		} else {
+			continue;
+		}
+		if (show_search_hits(wp, query, &hits_num))
+			return -1;
+	}
+}
+
 static int perform_input_operations(WINDOW *wp, int c)
 {
 	if (c == 'c') {
-		return 0;//rm_entry(_highligted_node->data->file);
+		return mark_for_removal(wp);
+	} else if (c == 'r') {
+		return rescan_highlighted(wp);
+	} else if (c == '/') {
+		return search_names(wp);
 	} else if (c == 'q'){
 		return 1;
+	} else if (c == 't') {
+		return toggle_top_view(wp, TOP_FILES);
+	} else if (c == 'T') {
+		return toggle_top_view(wp, TOP_LEAF_DIRS);
+	} else if (c == 's' || c == 'n' || c == 'm' || c == 'i') {
+		/* The listed entries keep their own order */
+		return _top_view ? 0 : perform_sorting(wp, c);
 	} else {
 		return perform_navigation(wp, c);
 	}
 }
 
-int nc_man_input(WINDOW *wp)
+/*
+ * Apply the watched changes and display the highlighted 
+ * node's level again, if anything has changed.
+ */
+static int refresh_watched_dtree(WINDOW *wp)
 {
-	int c;
+	int applied;
+
+	if ((applied = apply_watch_events(_watch)) <= 0)
+		return applied;
+	return refresh_changed_dtree(wp);
+}
+
+static inline double get_elapsed_secs(const struct timespec *since,
+				       const struct timespec *now)
+{
+	return (now->tv_sec - since->tv_sec) + 
+	       (now->tv_nsec - since->tv_nsec) / 1e9;
+}
+
+/*
+ * Get the entries read per second since the progress was last displayed
+ */
+static unsigned long get_scan_rate(unsigned long entries)
+{
+	struct timespec now;
+	double secs;
+	unsigned long rate;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	secs = get_elapsed_secs(&_last_tick, &now);
+	rate = (secs > 0) ? (entries - _last_entries) / secs : 0;
+	_last_entries = entries;
+	_last_tick = now;
+
+	return rate;
+}
+
+/*
+ * The largest entries are collected over the whole dtree, so while it's
+ * being scanned they're collected again only once a level is published
+ * since the last time, and not before _top_scan_refresh_secs pass.
+ */
+static bool is_top_refresh_due(void)
+{
+	struct timespec now;
+	unsigned long entries;
+
+	entries = _bg_scan->progress.entries;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	if (entries == _top_entries || 
+	    get_elapsed_secs(&_top_tick, &now) < _top_scan_refresh_secs)
+		return false;
+	_top_entries = entries;
+	_top_tick = now;
+
+	return true;
+}
+
+/*
+ * Display the scan's progress at the end of the opening message's line
+ */
+static int display_scan_progress(WINDOW *wp)
+{
+	struct size_format format;
+	unsigned long entries;
+	char buffer[128], last[1];
+
+	entries = _bg_scan->progress.entries;
+	format = get_proper_size_format(_bg_scan->progress.bytes);
+	snprintf(buffer, sizeof(buffer), 
+		 "Scanning: %lu entries (%lu/s), %0.2f %s found, %lu errors ",
+		 entries, get_scan_rate(entries), format.val, format.unit,
+		 get_held_errors(last, sizeof(last)));
+
+	return display_top_note(wp, buffer);
+}
+
+/*
+ * The input times out once the scan is done only if there's anything 
+ * else to refresh.
+ */
+static int finish_bg_scan(WINDOW *wp)
+{
+	if (!join_bg_scan(_bg_scan))
+		return -1;
+	_bg_scan = NULL;
+	update_input_timeout(wp);
+
+	return 0;
+}
+
+/*
+ * Display the highlighted node's level again with its directories' grown 
+ * sizes (sorted again), and the scan's progress until it's done. The 
+ * largest entries' view is only refreshed when it's due (see 
+ * is_top_refresh_due()) and once the scan is done.
+ */
+static int refresh_scan_progress(WINDOW *wp)
+{
+	if (is_bg_scan_done(_bg_scan) && finish_bg_scan(wp))
+		return -1;
 
-	while ((c = wgetch(wp)) != ERR) {
-		if (perform_input_operations(wp, c))
+	dirty_sort_cache(&_sort_cache);
+	if (!_top_view) {
+		if (show_node(wp, get_highlighted_node()))
+			return -1;
+	} else if (!_bg_scan || is_top_refresh_due()) {
+		if (refresh_top_view(wp))
 			return -1;
 	}
-	return 0;
+	return _bg_scan ? display_scan_progress(wp) : 0;
+}
+
+/*
+ * Keep the outcome of the removal as the report
+ */
+static void report_rm_job(const struct rm_job *job)
+{
+	struct size_format format;
+
+	format = get_proper_size_format(job->progress.bytes);
+
+	if (!job->error)
+		snprintf(_rm_report, sizeof(_rm_report), 
+			 "Deleted %s: %lu entries, %0.2f %s freed ",
+			 job->entry->fname, job->progress.entries, 
+			 format.val, format.unit);
+	else
+		snprintf(_rm_report, sizeof(_rm_report),
+			 "Couldn't delete all of %s: %s ",
+			 job->entry->fname, strerror(job->error));
+}
+
+/*
+ * Settle the finished removals into the dtree, the rescanned trees of
+ * the partly removed directories are watched again. Returns the number
+ * of the settled removals.
+ */
+static size_t settle_rm_jobs()
+{
+	struct rm_job *job;
+	size_t settled;
+
+	for (settled=0; (job = get_done_rm_job(_rm_queue)); settled++) {
+		settle_rm_job(_rm_queue, job, _rm_arena);
+
+		if (_watch && job->left && 
+		    !is_flagged_dtree(job->entry, DTREE_PENDING | DTREE_DETACHED))
+			rewatch_dtree(_watch, job->entry);
+		report_rm_job(job);
+		free_rm_job(job);
+		_rm_jobs_num--;
+	}
+	return settled;
+}
+
+/*
+ * Display the running removal's progress, or the last 
+ * one's outcome when there's nothing to remove anymore.
+ */
+static int display_rm_progress(WINDOW *wp)
+{
+	struct rm_progress progress;
+	struct size_format format;
+	const struct dtree *entry;
+	char buffer[256];
+
+	if (!(entry = get_running_rm_progress(_rm_queue, &progress)))
+		return _rm_report[0] ? display_top_note(wp, _rm_report) : 0;
+
+	format = get_proper_size_format(progress.bytes);
+	snprintf(buffer, sizeof(buffer), 
+		 "Deleting %s: %lu entries, %0.2f %s freed (%lu queued) ",
+		 entry->fname, progress.entries, format.val, format.unit,
+		 (unsigned long) _rm_jobs_num - 1);
+
+	return display_top_note(wp, buffer);
+}
+
+/*
+ * Settle the finished removals, displaying the highlighted node's 
+ * level again if any, and display the removals' progress.
+ */
+static int refresh_rm_progress(WINDOW *wp)
+{
+	if (settle_rm_jobs()) {
+		update_input_timeout(wp);
+		if (refresh_changed_dtree(wp))
+			return -1;
+	}
+	return display_rm_progress(wp);
+}
+
+/*
+ * Display the number of the errors that were held back and the last 
+ * one's message, whenever there are new ones. The scan's progress has
+ * the number in it instead.
+ */
+static int display_held_errors(WINDOW *wp)
+{
+	char last[192], note[256];
+	unsigned long num;
+
+	if ((num = get_held_errors(last, sizeof(last))) == _errors_num)
+		return 0;
+	_errors_num = num;
+	snprintf(note, sizeof(note), "%lu errors, the last: %s ", num, last);
+
+	return display_top_note(wp, note);
+}
+
+/*
+ * Browse the dtree while it's still being scanned, its first level
+ * (see wait_bg_scan_level()) is then passed to nc_initial_display().
+ * The scan is joined here once it's done.
+ */
+void nc_set_bg_scan(struct bg_scan *scan)
+{
+	_bg_scan = scan;
+	_last_entries = 0;
+	_top_entries = 0;
+	clock_gettime(CLOCK_MONOTONIC, &_last_tick);
+	_top_tick = _last_tick;
+}
+
+/*
+ * Browse the snapshot's view instead of a fully materialised 
+ * dtree, its first level is then passed to nc_initial_display().
+ */
+void nc_set_snap_view(struct snap_view *view)
+{
+	_snap_view = view;
+}
+
+/*
+ * Keep the displayed dtree up to date with the watch, the
+ * changes are applied whenever the input times out.
+ */
+void nc_set_watch(struct dtree_watch *watch)
+{
+	_watch = watch;
+}
+
+/*
+ * Remove the marked entries in the background with the queue, what's 
+ * left of the partly removed ones is rescanned into the arena. It's up
+ * to the caller to destroy the queue, which finishes its removals.
+ */
+void nc_set_rm_queue(struct rm_queue *queue, struct arena *arena)
+{
+	_rm_queue = queue;
+	_rm_arena = arena;
+}
+
+/*
+ * Rescan the highlighted entries ('r') with the scan's options, their
+ * new trees go into the arena. The previous snapshot and the progress
+ * only belong to the scan itself, so they're left out of the copy.
+ */
+void nc_set_rescan(const struct scan_opts *opts, struct arena *arena)
+{
+	_rescan_opts = *opts;
+	_rescan_opts.prev_snap = NULL;
+	_rescan_opts.progress = NULL;
+	_rescan_arena = arena;
+}
+
+/*
+ * Handle the keys, the scan's progress, the watched changes and the 
+ * removals are refreshed in between whenever the input times out.
+ */
+int nc_man_input(WINDOW *wp)
+{
+	int c, retval;
+
+	update_input_timeout(wp);
+	hold_errors(true);
+	retval = -1;
+
+	while ((c = wgetch(wp)) != ERR || _bg_scan || _watch || _rm_jobs_num) {
+		if (c != ERR) {
+			if (perform_input_operations(wp, c))
+				goto out_release_errors;
+		} else if (_bg_scan) {
+			if (refresh_scan_progress(wp))
+				goto out_release_errors;
+		} else if ((_watch && refresh_watched_dtree(wp)) ||
+			   (_rm_jobs_num && refresh_rm_progress(wp))) {
+			goto out_release_errors;
+		}
+		if (!_bg_scan && display_held_errors(wp))
+			goto out_release_errors;
+	}
+	retval = 0;
+
+out_release_errors:
+	hold_errors(false);
+
+	return retval;
 }
 
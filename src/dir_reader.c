@@ -0,0 +1,55 @@
+/*
+---------------------------------------------------------
+| License: GNU GPL-3.0                                  |
+---------------------------------------------------------
+| This source file contains all the necessary functions |
+| for reading the directories' entries in bulk.         |
+---------------------------------------------------------
+*/
+
+#include "informative.h"
+#include "dir_reader.h"
+
+
+void init_dir_reader(struct dir_reader *reader, int fd, 
+		     char *buf, size_t bufsize)
+{
+	reader->fd = fd;
+	reader->buf = buf;
+	reader->bufsize = bufsize;
+	reader->pos = 0;
+	reader->len = 0;
+}
+
+/*
+ * Refill the reader's buffer. Returns the number of read bytes,
+ * zero at the end of the directory and -1 on failure.
+ */
+static long refill_dir_reader(struct dir_reader *reader)
+{
+	long nread;
+
+	if ((nread = getdents64_inf(reader->fd, reader->buf, reader->bufsize)) > 0) {
+		reader->pos = 0;
+		reader->len = nread;
+	}
+	return nread;
+}
+
+/*
+ * Returns the next entry of the directory or NULL at the end of 
+ * it. Just like readdir_inf(), ERROR distinguishes between the
+ * end of the directory and a failure.
+ */
+struct linux_dirent64 *read_dir_reader(struct dir_reader *reader)
+{
+	struct linux_dirent64 *entry;
+
+	if (reader->pos >= reader->len && refill_dir_reader(reader) <= 0)
+		return NULL;
+
+	entry = (struct linux_dirent64 *) (reader->buf + reader->pos);
+	reader->pos += entry->d_reclen;
+
+	return entry;
+}
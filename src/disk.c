@@ -12,15 +12,25 @@
  * feature test macro requirements, which are:
  *     1) _XOPEN_SOURCE >= 500 || _ISOC99_SOURCE for snprintf() and lstat()
  *     2) _DEFAULT_SOURCE || _BSD_SOURCE for file type and mode macros
+ *     3) _GNU_SOURCE for statx() and _ATFILE_SOURCE for the *at() functions
+ *     4) _POSIX_C_SOURCE >= 199309L for nanosleep()
  */
 #define _GNU_SOURCE
 #include <stdio.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <time.h>
+#include <sys/sysmacros.h>
 #include "general.h"
 #include "informative.h" 
+#include "pool.h"
+#include "dir_reader.h"
+#include "uring.h"
+#include "link_set.h"
+#include "snapshot.h"
 #include "disk.h"
 
 #define IGNORE_EACCES() (ERROR = 0)
@@ -42,14 +52,121 @@
 				       S_ISBLK(file_mode) || \
 				       S_ISFIFO(file_mode))
 
-/* Necessary static functions prototype */
-static int rm_dir_r(const char *);
+#ifdef STATX_BASIC_STATS
+/* A statx request that is in flight through io_uring */
+struct statx_slot {
+	struct dtree *node;
+	struct statx stx;
+};
+#endif
+
+/* 
+ * The entry's identity and change times, only the directories
+ * keep them in their nodes (as their stamps).
+ */
+struct entry_id {
+	struct dtree_stamp stamp;
+	nlink_t nlink;
+};
+
+/* The scan's state that is shared by all the workers */
+struct scan_shared {
+	struct link_set *links; /* NULL unless hard links are charged once */
+	/* The tree that a rescan replaces, NULL unless it's a rescan */
+	const struct dtree *replaced;
+	const struct snapshot *prev; /* NULL unless it's an incremental scan */
+	struct scan_progress *progress; /* NULL unless it's followed */
+	dev_t root_dev;
+	bool one_fs; /* Don't descend into other file systems */
+};
+
+/*
+ * A directory whose tree is still being scanned. The totals of its tree
+ * are accumulated in its node, once its own level and all of its sub-
+ * directories are done they are added up to the parent's node.
+ */
+struct scan_dir {
+	struct dtree *node;
+	struct scan_dir *parent; /* The next free one when it's recycled */
+	long pending; /* Its own level plus the unfinished sub-directories */
+	/* Its level in the previous snapshot plus one, zero when there's none */
+	uint64_t prev_off;
+	bool unchanged; /* Its entries are the same as in the previous snapshot */
+};
+
+/* Thread local state of the scanner's workers */
+struct scan_local {
+	struct arena arena;
+	char *dents_buf;
+	struct path_buf path_buf;
+	struct scan_dir *free_dirs; /* Finished ones, ready for reuse */
+	const struct scan_shared *shared;
+	/* The previous sub-directories of the level that is being read */
+	struct snap_entry *prev_dirs;
+	size_t prev_dirs_cap;
+#ifdef STATX_BASIC_STATS
+	struct uring ring;
+	struct statx_slot *slots; /* NULL when io_uring isn't used */
+	unsigned int *free_slots;
+	unsigned int free_num;
+	unsigned int depth;
+#endif
+};
 
+/* The dtree level (directory) that is being read */
+struct level {
+	struct arena *arena;
+	const struct scan_shared *shared;
+	struct scan_dir *dir;
+	struct dtree *last;
+	const char *dir_path;
+	int fd;
+	bool failed;
+	/* Its previous sub-directories sorted by name, for incremental scans */
+	const struct snap_entry *prev_dirs;
+	size_t prev_dirs_num;
+	/* The level's own totals, its sub-directories add theirs later */
+	off_t fsize;
+	unsigned int files_num;
+	unsigned int dirs_num;
+};
 
 /*
- * Get entry's path in the case of dir_path being just a slash
+ * Reading buffers of the recursive deletion, one for each depth
+ * level. A buffer is reused by all the directories at its level
+ * without overwriting the unread entries of the levels above it.
  */
-static char *get_entry_path_slash(const char *entry_name)
+struct rm_bufs {
+	char **levels;
+	size_t num;
+};
+
+/* A directory whose tree is being removed */
+struct rm_dir {
+	struct dtree *node;
+	struct rm_dir *parent; /* The next free one when it's recycled */
+	long pending; /* Its own level plus the unremoved sub-directories */
+};
+
+/* Thread local state of the removal's workers */
+struct rm_local {
+	struct arena arena;
+	struct path_buf path_buf;
+	struct rm_bufs bufs; /* The fallback's reading buffers */
+	struct rm_dir *free_dirs; /* Removed ones, ready for reuse */
+	struct rm_progress *progress;
+};
+
+/* Necessary static functions prototype */
+static int rm_dir_r(const char *, struct rm_bufs *, size_t);
+
+
+static inline bool is_slash(const char *dir_path)
+{
+	return (efficient_strcmp(dir_path, "/") == 0);
+}
+
+static char *get_entry_path(const char *dir_path, const char *entry_name)
 {
 	const char slash = '/';
 	char *entry_path;
@@ -57,70 +174,170 @@ static char *get_entry_path_slash(const char *entry_name)
 
 	len = get_strsize(entry_name) + sizeof(slash);
 
-	if ((entry_path = malloc_inf(len)))
-		snprintf(entry_path, len, "%c%s", slash, entry_name);
+	if (is_slash(dir_path)) {
+		if ((entry_path = malloc_inf(len)))
+			snprintf(entry_path, len, "%c%s", slash, entry_name);
+	} else {
+		len += strlen(dir_path);
+
+		if ((entry_path = malloc_inf(len)))
+			snprintf(entry_path, len, "%s%c%s", 
+				 dir_path, slash, entry_name);
+	}
 	return entry_path;
 }
 
+static inline off_t get_entry_size(blkcnt_t blk_num) 
+{
+	const int blk_size = 512;
+
+	return blk_num * blk_size;
+}
+
+static inline void insert_stat_fields(struct dtree *node,
+				      struct entry_id *id,
+				      const struct stat *statbuf)
+{
+	node->fsize = get_entry_size(statbuf->st_blocks);
+	node->mtime = statbuf->st_mtim.tv_sec;
+	node->mode = statbuf->st_mode;
+	id->stamp.dev = statbuf->st_dev;
+	id->stamp.ino = statbuf->st_ino;
+	id->stamp.mtime = statbuf->st_mtim;
+	id->stamp.ctime = statbuf->st_ctim;
+	id->nlink = statbuf->st_nlink;
+}
+
+#ifdef STATX_BASIC_STATS
 /*
- * Get entry's path in the case of dir_path being just a regular
- * path and not just slash (contrast to get_entry_path_slash())
+ * Only the fields that ncda actually uses are requested, so the
+ * file system may skip filling (or fetching) the rest of them.
  */
-static char *get_entry_path_not_slash(const char *dir_path, 
-				      const char *entry_name)
+#define STATX_NCDA_MASK (STATX_TYPE | STATX_MODE | STATX_BLOCKS | \
+			 STATX_MTIME | STATX_CTIME | STATX_INO | STATX_NLINK)
+
+static inline void insert_statx_fields(struct dtree *node,
+				       struct entry_id *id,
+				       const struct statx *stx)
 {
-	const char slash = '/';
-	char *entry_path;
-	size_t len;
+	node->fsize = get_entry_size(stx->stx_blocks);
+	node->mtime = stx->stx_mtime.tv_sec;
+	node->mode = stx->stx_mode;
+	id->stamp.dev = makedev(stx->stx_dev_major, stx->stx_dev_minor);
+	id->stamp.ino = stx->stx_ino;
+	id->stamp.mtime.tv_sec = stx->stx_mtime.tv_sec;
+	id->stamp.mtime.tv_nsec = stx->stx_mtime.tv_nsec;
+	id->stamp.ctime.tv_sec = stx->stx_ctime.tv_sec;
+	id->stamp.ctime.tv_nsec = stx->stx_ctime.tv_nsec;
+	id->nlink = stx->stx_nlink;
+}
 
-	len = strlen(dir_path) + strlen(entry_name) + sizeof(slash) + 1;
-        
-	if ((entry_path = malloc_inf(len)))
-                snprintf(entry_path, len, "%s%c%s", dir_path, slash, entry_name);
-	return entry_path;
+/*
+ * Get the status of the entry relative to its directory's file
+ * descriptor, so the kernel doesn't resolve the whole path again.
+ */
+static int stat_entry(int dir_fd, const char *entry_name,
+		      struct dtree *node, struct entry_id *id)
+{
+	struct statx stx;
+	int retval;
+
+	if (!(retval = statx_inf(dir_fd, entry_name, AT_SYMLINK_NOFOLLOW,
+				 STATX_NCDA_MASK, &stx)))
+		insert_statx_fields(node, id, &stx);
+	return retval;
 }
+#else
+static int stat_entry(int dir_fd, const char *entry_name,
+		      struct dtree *node, struct entry_id *id)
+{
+	struct stat statbuf;
+	int retval;
 
-static inline bool is_slash(const char *dir_path)
+	if (!(retval = fstatat_inf(dir_fd, entry_name, &statbuf,
+				   AT_SYMLINK_NOFOLLOW)))
+		insert_stat_fields(node, id, &statbuf);
+	return retval;
+}
+#endif
+
+/*
+ * Whether the file's blocks should be added to the totals. When hard
+ * links are charged once, a file with more than one link is charged
+ * only if its inode isn't charged to another node (see 
+ * link_set_charge()). Returns -1 on failure.
+ */
+static inline int charge_file(const struct scan_shared *shared,
+			      const struct dtree *node,
+			      const struct entry_id *id)
 {
-	return (efficient_strcmp(dir_path, "/") == 0);
+	if (!shared->links || id->nlink < 2)
+		return 1;
+	return link_set_charge(shared->links, id->stamp.dev, id->stamp.ino,
+			       node, shared->replaced);
 }
 
-static char *get_entry_path(const char *dir_path, const char *entry_name)
+static inline bool is_other_fs(const struct scan_shared *shared,
+			       const struct entry_id *id)
 {
-        if (is_slash(dir_path))
-		return get_entry_path_slash(entry_name);
-	else
-		return get_entry_path_not_slash(dir_path, entry_name);
+	return (shared->one_fs && id->stamp.dev != shared->root_dev);
 }
 
-static void free_and_null_dtree(struct dtree **begin)
+/*
+ * Keep the directory's stamp in its node, so the snapshots taken
+ * of the tree can tell later on whether the directory changed.
+ */
+static int insert_entry_stamp(struct arena *arena, struct dtree *node,
+			      const struct entry_id *id)
 {
-	free_dtree(*begin);
-	*begin = NULL;
+	if (!(node->stamp = arena_alloc(arena, sizeof(struct dtree_stamp))))
+		return -1;
+	*node->stamp = id->stamp;
+
+	return 0;
 }
 
-static inline off_t get_entry_size(blkcnt_t blk_num) 
+/*
+ * The same goes for a file with more than one hard link, its level can
+ * then be reused from the snapshots with its inode charged once again.
+ */
+static inline int insert_link_stamp(struct arena *arena, struct dtree *node,
+				    const struct entry_id *id)
 {
-	const int blk_size = 512;
+	if (id->nlink < 2)
+		return 0;
+	node->flags |= DTREE_LINKED;
 
-	return blk_num * blk_size;
+	return insert_entry_stamp(arena, node, id);
 }
 
-static int insert_fdata_fields(struct fdata *ptr, 
-			       const char *entry_name, size_t nlen, 
-			       const char *entry_path, size_t plen)
+static inline bool is_same_stamp(const struct dtree_stamp *x,
+				 const struct dtree_stamp *y)
 {
-	int retval;
-	
-	if (!(retval = lstat_inf(entry_path, ptr->fstatus))) {
-		memcpy(ptr->fname, entry_name, nlen);
-		memcpy(ptr->fpath, entry_path, plen);
-		ptr->fsize = get_entry_size(ptr->fstatus->st_blocks);
-	}
-	return retval;
+	return (x->ino == y->ino && x->dev == y->dev &&
+		x->mtime.tv_sec == y->mtime.tv_sec &&
+		x->mtime.tv_nsec == y->mtime.tv_nsec &&
+		x->ctime.tv_sec == y->ctime.tv_sec &&
+		x->ctime.tv_nsec == y->ctime.tv_nsec);
+}
+
+/*
+ * Allocate the entry's node out of the arena and fill its name
+ */
+static struct dtree *alloc_entry_node(struct arena *arena, 
+				      const char *entry_name)
+{
+	struct dtree *node;
+	size_t len;
+
+	len = get_strsize(entry_name);
+
+	if ((node = alloc_dtree(arena, len)))
+		memcpy(node->fname, entry_name, len);
+	return node;
 }
 
-static short proper_cpair(mode_t mode)
+short get_proper_cpair(mode_t mode)
 {
 	if (SHLD_BE_BLUE(mode))
 		return BLUE_PAIR;
@@ -138,48 +355,44 @@ static short proper_cpair(mode_t mode)
 
 /*
  * Get the proper end of a string. If the file is a directory the end of
- * the string will be slash ('/'), else the end of a string will be blank
- * character (' ').
+ * the string will be slash ('/'), or '>' if it's another file system's
+ * mount point that wasn't scanned, else the end of a string will be
+ * blank character (' ').
  */
-static inline char proper_eos(mode_t mode)
+char get_proper_eos(const struct dtree *node)
 {
-	return S_ISDIR(mode) ? '/' : ' ';
-}
-
-static inline void insert_cdata_fields(struct entry_data *ptr, int node_i)
-{
-	const int init_displayed_y = 2;
-
-	ptr->curses->y = init_displayed_y + node_i;
-	ptr->curses->cpair = proper_cpair(ptr->file->fstatus->st_mode);
-	ptr->curses->eos = proper_eos(ptr->file->fstatus->st_mode);
+	if (node->flags & DTREE_MOUNT_POINT)
+		return '>';
+	return S_ISDIR(node->mode) ? '/' : ' ';
 }
 
-static struct dtree *get_entry_info(const char *entry_name, 
-				    const char *entry_path,
-				    int node_i)
+/*
+ * Get the entry's info relative to the already opened directory. The
+ * node of an entry that couldn't be stat'ed is just left in the arena.
+ */
+static struct dtree *get_entry_info(struct arena *arena, int dir_fd,
+				    const char *entry_name,
+				    struct entry_id *id)
 {
 	struct dtree *node;
-	size_t plen, nlen;
 
-	nlen = get_strsize(entry_name);
-	plen = get_strsize(entry_path);
-
-	if ((node = alloc_dtree(nlen, plen))) {
-		if(!insert_fdata_fields(node->data->file, entry_name, 
-					nlen, entry_path, plen))
-			insert_cdata_fields(node->data, node_i);
-		else
-			free_and_null_dtree(&node);
+	if ((node = alloc_entry_node(arena, entry_name))) {
+		if (stat_entry(dir_fd, entry_name, node, id))
+			node = NULL;
 	}
 	return node;
 }
 
-static inline bool is_kernel_dir(const char *dir_path)
+/*
+ * The kernel's directories can only be found right under the slash,
+ * so checking the entry's name is enough in that case.
+ */
+static inline bool is_kernel_dir(const char *dir_path, const char *entry_name)
 {
-	return (efficient_strcmp(dir_path, "/proc") == 0 ||
-		efficient_strcmp(dir_path, "/sys") == 0 ||
-		efficient_strcmp(dir_path, "/dev") == 0);
+	return (is_slash(dir_path) &&
+		(efficient_strcmp(entry_name, "proc") == 0 ||
+		 efficient_strcmp(entry_name, "sys") == 0 ||
+		 efficient_strcmp(entry_name, "dev") == 0));
 }
 
 /*
@@ -194,274 +407,1611 @@ static inline void connect_mate_nodes(struct dtree *current,
 }
 
 /*
- * Connect tow nodes together when they are parent directory and 
- * child directory.
+ * Make the directory's read level reachable. Its nodes are written
+ * before it's published, so another thread that finds the level 
+ * while the scan is still going sees it complete.
  */
-static inline void connect_family_nodes(struct dtree *current, 
-					struct dtree *new_node)
+static inline void publish_level(struct dtree *dir, struct dtree *begin)
 {
-	current->child = new_node;
-	new_node->parent = current;
+	__atomic_store_n(&dir->child, begin, __ATOMIC_RELEASE);
 }
 
-static struct dtree *get_dot_entry(const char *dir_path)
+static struct dtree *get_dot_entry(struct arena *arena, int dir_fd, 
+				   struct dtree *dir)
 {
-	const int dot_i = 0;
+	struct entry_id id;
 	struct dtree *dot;
-	char *path;
 
-	dot = NULL;
-
-	if ((path = get_entry_path(dir_path, "."))) {
-		dot = get_entry_info(".", path, dot_i);
-		free(path);
-	}
+	if ((dot = get_entry_info(arena, dir_fd, ".", &id)))
+		dot->parent = dir;
 	return dot;
 }
 
-static struct dtree *get_two_dots_entry(const char *dir_path)
+static struct dtree *get_two_dots_entry(struct arena *arena, int dir_fd, 
+					struct dtree *dir)
 {
-	const int two_dots_i = 1;
+	struct entry_id id;
 	struct dtree *two_dots;
-	char *path;
 
-	two_dots = NULL;
-
-	if ((path = get_entry_path(dir_path, ".."))) {
-		two_dots = get_entry_info("..", path, two_dots_i);
-		free(path);
-	}
+	if ((two_dots = get_entry_info(arena, dir_fd, "..", &id)))
+		two_dots->parent = dir;
 	return two_dots;
 }
 
 /*
  * Returns the address of the beggining (the dot entry) 
  */
-static struct dtree *get_dot_entries(const char *dir_path)
+static struct dtree *get_dot_entries(struct arena *arena, int dir_fd, 
+				     struct dtree *dir)
 {
 	struct dtree *dot, *two_dots;
 
-	if ((dot = get_dot_entry(dir_path))) {
-		if ((two_dots = get_two_dots_entry(dir_path)))
+	if ((dot = get_dot_entry(arena, dir_fd, dir))) {
+		if ((two_dots = get_two_dots_entry(arena, dir_fd, dir)))
 			connect_mate_nodes(dot, two_dots);
 		else 
-			free_and_null_dtree(&dot);
+			dot = NULL;
 	}
 	return dot;
 }
 
-static struct dtree *_get_dir_tree(DIR *dp, const char *dir_path)
+static inline struct scan_local *get_scan_local(const struct pool_worker *worker)
 {
-        struct dirent *entry;
-        struct dtree *new_node;
-        struct dtree *current;
-        struct dtree *begin;
-	struct dtree *child;
-	char *path;
-	int i;
-	
-	if (!(begin = get_dot_entries(dir_path)))
-		goto err_out;
-	/* 
-	 * The initial i is equal to 2 because i=0 goes to
-	 * the dot entry and i=1 goes to the two_dots entry
-	 */
-	i = 2;
-	current = begin->next;
-
-	while ((entry = readdir_inf(dp))) {
-		if (is_dot_entry(entry->d_name))
-			continue;
-		if (!(path = get_entry_path(dir_path, entry->d_name)))
-			goto err_free_dtree;
-		if (!is_kernel_dir(path)) {	
-			if (!(new_node = get_entry_info(entry->d_name, path, i++)))
-				goto err_free_path;
-			connect_mate_nodes(current, new_node);
-			current = new_node;
-				
-			if (S_ISDIR(current->data->file->fstatus->st_mode)) {
-				if ((child = get_dir_tree(current->data->file->fpath)))
-					connect_family_nodes(current, child);
-				else if (ERROR == EACCES)
-					IGNORE_EACCES();
-				else
-					goto err_free_path;
-			}
-		}
-		free(path);
+	return (struct scan_local *) worker->pool->arg + worker->id;
+}
+
+static inline bool is_skipped_entry(const char *dir_path, 
+				    const struct linux_dirent64 *entry)
+{
+	/* No need to compare the name unless it's a directory */
+	return (is_dot_entry(entry->d_name) ||
+		((entry->d_type == DT_DIR || entry->d_type == DT_UNKNOWN) &&
+		 is_kernel_dir(dir_path, entry->d_name)));
+}
+
+static struct scan_dir *get_scan_dir(struct scan_local *local, 
+				     struct dtree *node, 
+				     struct scan_dir *parent)
+{
+	struct scan_dir *dir;
+
+	if ((dir = local->free_dirs))
+		local->free_dirs = dir->parent;
+	else if (!(dir = arena_alloc(&local->arena, sizeof(struct scan_dir))))
+		return NULL;
+
+	dir->node = node;
+	dir->parent = parent;
+	dir->pending = 1;
+	dir->prev_off = 0;
+	dir->unchanged = false;
+
+	if (parent)
+		__sync_add_and_fetch(&parent->pending, 1);
+	return dir;
+}
+
+static inline void add_dir_totals(struct dtree *node, off_t fsize,
+				  unsigned int files_num, 
+				  unsigned int dirs_num)
+{
+	__sync_add_and_fetch(&node->fsize, fsize);
+	__sync_add_and_fetch(&node->files_num, files_num);
+	__sync_add_and_fetch(&node->dirs_num, dirs_num);
+}
+
+/*
+ * Mark one of the directory's pending parts as done. The last one adds
+ * the directory's totals up to its parent, which might complete the 
+ * parent as well and so on up the tree.
+ */
+static void finish_scan_dir(struct scan_local *local, struct scan_dir *dir)
+{
+	struct scan_dir *parent;
+
+	while (dir && __sync_sub_and_fetch(&dir->pending, 1) == 0) {
+		parent = dir->parent;
+
+		if (parent)
+			add_dir_totals(parent->node, dir->node->fsize,
+				       dir->node->files_num, 
+				       dir->node->dirs_num);
+		dir->parent = local->free_dirs;
+		local->free_dirs = dir;
+		dir = parent;
 	}
-	if (ERROR)
-		goto err_free_dtree;
+}
 
-	return begin;
+/*
+ * Take the directory's previous entry (if it has one) into account, an
+ * unchanged directory with a previous level doesn't need to be read.
+ */
+static inline void insert_prev_dir(struct scan_dir *dir,
+				   const struct snap_entry *prev,
+				   const struct entry_id *id)
+{
+	if (prev && prev->child_off) {
+		dir->prev_off = prev->child_off;
+		dir->unchanged = is_same_stamp(&prev->stamp, &id->stamp);
+	}
+}
 
-err_free_path:
-	free(path);
-err_free_dtree:
-	free_dtree(begin);
-err_out:
-	return NULL;
+static int cmp_prev_dirs(const void *a, const void *b)
+{
+	return strcmp(((const struct snap_entry *) a)->name,
+		      ((const struct snap_entry *) b)->name);
 }
 
-struct dtree *get_dir_tree(const char *path)
+static const struct snap_entry *find_prev_dir(const struct level *level,
+					      const char *name)
 {
-        struct dtree *retval;
-        DIR *dp;
+	struct snap_entry key;
 
-	retval = NULL;
+	if (!level->prev_dirs_num)
+		return NULL;
+	key.name = name;
 
-        if ((dp = opendir_inf(path))) {
-                retval = _get_dir_tree(dp, path);
-                
-                if (closedir_inf(dp) && retval)
-                        free_and_null_dtree(&retval);
-        }
-        return retval;
+	return bsearch(&key, level->prev_dirs, level->prev_dirs_num,
+		       sizeof(struct snap_entry), cmp_prev_dirs);
 }
 
-static int _delete_entry(const char *entry_path)
+static void link_level_node(struct level *level, struct dtree *node)
 {
-	struct stat statbuf;
+	node->parent = level->dir->node;
+	connect_mate_nodes(level->last, node);
+	level->last = node;
+}
+
+static inline void count_level_file(struct level *level,
+				    const struct dtree *node)
+{
+	if (!(node->flags & DTREE_UNCHARGED))
+		level->fsize += node->fsize;
+	level->files_num++;
+}
+
+/*
+ * Append the stat'ed entry to the end of the level and push it
+ * as a new job to the worker's deque if it's a sub-directory.
+ * An already seen hard link is counted without adding its blocks
+ * to the totals, and so is another file system's mount point,
+ * which is left as a marked placeholder without being descended.
+ * The sub-directory's previous entry is looked up by its name
+ * unless it's given as prev.
+ */
+static int append_level_entry(struct level *level, struct dtree *node,
+			      const struct entry_id *id,
+			      const struct snap_entry *prev,
+			      struct pool_worker *worker)
+{
+	struct scan_dir *dir;
+	int charged;
+
+	link_level_node(level, node);
 
-	 if (lstat_inf(entry_path, &statbuf))
+	if (!S_ISDIR(node->mode)) {
+		if (insert_link_stamp(level->arena, node, id) ||
+		    (charged = charge_file(level->shared, node, id)) == -1)
+			return -1;
+		if (!charged)
+			node->flags |= DTREE_UNCHARGED;
+		count_level_file(level, node);
+		return 0;
+	}
+	level->dirs_num++;
+
+	if (is_other_fs(level->shared, id)) {
+		node->flags |= DTREE_MOUNT_POINT;
+		return 0;
+	}
+	if (insert_entry_stamp(level->arena, node, id))
 		return -1;
-	 if (S_ISDIR(statbuf.st_mode))
-		return rm_dir_r(entry_path);
-	 else
-		return unlink_inf(entry_path);
+	if (!(dir = get_scan_dir(get_scan_local(worker), node, level->dir)))
+		return -1;
+	insert_prev_dir(dir, prev ? prev : find_prev_dir(level, node->fname),
+			id);
+
+	return pool_push(worker, dir);
 }
 
-static int delete_entry(const char *dir_path, const char *entry_name)
+static inline void add_scan_progress(const struct scan_shared *shared,
+				     const struct level *level)
 {
-	char *entry_path;	
-	int retval;
-	
-	retval = -1;
-	if ((entry_path = get_entry_path(dir_path, entry_name))) {
-		if ((retval = _delete_entry(entry_path)))
-			/*
-			 * Ignore permission denied error, but at the same 
-			 * time do not remove the state of ERROR for the
-			 * sake of distinguishing wether the entry got 
-			 * completaly removed or not. 
-			 */
-			if (ERROR == EACCES)
-				retval = 0;
-		free(entry_path);
+	if (shared->progress) {
+		__sync_add_and_fetch(&shared->progress->entries, 
+				     level->files_num + level->dirs_num);
+		__sync_add_and_fetch(&shared->progress->bytes, level->fsize);
 	}
-	return retval;
 }
 
 /*
- * Remove directory's content recursievly
+ * Read the level's entries and stat them one by one
  */
-static int rm_dir_content(DIR *dp, const char *path)
+static int read_level(struct dir_reader *reader, struct level *level,
+		      struct pool_worker *worker)
 {
-	struct dirent *entry;
-	
-	while ((entry = readdir_inf(dp))) {
-		if (is_dot_entry(entry->d_name))
+        struct linux_dirent64 *entry;
+        struct dtree *new_node;
+	struct entry_id id;
+
+	while ((entry = read_dir_reader(reader))) {
+		if (is_skipped_entry(level->dir_path, entry))
 			continue;
-		if (delete_entry(path, entry->d_name))
+		if (!(new_node = get_entry_info(level->arena, level->fd,
+						entry->d_name, &id)))
+			return -1;
+		if (append_level_entry(level, new_node, &id, NULL, worker))
 			return -1;
 	}
 	return ERROR ? -1 : 0;
 }
 
+#ifdef STATX_BASIC_STATS
+static int complete_statx(struct statx_slot *slot, int res, 
+			  struct level *level, struct pool_worker *worker)
+{
+	struct entry_id id;
+	struct dtree *node;
+
+	node = slot->node;
+
+	if (statx_res_inf(res, node->fname))
+		return -1;
+	insert_statx_fields(node, &id, &slot->stx);
+
+	return append_level_entry(level, node, &id, NULL, worker);
+}
+
 /*
- * Remove directory and it's content (recursively)
+ * Submit the prepared requests, wait for wait_nr of them and handle
+ * all the completed ones. A failed entry doesn't stop the reaping, 
+ * it's only recorded in the level.
  */
-static int rm_dir_r(const char *path)
+static int reap_statx(struct scan_local *local, struct level *level,
+		      struct pool_worker *worker, unsigned int wait_nr)
 {
-	int retval;
-	DIR *dp;
+	struct io_uring_cqe *cqe;
+	unsigned int slot_i;
+	int res;
 
-	retval = -1;
+	if (uring_submit_and_wait(&local->ring, wait_nr))
+		return -1;
 
-	if ((dp = opendir_inf(path))) {
-		retval = rm_dir_content(dp, path);
-		
-		if (closedir_inf(dp))
-			retval = -1;
-		/* Remove the directory itself if it's already empty */
-		if (!retval)
-			retval = rmdir_inf(path);
+	while ((cqe = uring_peek_cqe(&local->ring))) {
+		slot_i = cqe->user_data;
+		res = cqe->res;
+		uring_cqe_seen(&local->ring);
+		local->free_slots[local->free_num++] = slot_i;
+
+		if (complete_statx(&local->slots[slot_i], res, level, worker))
+			level->failed = true;
 	}
-	return retval;
+	return 0;
+}
+
+static int queue_statx(struct scan_local *local, struct level *level,
+		       struct pool_worker *worker, const char *entry_name)
+{
+	struct io_uring_sqe *sqe;
+	struct dtree *node;
+	unsigned int slot_i;
+
+	/* Wait for a free slot when all of them are in flight */
+	if (!local->free_num && reap_statx(local, level, worker, 1))
+		return -1;
+	if (!(node = alloc_entry_node(level->arena, entry_name)))
+		return -1;
+
+	slot_i = local->free_slots[--local->free_num];
+	local->slots[slot_i].node = node;
+	/* Can't fail, the in flight requests never exceed the ring's size */
+	sqe = uring_get_sqe(&local->ring);
+	uring_prep_statx(sqe, level->fd, node->fname, 
+			 AT_SYMLINK_NOFOLLOW, STATX_NCDA_MASK, 
+			 &local->slots[slot_i].stx, slot_i);
+	return 0;
 }
 
 /*
- * Remove node from the dtree when it is deleted
+ * Read the level's entries and stat them in batches through io_uring.
+ * The entries are appended in the order their requests complete.
  */
-void purge_node(struct dtree *node)
+static int read_level_uring(struct dir_reader *reader, struct level *level,
+			    struct pool_worker *worker)
 {
-	/* Connect the previous node with the next node */
-	node->prev = node->next;
-	free_dtree(node);
+        struct linux_dirent64 *entry;
+	struct scan_local *local;
+	int retval;
+
+	local = get_scan_local(worker);
+	retval = 0;
+
+	while (!retval && (entry = read_dir_reader(reader)))
+		if (!is_skipped_entry(level->dir_path, entry))
+			retval = queue_statx(local, level, worker, entry->d_name);
+
+	/* Drain the ring anyway, the requests are using the level's fd */
+	while (local->free_num < local->depth)
+		if (reap_statx(local, level, worker, 1))
+			return -1;
+	return (retval || level->failed || ERROR) ? -1 : 0;
 }
 
-int rm_entry(struct dtree *entry)
+static inline bool uses_uring(const struct scan_local *local)
 {
-	if (S_ISDIR(entry->data->file->fstatus->st_mode))
-		return rm_dir_r(entry->data->file->fpath);
-	else
-		return unlink_inf(entry->data->file->fpath);
+	return local->slots != NULL;
+}
+#else
+static inline int read_level_uring(struct dir_reader *reader, 
+				   struct level *level,
+				   struct pool_worker *worker)
+{
+	return read_level(reader, level, worker);
 }
 
-static inline bool is_zero_sized(off_t size)
+static inline bool uses_uring(const struct scan_local *local)
 {
-	return size == 0;
+	(void) local;
+	return false;
 }
+#endif
 
-static inline bool is_relevant_dir_entry(const struct fdata *file)
+static int grow_prev_dirs(struct scan_local *local)
 {
-	return (S_ISDIR(file->fstatus->st_mode) && !is_dot_entry(file->fname));
+	struct snap_entry *prev_dirs;
+	size_t cap;
+
+	cap = local->prev_dirs_cap ? local->prev_dirs_cap * 2 : 64;
+
+	if (!(prev_dirs = malloc_inf(cap * sizeof(struct snap_entry))))
+		return -1;
+	if (local->prev_dirs_cap)
+		memcpy(prev_dirs, local->prev_dirs, 
+		       local->prev_dirs_cap * sizeof(struct snap_entry));
+	free(local->prev_dirs);
+	local->prev_dirs = prev_dirs;
+	local->prev_dirs_cap = cap;
+
+	return 0;
 }
 
 /*
- * Get the acctual directory size (the size of it's content)
+ * Collect the sub-directories of the changed directory's previous level
+ * into the worker's buffer, sorted by name. The ones that are still 
+ * there may be unchanged themselves even though their parent changed.
  */
-static off_t get_acc_dir_size(struct dtree *dir_ptr)
+static int load_prev_dirs(struct scan_local *local, struct level *level)
 {
-	struct dtree *first_entry;
-	struct dtree *current;
-	off_t total;
+	struct snap_entry entry;
+	struct snap_iter iter;
+	size_t num;
+	int retval;
+
+	level->prev_dirs = NULL;
+	level->prev_dirs_num = 0;
 
-	first_entry = dir_ptr->child;
+	if (!level->dir->prev_off)
+		return 0;
+	if (init_snap_iter(&iter, level->shared->prev, 
+			   level->dir->prev_off - 1))
+		return -1;
 
-	for (current=first_entry, total=0; current; current=current->next) {
-		if (is_relevant_dir_entry(current->data->file))
-			current->data->file->fsize = get_acc_dir_size(current);
-		total += current->data->file->fsize;
+	for (num=0; (retval = snap_iter_next(&iter, &entry)) == 1; ) {
+		if (!entry.child_off)
+			continue;
+		if (num == local->prev_dirs_cap && grow_prev_dirs(local))
+			return -1;
+		local->prev_dirs[num++] = entry;
 	}
-	return total;
+	if (retval || !num)
+		return retval;
+
+	qsort(local->prev_dirs, num, sizeof(struct snap_entry), cmp_prev_dirs);
+	level->prev_dirs = local->prev_dirs;
+	level->prev_dirs_num = num;
+
+	return 0;
+}
+
+static inline void insert_snap_fields(struct dtree *node,
+				      const struct snap_entry *entry)
+{
+	node->fsize = get_entry_size(entry->blocks);
+	node->mtime = entry->mtime;
+	node->mode = entry->mode;
+	node->flags = entry->flags;
 }
 
 /*
- * Correct the actual directories' size since it actually 
- * represents only the number of bytes the entry itself is taking.
+ * Take the file as it was in the previous level. A file with more than
+ * one hard link is charged through the link set again, as if its level
+ * was read, and all the files are charged when the links aren't.
  */
-void correct_dirs_fsize(struct dtree *begin)
+static int reuse_level_file(struct level *level, struct dtree *node,
+			    const struct snap_entry *entry)
 {
-	struct dtree *current;
+	const struct scan_shared *shared;
+	int charged;
 
-	for (current=begin; current; current=current->next)
-		if (is_relevant_dir_entry(current->data->file))
-			current->data->file->fsize = get_acc_dir_size(current);	
+	shared = level->shared;
+	insert_snap_fields(node, entry);
+
+	if ((node->flags & DTREE_LINKED) && entry->stamp.ino) {
+		if (!(node->stamp = arena_alloc(level->arena,
+						sizeof(struct dtree_stamp))))
+			return -1;
+		*node->stamp = entry->stamp;
+	}
+	if (!shared->links) {
+		node->flags &= ~DTREE_UNCHARGED;
+	} else if (node->stamp) {
+		if ((charged = link_set_charge(shared->links, entry->stamp.dev,
+					       entry->stamp.ino, node,
+					       shared->replaced)) == -1)
+			return -1;
+		if (charged)
+			node->flags &= ~DTREE_UNCHARGED;
+		else
+			node->flags |= DTREE_UNCHARGED;
+	}
+	link_level_node(level, node);
+	count_level_file(level, node);
+
+	return 0;
 }
 
 /*
- * This function should be called only after calling correct_dtree_st_size() 
- * on the dtree struct 
+ * Rebuild the unchanged directory's level out of its previous level
+ * instead of reading it. The files are taken as they were and only
+ * the sub-directories are stat'ed, to tell whether they've changed.
+ * A file that is modified in place doesn't change its directory, so
+ * it keeps its previous size until its directory changes.
  */
-off_t get_dtree_disk_usage(const struct dtree *begin)
+static int reuse_level(struct level *level, struct pool_worker *worker)
 {
-	const struct dtree *current;
-	off_t total;
+	struct snap_entry entry;
+	struct snap_iter iter;
+	struct entry_id id;
+	struct dtree *node;
+	int retval;
+
+	if (init_snap_iter(&iter, level->shared->prev, 
+			   level->dir->prev_off - 1))
+		return -1;
+
+	while ((retval = snap_iter_next(&iter, &entry)) == 1) {
+		if (is_dot_entry(entry.name))
+			continue;
+		if (!(node = alloc_entry_node(level->arena, entry.name)))
+			return -1;
+
+		if (S_ISDIR(entry.mode)) {
+			if (stat_entry(level->fd, entry.name, node, &id) ||
+			    append_level_entry(level, node, &id, &entry, 
+					       worker))
+				return -1;
+		} else if (reuse_level_file(level, node, &entry)) {
+			return -1;
+		}
+	}
+	return retval;
+}
+
+/*
+ * Read the directory's entries into a new dtree level under dir's node.
+ * Sub-directories are not descended into here, instead they are pushed 
+ * as new jobs to the worker's deque. The level is connected to the node
+ * only once it's read. On failure the partially read level is connected
+ * all the same, since the pushed jobs might be using its nodes.
+ * The dot entries aren't counted in the directory's totals, the dot is 
+ * the directory's node itself and the two dots is its parent. In an
+ * incremental scan an unchanged directory isn't read at all.
+ */
+static int _get_dir_tree(struct dir_reader *reader, struct scan_dir *dir,
+			 const char *dir_path, struct pool_worker *worker)
+{
+	struct scan_local *local;
+	struct dtree *begin;
+	struct level level;
+	int retval;
 
-	for (current=begin, total=0; current; current=current->next)
-		if (!is_dot_entry(current->data->file->fname))
-			total += current->data->file->fsize;
-	return total;
-} 
\ No newline at end of file
+	local = get_scan_local(worker);
+
+	if (!(begin = get_dot_entries(&local->arena, reader->fd, dir->node)))
+		return -1;
+	level.arena = &local->arena;
+	level.shared = local->shared;
+	level.dir = dir;
+	level.last = begin->next;
+	level.dir_path = dir_path;
+	level.fd = reader->fd;
+	level.failed = false;
+	level.fsize = 0;
+	level.files_num = 0;
+	level.dirs_num = 0;
+
+	if (dir->unchanged)
+		retval = reuse_level(&level, worker);
+	else if (load_prev_dirs(local, &level))
+		retval = -1;
+	else if (uses_uring(local))
+		retval = read_level_uring(reader, &level, worker);
+	else
+		retval = read_level(reader, &level, worker);
+
+	add_dir_totals(dir->node, level.fsize, level.files_num, level.dirs_num);
+	add_scan_progress(level.shared, &level);
+	publish_level(dir->node, begin);
+
+	return retval;
+}
+
+/*
+ * Open the directory and read it into a new dtree level with the 
+ * worker's own reading buffer. The directory's path is rebuilt into 
+ * the worker's path buffer, which isn't touched again until the 
+ * level is read.
+ */
+static int read_dir_level(struct scan_dir *dir, struct pool_worker *worker)
+{
+	struct scan_local *local;
+	struct dir_reader reader;
+	const char *dir_path;
+	int fd, retval;
+
+	local = get_scan_local(worker);
+
+	if (!(dir_path = build_dtree_path(&local->path_buf, dir->node)))
+		return -1;
+	if ((fd = open_dir_inf(dir_path)) == -1)
+		return -1;
+
+	init_dir_reader(&reader, fd, local->dents_buf, DIR_READER_BUF_SIZE);
+	retval = _get_dir_tree(&reader, dir, dir_path, worker);
+	
+	if (close_inf(fd))
+		retval = -1;
+	return retval;
+}
+
+/*
+ * Read the directory's level, whether it's read completely or 
+ * not its part of the totals is done.
+ */
+static int scan_level(struct scan_dir *dir, struct pool_worker *worker)
+{
+	int retval;
+
+	retval = read_dir_level(dir, worker);
+	finish_scan_dir(get_scan_local(worker), dir);
+
+	return retval;
+}
+
+/*
+ * The pool's job handler, reads a sub-directory's level
+ */
+static int scan_dir_job(struct pool_worker *worker, void *job)
+{
+	int retval;
+
+	retval = scan_level(job, worker);
+
+	if (retval && ERROR == EACCES)
+		retval = IGNORE_EACCES();
+	return retval;
+}
+
+#ifdef STATX_BASIC_STATS
+/*
+ * Set up the worker's ring, io_uring being unavailable 
+ * is not an error since it falls back to statx().
+ */
+static int init_local_uring(struct scan_local *local, unsigned int depth)
+{
+	unsigned int i;
+
+	local->slots = NULL;
+
+	if (!depth || init_uring(&local->ring, depth, IORING_OP_STATX))
+		return 0;
+	if (!(local->slots = malloc_inf(depth * sizeof(struct statx_slot))))
+		goto err_destroy_ring;
+	if (!(local->free_slots = malloc_inf(depth * sizeof(unsigned int))))
+		goto err_free_slots;
+
+	for (i=0; i<depth; i++)
+		local->free_slots[i] = i;
+	local->free_num = depth;
+	local->depth = depth;
+
+	return 0;
+
+err_free_slots:
+	free_and_null((void **) &local->slots);
+err_destroy_ring:
+	destroy_uring(&local->ring);
+
+	return -1;
+}
+
+static void destroy_local_uring(struct scan_local *local)
+{
+	if (uses_uring(local)) {
+		destroy_uring(&local->ring);
+		free(local->free_slots);
+		free(local->slots);
+	}
+}
+#else
+static inline int init_local_uring(struct scan_local *local, 
+				   unsigned int depth)
+{
+	(void) local;
+	(void) depth;
+	return 0;
+}
+
+static inline void destroy_local_uring(struct scan_local *local)
+{
+	(void) local;
+}
+#endif
+
+/*
+ * Free the workers' locals, handing the nodes that 
+ * were allocated by each worker over to the arena.
+ */
+static void free_scan_locals(struct scan_local *locals, int num,
+			     struct arena *arena)
+{
+	while (num--) {
+		merge_arena(arena, &locals[num].arena);
+		free_path_buf(&locals[num].path_buf);
+		free(locals[num].prev_dirs);
+		destroy_local_uring(&locals[num]);
+		free(locals[num].dents_buf);
+	}
+	free(locals);
+}
+
+static int init_scan_local(struct scan_local *local,
+			   const struct scan_opts *opts,
+			   const struct scan_shared *shared)
+{
+	init_arena(&local->arena);
+	local->shared = shared;
+	init_path_buf(&local->path_buf);
+	local->free_dirs = NULL;
+	local->prev_dirs = NULL;
+	local->prev_dirs_cap = 0;
+
+	if (!(local->dents_buf = malloc_inf(DIR_READER_BUF_SIZE)))
+		return -1;
+	if (init_local_uring(local, opts->uring_depth)) {
+		free(local->dents_buf);
+		return -1;
+	}
+	return 0;
+}
+
+static struct scan_local *alloc_scan_locals(int num, 
+					    const struct scan_opts *opts,
+					    const struct scan_shared *shared,
+					    struct arena *arena)
+{
+	struct scan_local *locals;
+	int i;
+
+	if ((locals = malloc_inf(num * sizeof(struct scan_local))))
+		for (i=0; i<num; i++)
+			if (init_scan_local(&locals[i], opts, shared)) {
+				free_scan_locals(locals, i, arena);
+				return NULL;
+			}
+	return locals;
+}
+
+/*
+ * The root node holds the scanned path as its name, 
+ * the first level's nodes are its children.
+ */
+static struct dtree *get_root_entry(struct arena *arena, const char *path,
+				    struct entry_id *id)
+{
+	struct dtree *root;
+
+	if ((root = get_entry_info(arena, AT_FDCWD, path, id)) &&
+	    insert_entry_stamp(arena, root, id))
+		root = NULL;
+	return root;
+}
+
+/*
+ * Find the root's previous entry, the previous snapshot 
+ * is only used when it was taken of the same path.
+ */
+static int insert_prev_root(const struct scan_shared *shared,
+			    struct scan_dir *root_dir, const char *path,
+			    const struct entry_id *root_id)
+{
+	struct snap_entry entry;
+	struct snap_iter iter;
+	int retval;
+
+	if (!shared->prev)
+		return 0;
+	if (init_snap_iter(&iter, shared->prev, shared->prev->root_off) ||
+	    (retval = snap_iter_next(&iter, &entry)) == -1)
+		return -1;
+	if (retval && efficient_strcmp(entry.name, path) == 0)
+		insert_prev_dir(root_dir, &entry, root_id);
+	return 0;
+}
+
+/*
+ * Scan the directory's tree with a work-stealing pool of opts->threads
+ * threads. Returns the address of the first level's beginning (the dot
+ * entry) just like the sequential scan used to, its parent is the root. 
+ * Every directory's node ends up with the totals of its tree, so there's
+ * no need for another pass over the tree. Every thread allocates out of 
+ * its own arena, at the end they're all merged into arena. It's up to 
+ * the caller to free the arena, even when the scan fails. When there's
+ * a previous snapshot (opts->prev_snap) only the directories that have
+ * changed since are read again. A rescan's hard links take the charges
+ * of the replaced tree over (see link_set_charge()).
+ */
+static struct dtree *scan_dir_tree(const char *path,
+				   const struct scan_opts *opts,
+				   const struct dtree *replaced,
+				   struct arena *arena)
+{
+	struct scan_shared shared;
+	struct scan_local *locals;
+        struct dtree *retval, *root;
+	struct scan_dir *root_dir;
+	struct link_set links;
+	struct entry_id root_id;
+	struct snapshot prev;
+	struct pool *pool;
+
+	retval = NULL;
+
+	if (!(root = get_root_entry(arena, path, &root_id)))
+		return NULL;
+
+	shared.links = !opts->links_once ? NULL : 
+		       opts->links ? opts->links : &links;
+	shared.replaced = replaced;
+	shared.prev = opts->prev_snap ? &prev : NULL;
+	shared.root_dev = root_id.stamp.dev;
+	shared.one_fs = opts->one_fs;
+	shared.progress = opts->progress;
+
+	if (shared.prev && open_snapshot(&prev, opts->prev_snap))
+		return NULL;
+	/* The older snapshots don't keep the hard links' inodes */
+	if (shared.prev && shared.links && prev.version < 3) {
+		if (close_snapshot(&prev))
+			return NULL;
+		shared.prev = NULL;
+	}
+	if (shared.links == &links && init_link_set(&links))
+		goto out_close_prev;
+	if (!(pool = alloc_pool(opts->threads, scan_dir_job, NULL)))
+		goto out_destroy_links;
+	if (!(locals = alloc_scan_locals(pool->workers_num, opts,
+					 &shared, arena)))
+		goto out_free_pool;
+
+	pool->arg = locals;
+
+	if (shared.progress)
+		__atomic_store_n(&shared.progress->root, root, __ATOMIC_RELEASE);
+	/* The first level is read here to seed the pool with jobs */
+	if ((root_dir = get_scan_dir(&locals[0], root, NULL)) &&
+	    !insert_prev_root(&shared, root_dir, path, &root_id) &&
+	    !scan_level(root_dir, &pool->workers[0]) && !pool_run(pool))
+		retval = root->child;
+
+	free_scan_locals(locals, pool->workers_num, arena);
+out_free_pool:
+	free_pool(pool);
+out_destroy_links:
+	if (shared.links == &links)
+		destroy_link_set(&links);
+out_close_prev:
+	if (shared.prev && close_snapshot(&prev))
+		retval = NULL;
+
+        return retval;
+}
+
+struct dtree *get_dir_tree(const char *path, const struct scan_opts *opts,
+			   struct arena *arena)
+{
+	return scan_dir_tree(path, opts, NULL, arena);
+}
+
+static void *bg_scan_routine(void *arg)
+{
+	struct bg_scan *scan;
+	struct dtree *begin;
+
+	scan = arg;
+	begin = get_dir_tree(scan->path, &scan->opts, scan->arena);
+	scan->error = begin ? 0 : ERROR;
+	scan->begin = begin;
+	__atomic_store_n(&scan->done, true, __ATOMIC_RELEASE);
+
+	return NULL;
+}
+
+/*
+ * Scan the directory's tree in a background thread, just like 
+ * get_dir_tree(). The levels that are already read can be browsed
+ * meanwhile, their directories' sizes grow as their trees are done.
+ * The arena mustn't be touched until the scan is joined.
+ */
+int start_bg_scan(struct bg_scan *scan, const char *path, 
+		  const struct scan_opts *opts, struct arena *arena)
+{
+	scan->path = path;
+	scan->opts = *opts;
+	scan->opts.progress = &scan->progress;
+	scan->arena = arena;
+	scan->progress.root = NULL;
+	scan->progress.entries = 0;
+	scan->progress.bytes = 0;
+	scan->begin = NULL;
+	scan->error = 0;
+	scan->done = false;
+
+	return pthread_create_inf(&scan->thread, bg_scan_routine, scan) ? -1 : 0;
+}
+
+bool is_bg_scan_done(const struct bg_scan *scan)
+{
+	return __atomic_load_n(&scan->done, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Get the node's child, which might be published by the running
+ * scan. NULL means its level isn't read yet (or it has none).
+ */
+struct dtree *get_published_child(const struct dtree *node)
+{
+	return __atomic_load_n(&node->child, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Get the next node of the tree in pre-order, without going above the
+ * root. The levels are taken as they're published, so the tree can be
+ * walked while it's still being scanned. The trees that are pending 
+ * removal are skipped, apart from their own nodes.
+ */
+const struct dtree *get_next_dtree(const struct dtree *node,
+				   const struct dtree *root)
+{
+	const struct dtree *child;
+
+	if (!is_dot_entry(node->fname) && !(node->flags & DTREE_PENDING) &&
+	    (child = get_published_child(node)))
+		return child;
+
+	for (; node != root; node=node->parent)
+		if (node->next)
+			return node->next;
+	return NULL;
+}
+
+/*
+ * Wait until the scan's first level is read, it can be browsed while 
+ * the rest of the tree is still being scanned. Returns NULL if the scan
+ * failed before, it's up to the caller to join the scan either way.
+ */
+struct dtree *wait_bg_scan_level(const struct bg_scan *scan)
+{
+	const struct timespec nap = { 0, 10 * 1000 * 1000 };
+	struct dtree *root, *begin;
+
+	while (!is_bg_scan_done(scan)) {
+		root = __atomic_load_n(&scan->progress.root, __ATOMIC_ACQUIRE);
+
+		if (root && (begin = get_published_child(root)))
+			return begin;
+		nanosleep(&nap, NULL);
+	}
+	if (!scan->begin)
+		ERROR = scan->error;
+	return scan->begin;
+}
+
+/*
+ * Wait for the scan to finish, returns what get_dir_tree() would
+ */
+struct dtree *join_bg_scan(struct bg_scan *scan)
+{
+	pthread_join(scan->thread, NULL);
+
+	if (!scan->begin)
+		ERROR = scan->error;
+	return scan->begin;
+}
+
+/*
+ * Take the scanned tree's root over as the directory's node
+ */
+static void adopt_scanned_root(struct dtree *node, struct dtree *begin)
+{
+	struct dtree *root, *current;
+
+	root = begin->parent;
+	node->fsize = root->fsize;
+	node->files_num = root->files_num;
+	node->dirs_num = root->dirs_num;
+	node->stamp = root->stamp;
+	node->child = begin;
+
+	/* See insert_dtree() */
+	for (current=begin; current; current=current->next)
+		__atomic_store_n(&current->parent, node, __ATOMIC_RELEASE);
+}
+
+/*
+ * Whether the new file's blocks should be added to the totals. The
+ * hard links that the caller keeps (opts->links) are charged just like
+ * in the scans. Otherwise a file with more than one link is most likely
+ * a new link of an already charged file, so it's left uncharged.
+ */
+static int charge_new_file(const struct scan_opts *opts,
+			   const struct dtree *node, const struct entry_id *id,
+			   const struct dtree *replaced)
+{
+	if (!opts->links_once || id->nlink < 2)
+		return 1;
+	if (!opts->links)
+		return 0;
+	return link_set_charge(opts->links, id->stamp.dev, id->stamp.ino,
+			       node, replaced);
+}
+
+/*
+ * Get the node of an entry that showed up after the scan, named name
+ * and found at path, with its whole tree if it's a directory (unless
+ * it's another file system's mount point). When the entry is scanned
+ * again, replaced is its old node (or tree), whose hard links' charges
+ * are taken over. It's up to the caller to link the node into the tree.
+ */
+struct dtree *get_new_entry(const char *path, const char *name,
+			    const struct scan_opts *opts, dev_t root_dev,
+			    const struct dtree *replaced, struct arena *arena)
+{
+	struct dtree *node, *begin;
+	struct entry_id id;
+	int charged;
+
+	if (!(node = alloc_entry_node(arena, name)))
+		return NULL;
+	if (stat_entry(AT_FDCWD, path, node, &id))
+		return NULL;
+
+	if (!S_ISDIR(node->mode)) {
+		if (insert_link_stamp(arena, node, &id) ||
+		    (charged = charge_new_file(opts, node, &id, replaced)) == -1)
+			return NULL;
+		if (!charged)
+			node->flags |= DTREE_UNCHARGED;
+		return node;
+	}
+	if (opts->one_fs && id.stamp.dev != root_dev) {
+		node->flags |= DTREE_MOUNT_POINT;
+		return node;
+	}
+	if (!(begin = scan_dir_tree(path, opts, replaced, arena))) {
+		/* Just like a sub-directory that couldn't be read */
+		if (ERROR != EACCES)
+			return NULL;
+		IGNORE_EACCES();
+		return node;
+	}
+	adopt_scanned_root(node, begin);
+
+	return node;
+}
+
+/*
+ * Release the hard links' charges that the tree's nodes own, once it's
+ * taken out of the dtree (see link_set_release()). Returns whether any
+ * is released, the other links of their inodes are charged then with
+ * recharge_dtree_links().
+ */
+bool release_dtree_links(struct link_set *set, const struct dtree *node)
+{
+	const struct dtree *current;
+	bool released;
+
+	released = false;
+
+	for (current=node; current; current=get_next_dtree(current, node))
+		if ((current->flags & DTREE_LINKED) && current->stamp &&
+		    link_set_release(set, current->stamp->dev, 
+				     current->stamp->ino, current))
+			released = true;
+	return released;
+}
+
+/*
+ * Charge the uncharged hard links in the root's tree whose inodes' 
+ * charges were released, their blocks are added up to their ancestors.
+ * The trees that are pending removal are left as they are.
+ */
+void recharge_dtree_links(struct link_set *set, struct dtree *root)
+{
+	struct dtree *current;
+
+	for (current=root; current; 
+	     current=(struct dtree *) get_next_dtree(current, root)) {
+		if (!(current->flags & DTREE_UNCHARGED) || !current->stamp ||
+		    !link_set_take_over(set, current->stamp->dev,
+					current->stamp->ino, current))
+			continue;
+		add_dtree_totals(current->parent, current, -1);
+		current->flags &= ~DTREE_UNCHARGED;
+		add_dtree_totals(current->parent, current, 1);
+	}
+}
+
+/*
+ * Hand the charges of the detached node's hard links over to their
+ * other links in the tree, when the caller keeps the links.
+ */
+static void hand_over_links(const struct scan_opts *opts,
+			    const struct dtree *node)
+{
+	struct dtree *root;
+
+	if (!opts->links_once || !opts->links ||
+	    !release_dtree_links(opts->links, node))
+		return;
+	for (root=node->parent; root->parent; root=root->parent)
+		;
+	recharge_dtree_links(opts->links, root);
+}
+
+/*
+ * Get the device whose file system the rescan of the node at path stays
+ * on. It's its directory's, apart from another file system's mount point
+ * (a placeholder), which is asked to be scanned on its own file system.
+ */
+static int get_rescan_dev(const struct dtree *node, const char *path,
+			  dev_t *dev)
+{
+	struct stat statbuf;
+
+	if (node->flags & DTREE_MOUNT_POINT) {
+		if (lstat_inf(path, &statbuf))
+			return -1;
+		*dev = statbuf.st_dev;
+		return 0;
+	}
+	for (node=node->parent; node && !node->stamp; node=node->parent)
+		;
+	*dev = node ? node->stamp->dev : 0;
+
+	return 0;
+}
+
+/*
+ * Scan the entry again in place. Its new node (with its whole tree if
+ * it's a directory) takes the old one's place in its level, and the 
+ * difference is added up to its ancestors. A file keeps the way it was
+ * charged unless the caller keeps the hard links (opts->links), then 
+ * the old tree's charges that aren't taken over are handed over to the
+ * other links. Returns the new node, or NULL on failure, which leaves 
+ * the old one as it is unless the entry is gone (ERROR is ENOENT), it's
+ * detached then.
+ */
+struct dtree *rescan_dtree(struct dtree *node, const struct scan_opts *opts,
+			   struct arena *arena)
+{
+	struct dtree *new_node;
+	struct path_buf pb;
+	const char *path;
+	dev_t dev;
+
+	new_node = NULL;
+	init_path_buf(&pb);
+
+	if (!(path = build_dtree_path(&pb, node)))
+		goto out_free_path_buf;
+	if (get_rescan_dev(node, path, &dev) ||
+	    !(new_node = get_new_entry(path, node->fname, opts, dev, node,
+				       arena))) {
+		if (ERROR == ENOENT) {
+			detach_dtree(node);
+			hand_over_links(opts, node);
+		}
+		goto out_free_path_buf;
+	}
+	if (!S_ISDIR(new_node->mode) && !opts->links)
+		new_node->flags = (new_node->flags & ~DTREE_UNCHARGED) | 
+				  (node->flags & DTREE_UNCHARGED);
+	detach_dtree(node);
+	insert_dtree(node->parent, node->prev, new_node);
+	hand_over_links(opts, node);
+
+out_free_path_buf:
+	free_path_buf(&pb);
+
+	return new_node;
+}
+
+/*
+ * Stat the file's entry at path again after it was modified, its size
+ * difference is added up to its ancestors (see resize_dtree()).
+ */
+int restat_entry(struct dtree *node, const char *path)
+{
+	struct entry_id id;
+	off_t prev_fsize, fsize;
+
+	prev_fsize = node->fsize;
+
+	if (stat_entry(AT_FDCWD, path, node, &id))
+		return -1;
+	fsize = node->fsize;
+	node->fsize = prev_fsize;
+	resize_dtree(node, fsize);
+
+	return 0;
+}
+
+/*
+ * Get the reading buffer of the depth level, allocating it when it's
+ * the first time this level is reached (levels are reached in order).
+ */
+static char *get_level_buf(struct rm_bufs *bufs, size_t depth)
+{
+	char **levels;
+
+	if (depth < bufs->num)
+		return bufs->levels[depth];
+	if (!(levels = malloc_inf((depth + 1) * sizeof(char *))))
+		return NULL;
+	if (!(levels[depth] = malloc_inf(DIR_READER_BUF_SIZE))) {
+		free(levels);
+		return NULL;
+	}
+	if (bufs->num)
+		memcpy(levels, bufs->levels, bufs->num * sizeof(char *));
+	free(bufs->levels);
+	bufs->levels = levels;
+	bufs->num++;
+
+	return levels[depth];
+}
+
+static void free_rm_bufs(struct rm_bufs *bufs)
+{
+	while (bufs->num--)
+		free(bufs->levels[bufs->num]);
+	free(bufs->levels);
+}
+
+static int _delete_entry(const char *entry_path, unsigned char d_type,
+			 struct rm_bufs *bufs, size_t depth)
+{
+	struct stat statbuf;
+
+	/* Only stat the entry if the file system didn't report its type */
+	if (d_type == DT_UNKNOWN) {
+		if (lstat_inf(entry_path, &statbuf))
+			return -1;
+		d_type = IFTODT(statbuf.st_mode);
+	}
+	if (d_type == DT_DIR)
+		return rm_dir_r(entry_path, bufs, depth);
+	else
+		return unlink_inf(entry_path);
+}
+
+static int delete_entry(const char *dir_path, 
+			const struct linux_dirent64 *entry,
+			struct rm_bufs *bufs, size_t depth)
+{
+	char *entry_path;	
+	int retval;
+	
+	retval = -1;
+	if ((entry_path = get_entry_path(dir_path, entry->d_name))) {
+		if ((retval = _delete_entry(entry_path, entry->d_type, 
+					    bufs, depth)))
+			/*
+			 * Ignore permission denied error, but at the same 
+			 * time do not remove the state of ERROR for the
+			 * sake of distinguishing wether the entry got 
+			 * completaly removed or not. 
+			 */
+			if (ERROR == EACCES)
+				retval = 0;
+		free(entry_path);
+	}
+	return retval;
+}
+
+/*
+ * Remove directory's content recursievly
+ */
+static int rm_dir_content(struct dir_reader *reader, const char *path,
+			  struct rm_bufs *bufs, size_t depth)
+{
+	struct linux_dirent64 *entry;
+	
+	while ((entry = read_dir_reader(reader))) {
+		if (is_dot_entry(entry->d_name))
+			continue;
+		if (delete_entry(path, entry, bufs, depth + 1))
+			return -1;
+	}
+	return ERROR ? -1 : 0;
+}
+
+/*
+ * Remove directory and it's content (recursively)
+ */
+static int rm_dir_r(const char *path, struct rm_bufs *bufs, size_t depth)
+{
+	struct dir_reader reader;
+	int retval, fd;
+	char *buf;
+
+	if (!(buf = get_level_buf(bufs, depth)))
+		return -1;
+	if ((fd = open_dir_inf(path)) == -1)
+		return -1;
+
+	init_dir_reader(&reader, fd, buf, DIR_READER_BUF_SIZE);
+	retval = rm_dir_content(&reader, path, bufs, depth);
+		
+	if (close_inf(fd))
+		retval = -1;
+	/* Remove the directory itself if it's already empty */
+	if (!retval)
+		retval = rmdir_inf(path);
+
+	return retval;
+}
+
+/*
+ * Whether the failed unlinkat() found the entry already gone, 
+ * which isn't a failure of the removal.
+ */
+static inline bool is_gone_entry()
+{
+	if (ERROR != ENOENT)
+		return false;
+	ERROR = 0;
+	return true;
+}
+
+/*
+ * Remove the entry at path, whatever it is on the disk by now. It's
+ * the fallback for the entries that the dtree doesn't tell right.
+ * Returns 1 when the entry was already gone, so it isn't counted.
+ */
+static int rm_path(const char *path, struct rm_bufs *bufs)
+{
+	if (unlinkat_inf(AT_FDCWD, path, 0) == 0)
+		return 0;
+	if (is_gone_entry())
+		return 1;
+	if (ERROR != EISDIR)
+		return -1;
+	/* The directory's reader tells its end from a failure by ERROR */
+	ERROR = 0;
+
+	return rm_dir_r(path, bufs, 0);
+}
+
+static inline struct rm_local *get_rm_local(const struct pool_worker *worker)
+{
+	return (struct rm_local *) worker->pool->arg + worker->id;
+}
+
+static struct rm_dir *get_rm_dir(struct rm_local *local, struct dtree *node,
+				 struct rm_dir *parent)
+{
+	struct rm_dir *dir;
+
+	if ((dir = local->free_dirs))
+		local->free_dirs = dir->parent;
+	else if (!(dir = arena_alloc(&local->arena, sizeof(struct rm_dir))))
+		return NULL;
+
+	dir->node = node;
+	dir->parent = parent;
+	dir->pending = 1;
+
+	if (parent)
+		__sync_add_and_fetch(&parent->pending, 1);
+	return dir;
+}
+
+static inline void add_rm_progress(const struct rm_local *local,
+				   unsigned long entries, off_t bytes)
+{
+	if (local->progress) {
+		__sync_add_and_fetch(&local->progress->entries, entries);
+		__sync_add_and_fetch(&local->progress->bytes, bytes);
+	}
+}
+
+/*
+ * Remove the emptied directory. The entries that showed up after the
+ * scan leave it non-empty, it's then removed as it is on the disk.
+ * Returns 1 when the directory was already gone.
+ */
+static int rm_empty_dir(struct rm_local *local, const struct dtree *node)
+{
+	const char *path;
+
+	if (!(path = build_dtree_path(&local->path_buf, node)))
+		return -1;
+	if (unlinkat_inf(AT_FDCWD, path, AT_REMOVEDIR) == 0)
+		return 0;
+	if (is_gone_entry())
+		return 1;
+	if (ERROR != ENOTEMPTY)
+		return -1;
+	ERROR = 0;
+
+	return rm_dir_r(path, &local->bufs, 0);
+}
+
+/*
+ * Mark one of the directory's pending parts as done. The last one 
+ * removes the directory itself, which might complete its parent as 
+ * well and so on up the tree.
+ */
+static int finish_rm_dir(struct rm_local *local, struct rm_dir *dir)
+{
+	struct rm_dir *parent;
+	int removed;
+
+	while (dir && __sync_sub_and_fetch(&dir->pending, 1) == 0) {
+		if ((removed = rm_empty_dir(local, dir->node)) == -1)
+			return -1;
+		if (removed == 0)
+			add_rm_progress(local, 1, 0);
+
+		parent = dir->parent;
+		dir->parent = local->free_dirs;
+		local->free_dirs = dir;
+		dir = parent;
+	}
+	return 0;
+}
+
+/*
+ * Unlink the file relative to its directory's fd. A file that became
+ * a directory since the scan is removed by its path instead. Returns
+ * 1 when the file was already gone.
+ */
+static int rm_level_file(struct rm_local *local, int dir_fd,
+			 const struct dtree *node)
+{
+	const char *path;
+
+	if (unlinkat_inf(dir_fd, node->fname, 0) == 0)
+		return 0;
+	if (is_gone_entry())
+		return 1;
+	if (ERROR != EISDIR)
+		return -1;
+	if (!(path = build_dtree_path(&local->path_buf, node)))
+		return -1;
+	return rm_path(path, &local->bufs);
+}
+
+/*
+ * Unlink the level's files and push its sub-directories as new jobs,
+ * the types are taken from the dtree instead of stat'ing the entries.
+ */
+static int _rm_level(struct rm_dir *dir, int dir_fd, 
+		     struct pool_worker *worker)
+{
+	struct rm_local *local;
+	struct rm_dir *sub_dir;
+	struct dtree *current;
+	unsigned long files_num;
+	off_t fsize;
+	int retval, removed;
+
+	local = get_rm_local(worker);
+	files_num = 0;
+	fsize = 0;
+	retval = 0;
+
+	for (current=dir->node->child; current; current=current->next) {
+		if (is_dot_entry(current->fname))
+			continue;
+		if (S_ISDIR(current->mode)) {
+			if (!(sub_dir = get_rm_dir(local, current, dir)) ||
+			    pool_push(worker, sub_dir)) {
+				retval = -1;
+				break;
+			}
+		} else {
+			if ((removed = rm_level_file(local, dir_fd, 
+						     current)) == -1) {
+				retval = -1;
+				break;
+			}
+			/* The files that were already gone aren't counted */
+			if (removed)
+				continue;
+			files_num++;
+			if (!(current->flags & DTREE_UNCHARGED))
+				fsize += current->fsize;
+		}
+	}
+	add_rm_progress(local, files_num, fsize);
+
+	return retval;
+}
+
+/*
+ * Remove the directory's level, whether it's removed completely or 
+ * not its part is done. The directory is opened just for its files.
+ */
+static int rm_level(struct rm_dir *dir, struct pool_worker *worker)
+{
+	struct rm_local *local;
+	const char *path;
+	int fd, retval;
+
+	local = get_rm_local(worker);
+	retval = -1;
+
+	if ((path = build_dtree_path(&local->path_buf, dir->node))) {
+		if ((fd = open_dir_inf(path)) != -1) {
+			retval = _rm_level(dir, fd, worker);
+
+			if (close_inf(fd))
+				retval = -1;
+		} else if (ERROR == ENOENT) {
+			/* A directory that is gone since the scan is done */
+			ERROR = 0;
+			retval = 0;
+		}
+	}
+	if (finish_rm_dir(local, dir))
+		retval = -1;
+	return retval;
+}
+
+/*
+ * The pool's job handler, removes a sub-directory's level
+ */
+static int rm_dir_job(struct pool_worker *worker, void *job)
+{
+	return rm_level(job, worker);
+}
+
+static void free_rm_locals(struct rm_local *locals, int num)
+{
+	while (num--) {
+		free_arena(&locals[num].arena);
+		free_path_buf(&locals[num].path_buf);
+		free_rm_bufs(&locals[num].bufs);
+	}
+	free(locals);
+}
+
+static struct rm_local *alloc_rm_locals(int num, struct rm_progress *progress)
+{
+	struct rm_local *locals;
+	int i;
+
+	if ((locals = malloc_inf(num * sizeof(struct rm_local))))
+		for (i=0; i<num; i++) {
+			init_arena(&locals[i].arena);
+			init_path_buf(&locals[i].path_buf);
+			locals[i].bufs.levels = NULL;
+			locals[i].bufs.num = 0;
+			locals[i].free_dirs = NULL;
+			locals[i].progress = progress;
+		}
+	return locals;
+}
+
+/*
+ * Remove the directory's tree with a work-stealing pool of threads 
+ * (all the online CPUs when threads is zero or less). Every directory
+ * is opened once and its files are unlinked relative to it, and once
+ * all of its sub-directories are removed it's removed too. The removed
+ * entries are counted in progress unless it's NULL, the ones that were
+ * already gone aren't. The dtree itself is left as it is.
+ */
+static int rm_dtree_dir(struct dtree *dir, int threads,
+			struct rm_progress *progress)
+{
+	struct rm_local *locals;
+	struct rm_dir *root_dir;
+	struct pool *pool;
+	int retval;
+
+	retval = -1;
+
+	if (!(pool = alloc_pool(threads, rm_dir_job, NULL)))
+		return -1;
+	if (!(locals = alloc_rm_locals(pool->workers_num, progress)))
+		goto out_free_pool;
+
+	pool->arg = locals;
+	/* The first level is removed here to seed the pool with jobs */
+	if ((root_dir = get_rm_dir(&locals[0], dir, NULL)) &&
+	    !rm_level(root_dir, &pool->workers[0]) && !pool_run(pool))
+		retval = 0;
+
+	free_rm_locals(locals, pool->workers_num);
+out_free_pool:
+	free_pool(pool);
+
+	return retval;
+}
+
+/*
+ * Remove the entry from the disk, its whole tree if it's a directory 
+ * (see rm_dtree_dir()). The entry's node is left in the dtree.
+ */
+int rm_dtree(struct dtree *entry, int threads, struct rm_progress *progress)
+{
+	struct path_buf pb;
+	struct rm_bufs bufs;
+	const char *path;
+	int retval, removed;
+
+	if (S_ISDIR(entry->mode))
+		return rm_dtree_dir(entry, threads, progress);
+
+	init_path_buf(&pb);
+	bufs.levels = NULL;
+	bufs.num = 0;
+	retval = -1;
+
+	if ((path = build_dtree_path(&pb, entry)) && 
+	    (removed = rm_path(path, &bufs)) != -1) {
+		if (progress && !removed) {
+			__sync_add_and_fetch(&progress->entries, 1);
+			__sync_add_and_fetch(&progress->bytes, 
+					     (entry->flags & DTREE_UNCHARGED) ? 
+					     0 : entry->fsize);
+		}
+		retval = 0;
+	}
+	free_rm_bufs(&bufs);
+	free_path_buf(&pb);
+
+	return retval;
+}
+
+int rm_entry(struct dtree *entry)
+{
+	return rm_dtree(entry, 0, NULL);
+}
+
+static inline bool is_zero_sized(off_t size)
+{
+	return size == 0;
+}
+
+/*
+ * The directories' totals are accumulated while they're 
+ * scanned, so a directory's disk usage is its node's size.
+ */
+off_t get_dtree_disk_usage(const struct dtree *dir)
+{
+	return dir->fsize;
+}
@@ -19,6 +19,8 @@
 #include "informative.h"
 #include "general.h"
 
+#define SECS_IN_DAY ((time_t) 60 * 60 * 24)
+
 
 void free_and_null(void **ptr)
 {
@@ -99,101 +101,46 @@ struct size_format get_proper_size_format(off_t bytes)
 		return proper_size_format(bytes, "B");
 }
 
-static void remove_plural_s(char *str)
-{
-	size_t len;
-
-	len = strlen(str);
-	str[--len] = '\0';
-}
-
-static char *_mtime_str(unsigned int num, char *period)
-{
-	char *retval;
-	size_t size;	
-
-	if (num == 1)
-		remove_plural_s(period);
-	size = sizeof(num) + strlen(period) + sizeof(' ') + 1;
-	
-	if ((retval = malloc_inf(size)))
-		snprintf(retval, size, "%2d %s", num, period);
-	return retval;
-}
-
-static inline char *mtime_str_century(unsigned int num)
-{
-	char period[] = "centuries";
-
-	return _mtime_str(num, period);
-}
-
-static inline char *mtime_str_decade(unsigned int num)
-{
-	char period[] = "decades";
-
-	return _mtime_str(num, period);
-}
-
-static inline char *mtime_str_year(unsigned int num)
-{
-	char period[] = "years";
-
-	return _mtime_str(num, period);
-}
-
-static inline char *mtime_str_month(unsigned int num)
-{
-	char period[] = "months";
-
-	return _mtime_str(num, period);
-}
-
-static inline char *mtime_str_week(unsigned int num)
-{
-	char period[] = "weeks";
-
-	return _mtime_str(num, period);
-}
+/* The ages' periods, from the longest */
+static const struct {
+	time_t secs;
+	const char *name;
+	const char *plural;
+} _periods[] = {
+	{ SECS_IN_DAY * 365 * 100, "century", "centuries" },
+	{ SECS_IN_DAY * 365 * 10, "decade", "decades" },
+	{ SECS_IN_DAY * 365, "year", "years" },
+	{ SECS_IN_DAY * 30, "month", "months" },
+	{ SECS_IN_DAY * 7, "week", "weeks" },
+	{ SECS_IN_DAY, "day", "days" }
+};
 
-static inline char *mtime_str_day(unsigned int num)
+/*
+ * Format the age of mtime at now (e.g. " 3 weeks") into buf without any
+ * allocation. Returns the time from which on the formatted age is out 
+ * of date, when its count or its period changes.
+ */
+time_t format_mtime(char *buf, size_t size, time_t mtime, time_t now)
 {
-	char period[] = "days";
+	const size_t periods_num = sizeof(_periods) / sizeof(_periods[0]);
+	time_t difference, num, secs, stale;
+	size_t i;
 
-	return _mtime_str(num, period);
-}
- 
-static char *mtime_str(time_t difference)
-{
-	const time_t sec_in_day = 60 * 60 * 24;
-	const time_t century = sec_in_day * 365 * 100;
-	const time_t decade = sec_in_day * 365 * 10;
-	const time_t year = sec_in_day * 365;
-	const time_t month = sec_in_day * 30;
-	const time_t week = sec_in_day * 7;
-
-	if (difference >= century)
-		return mtime_str_century(difference/century);
-	else if (difference >= decade)
-		return mtime_str_decade(difference/decade);
-	else if (difference >= year)
-		return mtime_str_year(difference/year);
-	else if (difference >= month)
-		return mtime_str_month(difference/month);
-	else if (difference >= week)
-		return mtime_str_week(difference/week);
-	else
-		return mtime_str_day(difference/sec_in_day);
-}
+	difference = (now > mtime) ? now - mtime : 0;
 
-char *get_mtime_str(time_t mtime)
-{
-	time_t today;
+	for (i=0; i<periods_num-1; i++)
+		if (difference >= _periods[i].secs)
+			break;
+	secs = _periods[i].secs;
+	num = difference / secs;
+	snprintf(buf, size, "%2ld %s", (long) num, 
+		 (num == 1) ? _periods[i].name : _periods[i].plural);
 
-	if ((today = time_inf(NULL)) != -1)
-		return mtime_str(today-mtime);
-	else
-		return NULL;
+	/* The next count, unless the longer period comes first */
+	stale = (num + 1) * secs;
+	if (i && _periods[i - 1].secs < stale)
+		stale = _periods[i - 1].secs;
+	return mtime + stale;
 }
 
 size_t get_strsize(const char *str)
@@ -204,20 +151,24 @@ size_t get_strsize(const char *str)
 }
 
 /*
- * Extract directory's path from the first entry path (dot_entry)
+ * Make room for at least num elements, doubling the capacity
  */
-char *extract_dir_path(const char *dot_entry_path)
+int reserve_array(void **arr, size_t *cap, size_t num, size_t size)
 {
-	size_t len;
-	char *path;
-
-	len = get_strsize(dot_entry_path);
-	
-	if (len > 2)
-		len--;
-	if ((path = malloc_inf(len))) {
-		memcpy(path, dot_entry_path, len);
-		path[--len] = '\0';
-	}
-	return path;
-}
\ No newline at end of file
+	size_t new_cap;
+	void *new_arr;
+
+	if (num <= *cap)
+		return 0;
+	for (new_cap=*cap ? *cap : 64; new_cap<num; new_cap*=2)
+		;
+	if (!(new_arr = malloc_inf(new_cap * size)))
+		return -1;
+	if (*cap)
+		memcpy(new_arr, *arr, *cap * size);
+	free(*arr);
+	*arr = new_arr;
+	*cap = new_cap;
+
+	return 0;
+}
@@ -7,13 +7,100 @@
 | sages added to them in case of failures.                |
 -----------------------------------------------------------
 */
+
+/*
+ * Defining _GNU_SOURCE macro since it achives all the desired
+ * feature test macro requirements, which are:
+ *     1) _ATFILE_SOURCE || _POSIX_C_SOURCE >= 200809L for fstatat() and
+ *        unlinkat()
+ *     2) _GNU_SOURCE for statx()
+ *     3) _DEFAULT_SOURCE for syscall()
+ */
+#define _GNU_SOURCE
 #include <error.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdarg.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
 #include <unistd.h>
+#include <sys/mman.h>
+#include <sys/inotify.h>
+#include <sys/syscall.h>
 #include "informative.h"
 
-int ERROR = 0;
+/* Thread local, since the directories are scanned in parallel */
+__thread int ERROR = 0;
+
+/*
+ * The errors are held back instead of being printed while the window 
+ * is up (see hold_errors()), only their number and the last one are kept.
+ */
+static pthread_mutex_t held_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool held;
+static unsigned long held_num;
+static char held_last[256];
+
+
+/*
+ * Hold the errors back from now on (or print them again), since they
+ * would be printed over the window by any thread.
+ */
+void hold_errors(bool hold)
+{
+	pthread_mutex_lock(&held_lock);
+	held = hold;
+	pthread_mutex_unlock(&held_lock);
+}
+
+/*
+ * Get the number of the errors that were held back so far, 
+ * with the last one's message copied into last.
+ */
+unsigned long get_held_errors(char *last, size_t size)
+{
+	unsigned long num;
+
+	pthread_mutex_lock(&held_lock);
+	num = held_num;
+	snprintf(last, size, "%s", held_last);
+	pthread_mutex_unlock(&held_lock);
+
+	return num;
+}
+
+/*
+ * Print the message like error() does (with errnum's description
+ * unless it's zero), or hold it back while the errors are held.
+ */
+void report_error(int errnum, const char *format, ...)
+{
+	char message[sizeof(held_last)];
+	va_list args;
+	size_t len;
+
+	va_start(args, format);
+	vsnprintf(message, sizeof(message), format, args);
+	va_end(args);
+
+	pthread_mutex_lock(&held_lock);
+
+	if (!held) {
+		pthread_mutex_unlock(&held_lock);
+		error(0, errnum, "%s", message);
+		return;
+	}
+	len = strlen(message);
+	if (errnum)
+		snprintf(message + len, sizeof(message) - len, ": %s", 
+			 strerror(errnum));
+	memcpy(held_last, message, sizeof(held_last));
+	held_num++;
+
+	pthread_mutex_unlock(&held_lock);
+}
 
 
 void *malloc_inf(size_t size)
@@ -22,7 +109,18 @@ void *malloc_inf(size_t size)
 
         if(!(retval = malloc(size))) {
 		ERROR = errno;
-                error(0, errno, "could not allocate memory");
+                report_error(errno, "could not allocate memory");
+	}
+	return retval;
+}
+
+void *calloc_inf(size_t nmemb, size_t size)
+{
+        void *retval;
+
+        if(!(retval = calloc(nmemb, size))) {
+		ERROR = errno;
+                report_error(errno, "could not allocate memory");
 	}
 	return retval;
 }
@@ -33,18 +131,57 @@ int lstat_inf(const char *path, struct stat *statbuf)
 
         if ((retval = lstat(path, statbuf))) {
 		ERROR = errno;
-                error(0, errno, "could not get entry's status '%s'", path);
+                report_error(errno, "could not get entry's status '%s'", path);
+	}
+        return retval;
+}
+
+int fstatat_inf(int dir_fd, const char *path, struct stat *statbuf, int flags)
+{
+        int retval;
+
+        if ((retval = fstatat(dir_fd, path, statbuf, flags))) {
+		ERROR = errno;
+                report_error(errno, "could not get entry's status '%s'", path);
 	}
         return retval;
 }
 
+#ifdef STATX_BASIC_STATS
+int statx_inf(int dir_fd, const char *path, int flags, 
+	      unsigned int mask, struct statx *statxbuf)
+{
+        int retval;
+
+        if ((retval = statx(dir_fd, path, flags, mask, statxbuf))) {
+		ERROR = errno;
+                report_error(errno, "could not get entry's status '%s'", path);
+	}
+        return retval;
+}
+
+/*
+ * Report the result of a statx request that 
+ * was made asynchronously (through io_uring).
+ */
+int statx_res_inf(int res, const char *path)
+{
+	if (res < 0) {
+		ERROR = -res;
+                report_error(-res, "could not get entry's status '%s'", path);
+		return -1;
+	}
+	return 0;
+}
+#endif
+
 DIR *opendir_inf(const char *path)
 {
         DIR *retval;
 
         if (!(retval = opendir(path))) {
 		ERROR = errno;
-                error(0, errno, "could not open directory '%s'", path);
+                report_error(errno, "could not open directory '%s'", path);
 	}
         return retval;
 }
@@ -55,7 +192,7 @@ int closedir_inf(DIR *dp)
 
         if ((retval = closedir(dp))) {
 		ERROR = errno;
-                error(0, errno, "could not close directory");
+                report_error(errno, "could not close directory");
 	}
         return retval;
 }
@@ -72,18 +209,70 @@ struct dirent *readdir_inf(DIR *dp)
 
 	if(!(retval = readdir(dp)) && errno) {
 		ERROR = errno;
-		error(0, errno, "could not read directory's entries");
+		report_error(errno, "could not read directory's entries");
+	}
+        return retval;
+}
+
+int open_dir_inf(const char *path)
+{
+        int retval;
+
+        if ((retval = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1) {
+		ERROR = errno;
+                report_error(errno, "could not open directory '%s'", path);
+	}
+        return retval;
+}
+
+int close_inf(int fd)
+{
+        int retval;
+
+        if ((retval = close(fd))) {
+		ERROR = errno;
+                report_error(errno, "could not close file descriptor");
 	}
         return retval;
 }
 
+/*
+ * Called through syscall() since older versions of 
+ * the GNU C library don't provide a wrapper for it.
+ */
+long getdents64_inf(int fd, void *buf, size_t size)
+{
+	long retval;
+
+	if ((retval = syscall(SYS_getdents64, fd, buf, size)) == -1) {
+		ERROR = errno;
+		report_error(errno, "could not read directory's entries");
+	}
+	return retval;
+}
+
+int io_uring_enter_inf(int fd, unsigned int to_submit, 
+		       unsigned int min_complete, unsigned int flags)
+{
+	int retval;
+
+	if ((retval = syscall(SYS_io_uring_enter, fd, to_submit, 
+			      min_complete, flags, NULL, 0)) == -1) {
+		ERROR = errno;
+		/* Being interrupted is not an error, the caller retries */
+		if (errno != EINTR)
+			report_error(errno, "could not submit io_uring requests");
+	}
+	return retval;
+}
+
 int unlink_inf(const char *pathname)
 {
 	int retval;
 
 	if ((retval = unlink(pathname))) {
 		ERROR = errno;
-		error(0, errno, "could not remove file '%s'", pathname);
+		report_error(errno, "could not remove file '%s'", pathname);
 	}
 	return retval;
 }
@@ -94,7 +283,24 @@ int rmdir_inf(const char *pathname)
 
 	if ((retval = rmdir(pathname))) {
 		ERROR = errno;
-		error(0, errno, "could not remove directory '%s'", pathname);
+		report_error(errno, "could not remove directory '%s'", pathname);
+	}
+	return retval;
+}
+
+/*
+ * An entry that is already gone, a non-empty directory and a directory 
+ * that was taken for a file are left to the caller without a message.
+ */
+int unlinkat_inf(int dir_fd, const char *pathname, int flags)
+{
+	int retval;
+
+	if ((retval = unlinkat(dir_fd, pathname, flags))) {
+		ERROR = errno;
+
+		if (errno != ENOENT && errno != ENOTEMPTY && errno != EISDIR)
+			report_error(errno, "could not remove '%s'", pathname);
 	}
 	return retval;
 }
@@ -105,7 +311,7 @@ FILE *fopen_inf(const char *path, const char *mode)
 
 	if (!(fp = fopen(path, mode))) {
 		ERROR = errno;
-		error(0, errno, "could not open file '%s'", path);
+		report_error(errno, "could not open file '%s'", path);
 	}
 	return fp;
 }
@@ -116,18 +322,125 @@ int fclose_inf(FILE *fp)
 
 	if ((retval = fclose(fp))) {
 		ERROR = errno;
-                error(0, errno, "could not close file");
+                report_error(errno, "could not close file");
+	}
+	return retval;
+}
+
+/*
+ * A short write is an error as well, since 
+ * fwrite() sets errno only on real failures.
+ */
+size_t fwrite_inf(const void *ptr, size_t size, size_t nmemb, FILE *fp)
+{
+	size_t retval;
+
+	errno = 0;
+
+	if ((retval = fwrite(ptr, size, nmemb, fp)) < nmemb) {
+		ERROR = errno ? errno : EIO;
+                report_error(ERROR, "could not write to file");
+	}
+	return retval;
+}
+
+int open_file_inf(const char *path)
+{
+        int retval;
+
+        if ((retval = open(path, O_RDONLY | O_CLOEXEC)) == -1) {
+		ERROR = errno;
+                report_error(errno, "could not open file '%s'", path);
+	}
+        return retval;
+}
+
+int fstat_inf(int fd, struct stat *statbuf)
+{
+        int retval;
+
+        if ((retval = fstat(fd, statbuf))) {
+		ERROR = errno;
+                report_error(errno, "could not get file's status");
+	}
+        return retval;
+}
+
+/*
+ * Map the whole file for reading, returns NULL 
+ * (instead of MAP_FAILED) on failure.
+ */
+void *mmap_file_inf(int fd, size_t size)
+{
+	void *retval;
+
+	if ((retval = mmap(NULL, size, PROT_READ, MAP_PRIVATE, 
+			   fd, 0)) == MAP_FAILED) {
+		ERROR = errno;
+                report_error(errno, "could not map file into memory");
+		retval = NULL;
+	}
+	return retval;
+}
+
+int munmap_inf(void *addr, size_t size)
+{
+	int retval;
+
+	if ((retval = munmap(addr, size))) {
+		ERROR = errno;
+                report_error(errno, "could not unmap file from memory");
+	}
+	return retval;
+}
+
+/*
+ * Reading a non-blocking descriptor that has nothing to read 
+ * is not an error, the caller just finds ERROR set to EAGAIN.
+ */
+ssize_t read_inf(int fd, void *buf, size_t count)
+{
+	ssize_t retval;
+
+	if ((retval = read(fd, buf, count)) == -1) {
+		ERROR = errno;
+
+		if (errno != EAGAIN)
+			report_error(errno, "could not read from file");
 	}
 	return retval;
 }
 
+int inotify_init_inf()
+{
+        int retval;
+
+        if ((retval = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) == -1) {
+		ERROR = errno;
+                report_error(errno, "could not initialize inotify");
+	}
+        return retval;
+}
+
 time_t time_inf(time_t *tloc)
 {
 	time_t retval;
 
 	if ((retval = time(tloc)) == -1) {
 		ERROR = errno;
-		error(0, errno, "could not get time in seconds");
+		report_error(errno, "could not get time in seconds");
+	}
+	return retval;
+}
+
+int pthread_create_inf(pthread_t *thread, void *(*routine)(void *), void *arg)
+{
+	int retval;
+
+	/* pthread functions return the error number instead of setting errno */
+	if ((retval = pthread_create(thread, NULL, routine, arg))) {
+		ERROR = retval;
+		report_error(retval, "could not create thread");
 	}
 	return retval;
 }
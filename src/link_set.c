@@ -0,0 +1,255 @@
+/*
+---------------------------------------------------------
+| License: GNU GPL-3.0                                  |
+---------------------------------------------------------
+| This source file contains all the necessary functions |
+| for the set of the already seen hard links.           |
+---------------------------------------------------------
+*/
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include "informative.h"
+#include "structs.h"
+#include "link_set.h"
+
+#define LINK_SHARD_INIT_CAP 64
+
+
+int init_link_set(struct link_set *set)
+{
+	struct link_shard *shard;
+	int i;
+
+	for (i=0; i<LINK_SET_SHARDS; i++) {
+		shard = &set->shards[i];
+		shard->keys = NULL;
+		shard->cap = 0;
+		shard->count = 0;
+
+		if (pthread_mutex_init(&shard->lock, NULL))
+			goto err_destroy_locks;
+	}
+	return 0;
+
+err_destroy_locks:
+	while (i--)
+		pthread_mutex_destroy(&set->shards[i].lock);
+	return -1;
+}
+
+void destroy_link_set(struct link_set *set)
+{
+	int i;
+
+	for (i=0; i<LINK_SET_SHARDS; i++) {
+		pthread_mutex_destroy(&set->shards[i].lock);
+		free(set->shards[i].keys);
+	}
+}
+
+/*
+ * Mix the key's bits (splitmix64's finalizer), the inodes of
+ * a file system are mostly sequential so they can't be used as
+ * they are. The low bits pick the shard, the high bits the slot.
+ */
+static inline uint64_t hash_link_key(uint64_t dev, uint64_t ino)
+{
+	uint64_t h;
+
+	h = ino ^ (dev * 0x9e3779b97f4a7c15ULL);
+	h ^= h >> 30;
+	h *= 0xbf58476d1ce4e5b9ULL;
+	h ^= h >> 27;
+	h *= 0x94d049bb133111ebULL;
+	h ^= h >> 31;
+
+	return h;
+}
+
+static inline size_t get_slot_i(const struct link_shard *shard, uint64_t hash)
+{
+	return (hash >> 32) & (shard->cap - 1);
+}
+
+static inline bool is_empty_slot(const struct link_key *key)
+{
+	return key->ino == 0;
+}
+
+/*
+ * Find the key's slot, or the empty slot where it should go
+ */
+static struct link_key *find_slot(const struct link_shard *shard, 
+				  uint64_t hash, uint64_t dev, uint64_t ino)
+{
+	struct link_key *key;
+	size_t i;
+
+	for (i=get_slot_i(shard, hash); ; i=(i + 1) & (shard->cap - 1)) {
+		key = &shard->keys[i];
+
+		if (is_empty_slot(key) || (key->ino == ino && key->dev == dev))
+			return key;
+	}
+}
+
+/*
+ * Double the shard's capacity (or allocate the initial one) 
+ * and re-insert its keys.
+ */
+static int grow_link_shard(struct link_shard *shard)
+{
+	struct link_key *old_keys, *key;
+	size_t old_cap, i;
+
+	old_keys = shard->keys;
+	old_cap = shard->cap;
+	shard->cap = old_cap ? old_cap * 2 : LINK_SHARD_INIT_CAP;
+
+	if (!(shard->keys = calloc_inf(shard->cap, sizeof(struct link_key)))) {
+		shard->keys = old_keys;
+		shard->cap = old_cap;
+		return -1;
+	}
+	for (i=0; i<old_cap; i++) {
+		if (is_empty_slot(&old_keys[i]))
+			continue;
+		key = find_slot(shard, hash_link_key(old_keys[i].dev, 
+						     old_keys[i].ino),
+				old_keys[i].dev, old_keys[i].ino);
+		*key = old_keys[i];
+	}
+	free(old_keys);
+
+	return 0;
+}
+
+/* Keep the load factor under 3/4 */
+static inline bool is_full_shard(const struct link_shard *shard)
+{
+	return (shard->count + 1) * 4 > shard->cap * 3;
+}
+
+/*
+ * Whether the owner is the replaced node or lies in its tree. The 
+ * parents are loaded atomically since the tree might be changed by
+ * another thread meanwhile (see insert_dtree()).
+ */
+static bool is_replaced_owner(const struct dtree *owner,
+			      const struct dtree *replaced)
+{
+	if (!replaced)
+		return false;
+
+	for (; owner; owner=__atomic_load_n(&owner->parent, __ATOMIC_ACQUIRE))
+		if (owner == replaced)
+			return true;
+	return false;
+}
+
+static int _link_set_charge(struct link_shard *shard, uint64_t hash,
+			    uint64_t dev, uint64_t ino,
+			    const struct dtree *owner,
+			    const struct dtree *replaced)
+{
+	struct link_key *key;
+
+	if (is_full_shard(shard) && grow_link_shard(shard))
+		return -1;
+
+	key = find_slot(shard, hash, dev, ino);
+
+	if (is_empty_slot(key)) {
+		key->dev = dev;
+		key->ino = ino;
+		shard->count++;
+	} else if (key->owner && !is_replaced_owner(key->owner, replaced)) {
+		return 0;
+	}
+	key->owner = owner;
+
+	return 1;
+}
+
+/*
+ * Charge the blocks of the (device, inode) pair to the owner, unless 
+ * they're charged to another node already. A rescan's entries take the
+ * charges of the tree that they replace over, so the nodes in it don't
+ * count as others (replaced is NULL for any other scan). A released
+ * charge (see link_set_release()) is taken over by anyone. Returns 1 if
+ * it's charged, 0 if it isn't and -1 on failure. Zero inodes are never
+ * stored, so they're always charged.
+ */
+int link_set_charge(struct link_set *set, uint64_t dev, uint64_t ino,
+		    const struct dtree *owner, const struct dtree *replaced)
+{
+	struct link_shard *shard;
+	uint64_t hash;
+	int retval;
+
+	if (ino == 0)
+		return 1;
+
+	hash = hash_link_key(dev, ino);
+	shard = &set->shards[hash & (LINK_SET_SHARDS - 1)];
+
+	pthread_mutex_lock(&shard->lock);
+	retval = _link_set_charge(shard, hash, dev, ino, owner, replaced);
+	pthread_mutex_unlock(&shard->lock);
+
+	return retval;
+}
+
+/*
+ * Set the owner of the (device, inode) pair's charge to new_owner if
+ * it's old_owner, returns whether it's changed.
+ */
+static bool swap_link_owner(struct link_set *set, uint64_t dev, uint64_t ino,
+			    const struct dtree *old_owner, 
+			    const struct dtree *new_owner)
+{
+	struct link_shard *shard;
+	struct link_key *key;
+	uint64_t hash;
+	bool swapped;
+
+	hash = hash_link_key(dev, ino);
+	shard = &set->shards[hash & (LINK_SET_SHARDS - 1)];
+	swapped = false;
+
+	pthread_mutex_lock(&shard->lock);
+
+	if (shard->cap && ino) {
+		key = find_slot(shard, hash, dev, ino);
+
+		if (!is_empty_slot(key) && key->owner == old_owner) {
+			key->owner = new_owner;
+			swapped = true;
+		}
+	}
+	pthread_mutex_unlock(&shard->lock);
+
+	return swapped;
+}
+
+/*
+ * Release the charge of the (device, inode) pair if it's the owner's,
+ * e.g. once the owner is taken out of the tree, so another link of the
+ * same inode can take it over. Returns whether it's released.
+ */
+bool link_set_release(struct link_set *set, uint64_t dev, uint64_t ino,
+		      const struct dtree *owner)
+{
+	return swap_link_owner(set, dev, ino, owner, NULL);
+}
+
+/*
+ * Take the released charge of the (device, inode) pair over, returns
+ * whether it's taken. Unlike link_set_charge() it never inserts.
+ */
+bool link_set_take_over(struct link_set *set, uint64_t dev, uint64_t ino,
+			const struct dtree *owner)
+{
+	return swap_link_owner(set, dev, ino, NULL, owner);
+}
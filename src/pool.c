@@ -0,0 +1,364 @@
+/*
+---------------------------------------------------------
+| License: GNU GPL-3.0                                  |
+---------------------------------------------------------
+| This source file contains all the necessary functions |
+| for the work-stealing pool of threads.                |
+---------------------------------------------------------
+*/
+
+/*
+ * Defining _GNU_SOURCE macro since it achives all the desired
+ * feature test macro requirements, which are:
+ *     1) _POSIX_C_SOURCE >= 199309L for clock_gettime()
+ *     2) _POSIX_C_SOURCE || _XOPEN_SOURCE for sysconf() and rand_r()
+ */
+#define _GNU_SOURCE
+#include <time.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include "informative.h"
+#include "pool.h"
+
+
+int get_online_cpus()
+{
+	long retval;
+
+	retval = sysconf(_SC_NPROCESSORS_ONLN);
+
+	return (retval > 0) ? retval : 1;
+}
+
+static int init_job_deque(struct job_deque *deque)
+{
+	const size_t init_cap = 64;
+
+	if (!(deque->jobs = malloc_inf(init_cap * sizeof(void *))))
+		return -1;
+	if (pthread_mutex_init(&deque->lock, NULL)) {
+		free(deque->jobs);
+		return -1;
+	}
+	deque->cap = init_cap;
+	deque->head = 0;
+	deque->count = 0;
+
+	return 0;
+}
+
+static void destroy_job_deque(struct job_deque *deque)
+{
+	pthread_mutex_destroy(&deque->lock);
+	free(deque->jobs);
+}
+
+/*
+ * Double the capacity of the deque while unwrapping
+ * the circular buffer to the beginning of the new one.
+ */
+static int grow_job_deque(struct job_deque *deque)
+{
+	size_t first_part;
+	void **jobs;
+
+	if (!(jobs = malloc_inf(deque->cap * 2 * sizeof(void *))))
+		return -1;
+
+	first_part = deque->cap - deque->head;
+	memcpy(jobs, deque->jobs + deque->head, first_part * sizeof(void *));
+	memcpy(jobs + first_part, deque->jobs, deque->head * sizeof(void *));
+	free(deque->jobs);
+
+	deque->jobs = jobs;
+	deque->cap *= 2;
+	deque->head = 0;
+
+	return 0;
+}
+
+static int push_bottom(struct job_deque *deque, void *job)
+{
+	int retval;
+
+	retval = 0;
+	pthread_mutex_lock(&deque->lock);
+
+	if (deque->count < deque->cap || !(retval = grow_job_deque(deque)))
+		deque->jobs[(deque->head + deque->count++) % deque->cap] = job;
+
+	pthread_mutex_unlock(&deque->lock);
+
+	return retval;
+}
+
+static void *pop_bottom(struct job_deque *deque)
+{
+	void *job;
+
+	job = NULL;
+	pthread_mutex_lock(&deque->lock);
+
+	if (deque->count)
+		job = deque->jobs[(deque->head + --deque->count) % deque->cap];
+
+	pthread_mutex_unlock(&deque->lock);
+
+	return job;
+}
+
+static void *steal_top(struct job_deque *deque)
+{
+	void *job;
+
+	job = NULL;
+	pthread_mutex_lock(&deque->lock);
+
+	if (deque->count) {
+		job = deque->jobs[deque->head];
+		deque->head = (deque->head + 1) % deque->cap;
+		deque->count--;
+	}
+	pthread_mutex_unlock(&deque->lock);
+
+	return job;
+}
+
+/*
+ * Steal a job from the other workers, starting from a
+ * random victim so the thieves don't gang up on one deque.
+ */
+static void *steal_job(struct pool_worker *thief)
+{
+	const int workers_num = thief->pool->workers_num;
+	struct pool_worker *victim;
+	void *job;
+	int i, start;
+
+	start = rand_r(&thief->seed) % workers_num;
+
+	for (i=0; i<workers_num; i++) {
+		victim = &thief->pool->workers[(start + i) % workers_num];
+
+		if (victim != thief && (job = steal_top(&victim->deque)))
+			return job;
+	}
+	return NULL;
+}
+
+static inline bool should_stop(struct pool *pool)
+{
+	return (__atomic_load_n(&pool->pending, __ATOMIC_ACQUIRE) == 0 ||
+		__atomic_load_n(&pool->failed, __ATOMIC_ACQUIRE));
+}
+
+static void wake_idle_workers(struct pool *pool, bool all)
+{
+	pthread_mutex_lock(&pool->idle_lock);
+
+	if (pool->idle) {
+		if (all)
+			pthread_cond_broadcast(&pool->idle_cond);
+		else
+			pthread_cond_signal(&pool->idle_cond);
+	}
+	pthread_mutex_unlock(&pool->idle_lock);
+}
+
+/*
+ * Wait shortly for new jobs. The timeout is there so a lost
+ * wake-up can't stall the pool, it only delays the thief.
+ */
+static void wait_for_jobs(struct pool *pool)
+{
+	const long timeout_ns = 1000000;
+	const long sec_in_ns = 1000000000;
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+
+	if (ts.tv_nsec < sec_in_ns - timeout_ns) {
+		ts.tv_nsec += timeout_ns;
+	} else {
+		ts.tv_nsec -= sec_in_ns - timeout_ns;
+		ts.tv_sec++;
+	}
+	pthread_mutex_lock(&pool->idle_lock);
+	pool->idle++;
+
+	if (!should_stop(pool))
+		pthread_cond_timedwait(&pool->idle_cond, &pool->idle_lock, &ts);
+
+	pool->idle--;
+	pthread_mutex_unlock(&pool->idle_lock);
+}
+
+static void handle_job(struct pool_worker *worker, void *job)
+{
+	struct pool *pool;
+	int failed;
+
+	pool = worker->pool;
+	failed = 0;
+
+	if (pool->handler(worker, job)) {
+		/* Make sure a failed job is reported even without ERROR */
+		failed = ERROR ? ERROR : -1;
+		__sync_bool_compare_and_swap(&pool->failed, 0, failed);
+	}
+	if (__sync_sub_and_fetch(&pool->pending, 1) == 0 || failed)
+		wake_idle_workers(pool, true);
+}
+
+static void *worker_routine(void *arg)
+{
+	struct pool_worker *worker;
+	void *job;
+
+	worker = arg;
+
+	while (!should_stop(worker->pool)) {
+		if ((job = pop_bottom(&worker->deque)) ||
+		    (job = steal_job(worker)))
+			handle_job(worker, job);
+		else
+			wait_for_jobs(worker->pool);
+	}
+	return NULL;
+}
+
+/*
+ * Push a new job to the worker's own deque. Can be called
+ * before running the pool to seed it with initial jobs.
+ */
+int pool_push(struct pool_worker *worker, void *job)
+{
+	struct pool *pool;
+
+	pool = worker->pool;
+	/* Count it first so the pool can't be seen empty meanwhile */
+	__sync_add_and_fetch(&pool->pending, 1);
+
+	if (push_bottom(&worker->deque, job)) {
+		__sync_sub_and_fetch(&pool->pending, 1);
+		return -1;
+	}
+	wake_idle_workers(pool, false);
+
+	return 0;
+}
+
+static void init_pool_fields(struct pool *pool, int workers_num,
+			     job_handler handler, void *arg)
+{
+	pool->workers_num = workers_num;
+	pool->handler = handler;
+	pool->arg = arg;
+	pool->pending = 0;
+	pool->failed = 0;
+	pool->idle = 0;
+}
+
+static int init_workers(struct pool *pool)
+{
+	struct pool_worker *worker;
+	int i;
+
+	for (i=0; i<pool->workers_num; i++) {
+		worker = &pool->workers[i];
+		worker->pool = pool;
+		worker->seed = i + 1;
+		worker->id = i;
+
+		if (init_job_deque(&worker->deque))
+			goto err_destroy_deques;
+	}
+	return 0;
+
+err_destroy_deques:
+	while (i--)
+		destroy_job_deque(&pool->workers[i].deque);
+	return -1;
+}
+
+/*
+ * Allocate a pool of workers_num workers, zero or less means
+ * a worker per online CPU. The arg is left for the handler.
+ */
+struct pool *alloc_pool(int workers_num, job_handler handler, void *arg)
+{
+	struct pool *pool;
+
+	if (workers_num <= 0)
+		workers_num = get_online_cpus();
+	if (!(pool = malloc_inf(sizeof(struct pool))))
+		return NULL;
+
+	init_pool_fields(pool, workers_num, handler, arg);
+
+	if (!(pool->workers = malloc_inf(workers_num * sizeof(struct pool_worker))))
+		goto err_free_pool;
+	if (init_workers(pool))
+		goto err_free_workers;
+	if (pthread_mutex_init(&pool->idle_lock, NULL))
+		goto err_destroy_workers;
+	if (pthread_cond_init(&pool->idle_cond, NULL))
+		goto err_destroy_idle_lock;
+
+	return pool;
+
+err_destroy_idle_lock:
+	pthread_mutex_destroy(&pool->idle_lock);
+err_destroy_workers:
+	for (workers_num=0; workers_num<pool->workers_num; workers_num++)
+		destroy_job_deque(&pool->workers[workers_num].deque);
+err_free_workers:
+	free(pool->workers);
+err_free_pool:
+	free(pool);
+
+	return NULL;
+}
+
+void free_pool(struct pool *pool)
+{
+	int i;
+
+	for (i=0; i<pool->workers_num; i++)
+		destroy_job_deque(&pool->workers[i].deque);
+
+	pthread_cond_destroy(&pool->idle_cond);
+	pthread_mutex_destroy(&pool->idle_lock);
+	free(pool->workers);
+	free(pool);
+}
+
+/*
+ * Run the pool until all the pushed jobs (including the ones pushed
+ * by the jobs themselves) are handled or until one of them fails.
+ * The calling thread acts as the first worker.
+ */
+int pool_run(struct pool *pool)
+{
+	int created, i;
+
+	for (created=1; created<pool->workers_num; created++)
+		if (pthread_create_inf(&pool->workers[created].thread,
+				       worker_routine, &pool->workers[created])) {
+			__sync_bool_compare_and_swap(&pool->failed, 0, ERROR);
+			break;
+		}
+
+	worker_routine(&pool->workers[0]);
+
+	for (i=1; i<created; i++)
+		pthread_join(pool->workers[i].thread, NULL);
+
+	if (pool->failed) {
+		ERROR = pool->failed;
+		return -1;
+	}
+	return 0;
+}
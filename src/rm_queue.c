@@ -0,0 +1,318 @@
+/*
+---------------------------------------------------------
+| License: GNU GPL-3.0                                  |
+---------------------------------------------------------
+| This source file contains all the necessary functions |
+| for removing the entries in the background.           |
+---------------------------------------------------------
+*/
+
+#include <errno.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include "general.h"
+#include "informative.h"
+#include "disk.h"
+#include "link_set.h"
+#include "rm_queue.h"
+
+
+/*
+ * Remove the job's entry. When it's not removed completely, what's 
+ * left of it is rescanned so the dtree can be reconciled with it.
+ */
+static void remove_entry(struct rm_queue *queue, struct rm_job *job)
+{
+	const char *path;
+
+	if (!rm_dtree(job->entry, queue->threads, &job->progress))
+		return;
+	job->error = ERROR;
+	/* The scanner tells the end of a directory from a failure by ERROR */
+	ERROR = 0;
+
+	if (!(path = build_dtree_path(&queue->path_buf, job->entry)) ||
+	    !(job->left = get_new_entry(path, job->entry->fname, &queue->opts,
+					queue->root_dev, job->entry,
+					&job->arena)))
+		job->rescan_error = ERROR;
+}
+
+static void *rm_queue_routine(void *arg)
+{
+	struct rm_queue *queue;
+	struct rm_job *job;
+
+	queue = arg;
+	pthread_mutex_lock(&queue->lock);
+
+	for (;;) {
+		while (!queue->waiting && !queue->stop)
+			pthread_cond_wait(&queue->cond, &queue->lock);
+		/* The queued entries are removed before stopping */
+		if (!(job = queue->waiting))
+			break;
+		if (!(queue->waiting = job->next))
+			queue->waiting_tail = &queue->waiting;
+		queue->running = job;
+		pthread_mutex_unlock(&queue->lock);
+
+		remove_entry(queue, job);
+
+		pthread_mutex_lock(&queue->lock);
+		queue->running = NULL;
+		job->next = queue->done;
+		queue->done = job;
+	}
+	pthread_mutex_unlock(&queue->lock);
+
+	return NULL;
+}
+
+/*
+ * Start the queue's thread. The failed removals are rescanned with the 
+ * scan's options, root_dev is the scanned root's device.
+ */
+int init_rm_queue(struct rm_queue *queue, const struct scan_opts *opts,
+		  dev_t root_dev)
+{
+	queue->waiting = NULL;
+	queue->waiting_tail = &queue->waiting;
+	queue->running = NULL;
+	queue->done = NULL;
+	queue->stop = false;
+	queue->threads = opts->threads;
+	queue->opts = *opts;
+	queue->opts.prev_snap = NULL;
+	queue->opts.progress = NULL;
+	queue->root_dev = root_dev;
+	init_path_buf(&queue->path_buf);
+
+	if (pthread_mutex_init(&queue->lock, NULL))
+		return -1;
+	if (pthread_cond_init(&queue->cond, NULL))
+		goto err_destroy_lock;
+	if (pthread_create_inf(&queue->thread, rm_queue_routine, queue))
+		goto err_destroy_cond;
+
+	return 0;
+
+err_destroy_cond:
+	pthread_cond_destroy(&queue->cond);
+err_destroy_lock:
+	pthread_mutex_destroy(&queue->lock);
+
+	return -1;
+}
+
+/*
+ * Wait for the queued removals to finish and stop the thread. The 
+ * unsettled jobs are just freed, the dtree is left as it is.
+ */
+void destroy_rm_queue(struct rm_queue *queue)
+{
+	struct rm_job *job;
+
+	pthread_mutex_lock(&queue->lock);
+	queue->stop = true;
+	pthread_cond_signal(&queue->cond);
+	pthread_mutex_unlock(&queue->lock);
+	pthread_join(queue->thread, NULL);
+
+	while ((job = queue->done)) {
+		queue->done = job->next;
+		free_rm_job(job);
+	}
+	free_path_buf(&queue->path_buf);
+	pthread_cond_destroy(&queue->cond);
+	pthread_mutex_destroy(&queue->lock);
+}
+
+/*
+ * Queue the entry's removal. The entry is marked pending and its part 
+ * of the totals is taken off right away, it's left in the tree (and its
+ * tree mustn't be changed) until its job is settled.
+ */
+int queue_rm_entry(struct rm_queue *queue, struct dtree *entry)
+{
+	struct rm_job *job;
+
+	if (!(job = malloc_inf(sizeof(struct rm_job))))
+		return -1;
+
+	job->next = NULL;
+	job->entry = entry;
+	job->progress.entries = 0;
+	job->progress.bytes = 0;
+	job->error = 0;
+	job->left = NULL;
+	job->rescan_error = 0;
+	init_arena(&job->arena);
+
+	entry->flags |= DTREE_PENDING;
+	add_dtree_totals(entry->parent, entry, -1);
+
+	pthread_mutex_lock(&queue->lock);
+	*queue->waiting_tail = job;
+	queue->waiting_tail = &job->next;
+	pthread_cond_signal(&queue->cond);
+	pthread_mutex_unlock(&queue->lock);
+
+	return 0;
+}
+
+/*
+ * Get the entry that is being removed with a copy of its progress,
+ * or NULL when nothing is being removed.
+ */
+const struct dtree *get_running_rm_progress(struct rm_queue *queue,
+					   struct rm_progress *progress)
+{
+	const struct dtree *entry;
+
+	entry = NULL;
+	pthread_mutex_lock(&queue->lock);
+
+	if (queue->running) {
+		entry = queue->running->entry;
+		progress->entries = __atomic_load_n(
+			&queue->running->progress.entries, __ATOMIC_RELAXED);
+		progress->bytes = __atomic_load_n(
+			&queue->running->progress.bytes, __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&queue->lock);
+
+	return entry;
+}
+
+static inline bool is_in_dtree(const struct dtree *node,
+			       const struct dtree *dir)
+{
+	for (; node; node=node->parent)
+		if (node == dir)
+			return true;
+	return false;
+}
+
+/*
+ * Whether the entry of a job that isn't settled yet is the dir or lies
+ * in its tree. Must be called by the dtree's owner, the entries' 
+ * ancestors might change otherwise.
+ */
+bool is_removing_under(struct rm_queue *queue, const struct dtree *dir)
+{
+	const struct rm_job *job;
+	bool retval;
+
+	pthread_mutex_lock(&queue->lock);
+
+	retval = queue->running && is_in_dtree(queue->running->entry, dir);
+
+	for (job=queue->waiting; job && !retval; job=job->next)
+		retval = is_in_dtree(job->entry, dir);
+	for (job=queue->done; job && !retval; job=job->next)
+		retval = is_in_dtree(job->entry, dir);
+	pthread_mutex_unlock(&queue->lock);
+
+	return retval;
+}
+
+/*
+ * Take a finished job out of the queue, NULL when there's none. It's
+ * up to the caller to settle it (see settle_rm_job()) and free it.
+ */
+struct rm_job *get_done_rm_job(struct rm_queue *queue)
+{
+	struct rm_job *job;
+
+	pthread_mutex_lock(&queue->lock);
+
+	if ((job = queue->done))
+		queue->done = job->next;
+	pthread_mutex_unlock(&queue->lock);
+
+	return job;
+}
+
+/*
+ * Take what's left of the entry over in place of its scanned tree, the
+ * left-behind nodes are detached so nothing is applied to them. The old
+ * dot entries aren't, the nodes that were in their level lead to them.
+ * A file's charge is moved from its rescanned node to the entry.
+ */
+static void adopt_left_entry(struct dtree *entry, struct dtree *left,
+			     struct link_set *links)
+{
+	struct dtree *current;
+
+	if (links && (left->flags & DTREE_LINKED) && left->stamp &&
+	    link_set_release(links, left->stamp->dev, left->stamp->ino, left))
+		link_set_take_over(links, left->stamp->dev, left->stamp->ino,
+				   entry);
+
+	for (current=entry->child; current; current=current->next)
+		if (!is_dot_entry(current->fname))
+			current->flags |= DTREE_DETACHED;
+
+	entry->mode = left->mode;
+	entry->fsize = left->fsize;
+	entry->mtime = left->mtime;
+	entry->files_num = left->files_num;
+	entry->dirs_num = left->dirs_num;
+	entry->stamp = left->stamp;
+	entry->flags = left->flags;
+	entry->child = left->child;
+
+	/* See insert_dtree() */
+	for (current=entry->child; current; current=current->next)
+		__atomic_store_n(&current->parent, entry, __ATOMIC_RELEASE);
+}
+
+/*
+ * Apply the finished removal to the dtree. A removed entry is taken out
+ * of the tree, and a partly removed one is reconciled with what's left
+ * of it and charged again. An entry whose ancestor is pending or 
+ * detached is left to that ancestor. The job's nodes are merged into 
+ * the arena either way, since they might be the owners of hard links'
+ * charges (see link_set_charge()). The charges of the removed links are
+ * handed over to their other links in the tree.
+ */
+void settle_rm_job(struct rm_queue *queue, struct rm_job *job,
+		   struct arena *arena)
+{
+	struct link_set *links;
+	struct dtree *entry, *root;
+	bool released;
+
+	entry = job->entry;
+	links = queue->opts.links_once ? queue->opts.links : NULL;
+	merge_arena(arena, &job->arena);
+
+	if (is_flagged_dtree(entry->parent, DTREE_PENDING | DTREE_DETACHED))
+		return;
+	/* Its part of the totals is already off */
+	if (!job->error || (!job->left && job->rescan_error == ENOENT)) {
+		detach_dtree(entry);
+		entry->flags &= ~DTREE_PENDING;
+		released = links && release_dtree_links(links, entry);
+	} else {
+		entry->flags &= ~DTREE_PENDING;
+		/* What's left took the charges that are still there over */
+		released = links && release_dtree_links(links, entry);
+
+		if (job->left)
+			adopt_left_entry(entry, job->left, links);
+		add_dtree_totals(entry->parent, entry, 1);
+	}
+	if (!released)
+		return;
+	for (root=entry->parent; root->parent; root=root->parent)
+		;
+	recharge_dtree_links(links, root);
+}
+
+void free_rm_job(struct rm_job *job)
+{
+	free_arena(&job->arena);
+	free(job);
+}
@@ -0,0 +1,319 @@
+/*
+---------------------------------------------------------
+| License: GNU GPL-3.0                                  |
+---------------------------------------------------------
+| This source file contains all the necessary functions |
+| for searching the tree's entries by their names.      |
+---------------------------------------------------------
+*/
+
+/*
+ * Defining _GNU_SOURCE macro since it achives all the desired
+ * feature test macro requirements, which are:
+ *     1) _GNU_SOURCE for strcasestr() and FNM_CASEFOLD
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <ctype.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <fnmatch.h>
+#include "general.h"
+#include "informative.h"
+#include "disk.h"
+#include "search.h"
+
+#define GLOB_CHARS "*?[]\\"
+
+
+static inline uint32_t get_trigram_bucket(const char *s)
+{
+	uint32_t key;
+
+	key = (uint32_t) tolower((unsigned char) s[0]) << 16 |
+	      (uint32_t) tolower((unsigned char) s[1]) << 8 |
+	      (uint32_t) tolower((unsigned char) s[2]);
+
+	return (key * 0x9e3779b1U) >> (32 - NAME_INDEX_BITS);
+}
+
+/*
+ * Add the buckets of the string's first len bytes' trigrams that aren't
+ * among the num buckets already. Returns the new number of the buckets.
+ */
+static size_t add_trigram_buckets(const char *s, size_t len,
+				  uint32_t *buckets, size_t num)
+{
+	uint32_t bucket;
+	size_t i, j;
+
+	for (i=0; i+3<=len && num<NAME_QUERY_SIZE; i++) {
+		bucket = get_trigram_bucket(s + i);
+
+		for (j=0; j<num; j++)
+			if (buckets[j] == bucket)
+				break;
+		if (j == num)
+			buckets[num++] = bucket;
+	}
+	return num;
+}
+
+/*
+ * Fill the index's nodes with the tree's entries, apart from the dot
+ * entries. Only counts them when nodes is NULL. Returns their number.
+ */
+static size_t collect_index_nodes(const struct dtree *root,
+				  struct dtree **nodes)
+{
+	const struct dtree *current;
+	size_t num;
+
+	num = 0;
+
+	for (current=get_next_dtree(root, root); current;
+	     current=get_next_dtree(current, root))
+		if (!is_dot_entry(current->fname)) {
+			if (nodes)
+				nodes[num] = (struct dtree *) current;
+			num++;
+		}
+	return num;
+}
+
+/*
+ * Count each bucket's ids into the offset after its own,
+ * so the offsets are the lists' beginnings once summed.
+ */
+static void count_index_postings(struct name_index *index)
+{
+	uint32_t buckets[NAME_QUERY_SIZE];
+	size_t id, i, num;
+
+	for (id=0; id<index->num; id++) {
+		num = add_trigram_buckets(index->nodes[id]->fname,
+					  strlen(index->nodes[id]->fname),
+					  buckets, 0);
+		for (i=0; i<num; i++)
+			index->offsets[buckets[i] + 1]++;
+	}
+	for (i=0; i<NAME_INDEX_BUCKETS; i++)
+		index->offsets[i + 1] += index->offsets[i];
+}
+
+/*
+ * Fill the lists in ascending order of the ids. Each offset is moved to
+ * the end of its list meanwhile, which is where the next list begins.
+ */
+static void fill_index_postings(struct name_index *index)
+{
+	uint32_t buckets[NAME_QUERY_SIZE];
+	size_t id, i, num;
+
+	for (id=0; id<index->num; id++) {
+		num = add_trigram_buckets(index->nodes[id]->fname,
+					  strlen(index->nodes[id]->fname),
+					  buckets, 0);
+		for (i=0; i<num; i++)
+			index->postings[index->offsets[buckets[i]]++] = id;
+	}
+	memmove(index->offsets + 1, index->offsets,
+		NAME_INDEX_BUCKETS * sizeof(size_t));
+	index->offsets[0] = 0;
+}
+
+/*
+ * Index the names of the entries under the root
+ */
+int build_name_index(struct name_index *index, const struct dtree *root)
+{
+	index->nodes = NULL;
+	index->postings = NULL;
+	index->num = collect_index_nodes(root, NULL);
+
+	/* The ids are kept in 32 bits */
+	if (index->num > UINT32_MAX) {
+		ERROR = EOVERFLOW;
+		return -1;
+	}
+	if (!(index->offsets = calloc_inf(NAME_INDEX_BUCKETS + 1,
+					  sizeof(size_t))))
+		return -1;
+	if (!(index->nodes = malloc_inf((index->num + 1) *
+					sizeof(struct dtree *))))
+		goto free_index;
+	collect_index_nodes(root, index->nodes);
+	count_index_postings(index);
+
+	if (!(index->postings = malloc_inf((index->offsets[NAME_INDEX_BUCKETS]
+					    + 1) * sizeof(uint32_t))))
+		goto free_index;
+	fill_index_postings(index);
+
+	return 0;
+
+free_index:
+	free_name_index(index);
+	return -1;
+}
+
+void free_name_index(struct name_index *index)
+{
+	free_and_null((void **) &index->nodes);
+	free_and_null((void **) &index->offsets);
+	free_and_null((void **) &index->postings);
+	index->num = 0;
+}
+
+/*
+ * Add the buckets of the glob pattern's literal runs' trigrams, the
+ * bracket expressions are skipped since they match any of their chars.
+ */
+static size_t add_pattern_buckets(const char *pattern, uint32_t *buckets)
+{
+	size_t num, len;
+
+	num = 0;
+
+	while (*pattern) {
+		len = strcspn(pattern, GLOB_CHARS);
+		num = add_trigram_buckets(pattern, len, buckets, num);
+		pattern += len;
+
+		if (*pattern == '[') {
+			pattern++;
+			if (*pattern == '!' || *pattern == '^')
+				pattern++;
+			/* A leading ']' is a member of the expression */
+			if (*pattern == ']')
+				pattern++;
+			pattern += strcspn(pattern, "]");
+		}
+		if (*pattern)
+			pattern++;
+	}
+	return num;
+}
+
+/*
+ * Get the first position of the list from begin on whose id isn't
+ * below the id. It gallops ahead first, since the sought ids are
+ * usually far apart in the longer lists.
+ */
+static size_t seek_posting(const uint32_t *postings, size_t begin,
+			   size_t end, uint32_t id)
+{
+	size_t step, mid;
+
+	for (step=1; begin+step<end && postings[begin + step]<id; step*=2)
+		begin += step;
+	if (begin + step < end)
+		end = begin + step;
+
+	while (begin < end) {
+		mid = begin + (end - begin) / 2;
+
+		if (postings[mid] < id)
+			begin = mid + 1;
+		else
+			end = mid;
+	}
+	return begin;
+}
+
+static inline bool is_glob_pattern(const char *query)
+{
+	return strpbrk(query, GLOB_CHARS) != NULL;
+}
+
+/*
+ * A glob pattern has to match the whole name, anything else is searched
+ * as a part of it. Both ignore the case.
+ */
+static bool is_query_match(const char *name, const char *query, bool is_glob)
+{
+	if (is_glob)
+		return !fnmatch(query, name, FNM_CASEFOLD);
+	else
+		return strcasestr(name, query) != NULL;
+}
+
+/*
+ * Add the node to the hits if it matches the query and it's still
+ * in the tree, returns the new number of the hits.
+ */
+static inline size_t add_hit(struct dtree *node, const char *query,
+			     bool is_glob, struct dtree **hits, size_t num)
+{
+	if (is_query_match(node->fname, query, is_glob) &&
+	    !is_flagged_dtree(node, DTREE_DETACHED | DTREE_PENDING))
+		hits[num++] = node;
+	return num;
+}
+
+/*
+ * Intersect the buckets' lists from the shortest one on, and match
+ * the ids that are in all of them. Returns the number of the hits.
+ */
+static size_t search_postings(const struct name_index *index,
+			      const char *query, bool is_glob,
+			      const uint32_t *buckets, size_t buckets_num,
+			      struct dtree **hits, size_t max)
+{
+	size_t begins[NAME_QUERY_SIZE], ends[NAME_QUERY_SIZE];
+	size_t i, pos, shortest, num;
+	uint32_t id;
+
+	for (i=0, shortest=0; i<buckets_num; i++) {
+		begins[i] = index->offsets[buckets[i]];
+		ends[i] = index->offsets[buckets[i] + 1];
+
+		if (ends[i] - begins[i] < ends[shortest] - begins[shortest])
+			shortest = i;
+	}
+	for (pos=begins[shortest], num=0; pos<ends[shortest] && num<max; pos++) {
+		id = index->postings[pos];
+
+		for (i=0; i<buckets_num; i++) {
+			if (i == shortest)
+				continue;
+			begins[i] = seek_posting(index->postings, begins[i],
+						 ends[i], id);
+			if (begins[i] == ends[i])
+				return num;
+			if (index->postings[begins[i]] != id)
+				break;
+		}
+		if (i == buckets_num)
+			num = add_hit(index->nodes[id], query, is_glob,
+				      hits, num);
+	}
+	return num;
+}
+
+/*
+ * Search the names for the query, at most max hits in the tree's
+ * pre-order are kept. A query without any trigram (e.g. a too short
+ * one) is matched against all the names.
+ */
+size_t search_name_index(const struct name_index *index, const char *query,
+			 struct dtree **hits, size_t max)
+{
+	uint32_t buckets[NAME_QUERY_SIZE];
+	size_t buckets_num, id, num;
+	bool is_glob;
+
+	if ((is_glob = is_glob_pattern(query)))
+		buckets_num = add_pattern_buckets(query, buckets);
+	else
+		buckets_num = add_trigram_buckets(query, strlen(query),
+						  buckets, 0);
+	if (buckets_num)
+		return search_postings(index, query, is_glob, buckets,
+				       buckets_num, hits, max);
+
+	for (id=0, num=0; id<index->num && num<max; id++)
+		num = add_hit(index->nodes[id], query, is_glob, hits, num);
+	return num;
+}
@@ -0,0 +1,914 @@
+/*
+---------------------------------------------------------
+| License: GNU GPL-3.0                                  |
+---------------------------------------------------------
+| This source file contains all the necessary functions |
+| for saving and loading the dtree snapshots.           |
+---------------------------------------------------------
+*/
+
+#include <error.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <sys/stat.h>
+#include "general.h"
+#include "informative.h"
+#include "snapshot.h"
+
+#define BLK_SHIFT 9
+#define VARINT_MAX_LEN 10
+#define NAME_TABLE_INIT_SLOTS 1024
+
+
+static inline uint64_t zigzag_encode(int64_t val)
+{
+	return ((uint64_t) val << 1) ^ (uint64_t) (val >> 63);
+}
+
+static inline int64_t zigzag_decode(uint64_t val)
+{
+	return (int64_t) (val >> 1) ^ -(int64_t) (val & 1);
+}
+
+static void put_le(unsigned char *buf, uint64_t val, int len)
+{
+	int i;
+
+	for (i=0; i<len; i++)
+		buf[i] = val >> (8 * i);
+}
+
+static uint64_t get_le(const unsigned char *buf, int len)
+{
+	uint64_t val;
+	int i;
+
+	for (i=0, val=0; i<len; i++)
+		val |= (uint64_t) buf[i] << (8 * i);
+	return val;
+}
+
+static int flush_writer(struct snapshot_writer *w)
+{
+	if (w->len && fwrite_inf(w->buf, 1, w->len, w->fp) < w->len)
+		return -1;
+	w->len = 0;
+
+	return 0;
+}
+
+static int write_bytes(struct snapshot_writer *w, const void *ptr, size_t len)
+{
+	size_t n;
+
+	for (; len; len-=n, ptr=(const char *) ptr + n) {
+		if (w->len == SNAPSHOT_BUF_SIZE && flush_writer(w))
+			return -1;
+		n = SNAPSHOT_BUF_SIZE - w->len;
+		n = (len < n) ? len : n;
+		memcpy(w->buf + w->len, ptr, n);
+		w->len += n;
+		w->off += n;
+	}
+	return 0;
+}
+
+static int write_le(struct snapshot_writer *w, uint64_t val, int len)
+{
+	unsigned char buf[8];
+
+	put_le(buf, val, len);
+
+	return write_bytes(w, buf, len);
+}
+
+static int write_varint(struct snapshot_writer *w, uint64_t val)
+{
+	unsigned char buf[VARINT_MAX_LEN];
+	int len;
+
+	for (len=0; val >= 0x80; val>>=7)
+		buf[len++] = (val & 0x7f) | 0x80;
+	buf[len++] = val;
+
+	return write_bytes(w, buf, len);
+}
+
+/* FNV-1a */
+static inline uint64_t hash_name(const char *name)
+{
+	uint64_t hash;
+
+	for (hash=0xcbf29ce484222325ULL; *name; name++)
+		hash = (hash ^ (unsigned char) *name) * 0x100000001b3ULL;
+	return hash;
+}
+
+static void free_name_table(struct name_table *table)
+{
+	free(table->names);
+	free(table->slots);
+}
+
+static int init_name_table(struct name_table *table)
+{
+	table->slots_num = NAME_TABLE_INIT_SLOTS;
+	table->num = 0;
+	table->blob_size = 0;
+	table->names = NULL;
+
+	if (!(table->slots = calloc_inf(table->slots_num, sizeof(uint32_t))))
+		return -1;
+	if (!(table->names = malloc_inf(table->slots_num / 2 *
+					sizeof(const char *)))) {
+		free(table->slots);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Find the name's slot, or the empty slot where it should go
+ */
+static uint32_t *find_name_slot(const struct name_table *table,
+				const char *name)
+{
+	uint32_t *slot;
+	size_t i;
+
+	for (i=hash_name(name); ; i++) {
+		slot = &table->slots[i & (table->slots_num - 1)];
+
+		if (!*slot || efficient_strcmp(table->names[*slot - 1], name) == 0)
+			return slot;
+	}
+}
+
+/*
+ * Double the slots when they're half full. The
+ * names' array has room for half of them too.
+ */
+static int grow_name_table(struct name_table *table)
+{
+	const char **names;
+	uint32_t *slots;
+	uint32_t i;
+
+	if (!(slots = calloc_inf(table->slots_num * 2, sizeof(uint32_t))))
+		return -1;
+	if (!(names = malloc_inf(table->slots_num * sizeof(const char *)))) {
+		free(slots);
+		return -1;
+	}
+	memcpy(names, table->names, table->num * sizeof(const char *));
+	free(table->names);
+	free(table->slots);
+
+	table->names = names;
+	table->slots = slots;
+	table->slots_num *= 2;
+
+	for (i=0; i<table->num; i++)
+		*find_name_slot(table, names[i]) = i + 1;
+	return 0;
+}
+
+/*
+ * Get the name's index, adding it to the table if it's new.
+ * The names are not copied, the nodes outlive the writer.
+ */
+static int get_name_i(struct name_table *table, const char *name,
+		      uint32_t *name_i)
+{
+	uint32_t *slot;
+
+	if (table->num == table->slots_num / 2 && grow_name_table(table))
+		return -1;
+	if (!*(slot = find_name_slot(table, name))) {
+		table->names[table->num] = name;
+		table->blob_size += get_strsize(name);
+		*slot = ++table->num;
+	}
+	*name_i = *slot - 1;
+
+	return 0;
+}
+
+static inline void init_off_stack(struct off_stack *stack)
+{
+	stack->offs = NULL;
+	stack->num = 0;
+	stack->cap = 0;
+}
+
+static int push_off(struct off_stack *stack, uint64_t off)
+{
+	if (reserve_array((void **) &stack->offs, &stack->cap,
+			  stack->num + 1, sizeof(uint64_t)))
+		return -1;
+	stack->offs[stack->num++] = off;
+
+	return 0;
+}
+
+static inline bool has_child_level(const struct dtree *node)
+{
+	return (S_ISDIR(node->mode) && node->child &&
+		!is_dot_entry(node->fname));
+}
+
+static int write_stamp(struct snapshot_writer *w,
+		       const struct dtree_stamp *stamp)
+{
+	static const struct dtree_stamp none;
+
+	if (!stamp)
+		stamp = &none;
+
+	return (write_varint(w, stamp->dev) || write_varint(w, stamp->ino) ||
+		write_varint(w, stamp->mtime.tv_nsec) ||
+		write_varint(w, zigzag_encode(stamp->ctime.tv_sec)) ||
+		write_varint(w, stamp->ctime.tv_nsec)) ? -1 : 0;
+}
+
+static int write_link_inode(struct snapshot_writer *w,
+			    const struct dtree *node)
+{
+	if (!(node->flags & DTREE_LINKED))
+		return 0;
+
+	return (write_varint(w, node->stamp ? node->stamp->dev : 0) ||
+		write_varint(w, node->stamp ? node->stamp->ino : 0)) ? -1 : 0;
+}
+
+static int write_entry(struct snapshot_writer *w, const struct dtree *node,
+		       uint64_t child_off)
+{
+	uint32_t name_i;
+
+	if (get_name_i(&w->names, node->fname, &name_i))
+		return -1;
+	if (write_varint(w, name_i) || write_varint(w, node->mode) ||
+	    write_varint(w, (uint64_t) node->fsize >> BLK_SHIFT) ||
+	    write_varint(w, zigzag_encode(node->mtime)) ||
+	    write_bytes(w, &node->flags, 1))
+		return -1;
+	if (!S_ISDIR(node->mode))
+		return write_link_inode(w, node);
+	if (write_varint(w, node->files_num) ||
+	    write_varint(w, node->dirs_num) || write_varint(w, child_off))
+		return -1;
+
+	return write_stamp(w, node->stamp);
+}
+
+/*
+ * The written order of the entries: the dot entry, the two dots
+ * entry and then the rest of them by size in descending order.
+ */
+static int cmp_written_order(const void *a, const void *b)
+{
+	const struct dtree *x = *(const struct dtree **) a;
+	const struct dtree *y = *(const struct dtree **) b;
+	bool x_dot, y_dot;
+
+	x_dot = is_dot_entry(x->fname);
+	y_dot = is_dot_entry(y->fname);
+
+	if (x_dot || y_dot)
+		return (x_dot && y_dot) ? strcmp(x->fname, y->fname) : 
+					  y_dot - x_dot;
+	if (x->fsize != y->fsize)
+		return (x->fsize < y->fsize) ? 1 : -1;
+	return strcmp(x->fname, y->fname);
+}
+
+/*
+ * Push the level's entries and sort them in the written order
+ */
+static int sort_level(struct snapshot_writer *w, const struct dtree *begin,
+		      size_t *count)
+{
+	const struct dtree *current;
+	size_t base;
+
+	base = w->sorted_num;
+
+	for (current=begin; current; current=current->next) {
+		if (reserve_array((void **) &w->sorted, &w->sorted_cap,
+				  w->sorted_num + 1, sizeof(struct dtree *)))
+			return -1;
+		w->sorted[w->sorted_num++] = current;
+	}
+	*count = w->sorted_num - base;
+	qsort(w->sorted + base, *count, sizeof(struct dtree *), 
+	      cmp_written_order);
+
+	return 0;
+}
+
+/*
+ * Write the sub-directories' levels first and then the level itself,
+ * so the level's offset is only known after all of them are written.
+ * The sorted entries and the offsets are kept on the writer's stacks, 
+ * which the nested levels push above them.
+ */
+static int write_level(struct snapshot_writer *w, const struct dtree *begin,
+		       uint64_t *level_off)
+{
+	const struct dtree *node;
+	size_t base, offs_base, count, i, j;
+	uint64_t child_off;
+
+	base = w->sorted_num;
+	offs_base = w->offs.num;
+
+	if (sort_level(w, begin, &count))
+		return -1;
+
+	for (i=0; i<count; i++) {
+		node = w->sorted[base + i];
+
+		if (!has_child_level(node))
+			continue;
+		if (write_level(w, node->child, &child_off) ||
+		    push_off(&w->offs, child_off + 1))
+			return -1;
+	}
+	*level_off = w->off;
+
+	if (write_varint(w, count))
+		return -1;
+
+	for (i=0, j=offs_base; i<count; i++) {
+		node = w->sorted[base + i];
+
+		if (write_entry(w, node, has_child_level(node) ?
+					 w->offs.offs[j++] : 0))
+			return -1;
+	}
+	w->sorted_num = base;
+	w->offs.num = offs_base;
+
+	return 0;
+}
+
+static int write_names(struct snapshot_writer *w)
+{
+	uint64_t off;
+	uint32_t i;
+
+	if (w->names.blob_size > UINT32_MAX) {
+		ERROR = EOVERFLOW;
+		report_error(ERROR, "too many names for a snapshot");
+		return -1;
+	}
+	if (write_le(w, w->names.num, 4))
+		return -1;
+
+	for (i=0, off=0; i<w->names.num; i++) {
+		if (write_le(w, off, 4))
+			return -1;
+		off += get_strsize(w->names.names[i]);
+	}
+	if (write_le(w, off, 4))
+		return -1;
+
+	for (i=0; i<w->names.num; i++)
+		if (write_bytes(w, w->names.names[i],
+				get_strsize(w->names.names[i])))
+			return -1;
+	return 0;
+}
+
+static int write_snapshot(struct snapshot_writer *w, const struct dtree *root)
+{
+	uint64_t root_off, names_off;
+
+	if (write_bytes(w, SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_LEN) ||
+	    write_le(w, SNAPSHOT_VERSION, 4))
+		return -1;
+	if (write_level(w, root, &root_off))
+		return -1;
+
+	names_off = w->off;
+
+	if (write_names(w))
+		return -1;
+	if (write_le(w, root_off, 8) || write_le(w, names_off, 8) ||
+	    write_bytes(w, SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_LEN))
+		return -1;
+	return flush_writer(w);
+}
+
+/*
+ * Save the scanned tree (its first level's beginning as returned
+ * by get_dir_tree()) into a snapshot file.
+ */
+int save_snapshot(const char *path, const struct dtree *begin)
+{
+	struct snapshot_writer *w;
+	int retval;
+
+	if (!(w = malloc_inf(sizeof(struct snapshot_writer))))
+		return -1;
+
+	retval = -1;
+	w->off = 0;
+	w->len = 0;
+	w->sorted = NULL;
+	w->sorted_num = 0;
+	w->sorted_cap = 0;
+	init_off_stack(&w->offs);
+
+	if (init_name_table(&w->names))
+		goto out_free_writer;
+	if (!(w->fp = fopen_inf(path, "w")))
+		goto out_free_names;
+
+	retval = write_snapshot(w, begin->parent);
+
+	if (fclose_inf(w->fp))
+		retval = -1;
+out_free_names:
+	free_name_table(&w->names);
+	free(w->offs.offs);
+	free(w->sorted);
+out_free_writer:
+	free(w);
+
+	return retval;
+}
+
+static int corrupted_snapshot(const char *path)
+{
+	ERROR = EINVAL;
+	report_error(0, "corrupted snapshot '%s'", path);
+
+	return -1;
+}
+
+/*
+ * Validate the header, the footer and the string table's
+ * bounds, the levels are validated while they're decoded.
+ */
+static int parse_snapshot(struct snapshot *snap)
+{
+	const unsigned char *footer;
+	uint64_t names_off, offs_size;
+
+	if (snap->size < SNAPSHOT_HEADER_SIZE + SNAPSHOT_FOOTER_SIZE)
+		return -1;
+
+	footer = snap->base + snap->size - SNAPSHOT_FOOTER_SIZE;
+
+	snap->version = get_le(snap->base + SNAPSHOT_MAGIC_LEN, 4);
+
+	/* The older versions are still read, only without the stamps */
+	if (memcmp(snap->base, SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_LEN) ||
+	    !snap->version || snap->version > SNAPSHOT_VERSION ||
+	    memcmp(footer + 16, SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_LEN))
+		return -1;
+
+	snap->root_off = get_le(footer, 8);
+	names_off = get_le(footer + 8, 8);
+
+	if (snap->root_off < SNAPSHOT_HEADER_SIZE ||
+	    snap->root_off >= names_off ||
+	    names_off + 4 > snap->size - SNAPSHOT_FOOTER_SIZE)
+		return -1;
+
+	snap->names_num = get_le(snap->base + names_off, 4);
+	snap->name_offs = snap->base + names_off + 4;
+	offs_size = ((uint64_t) snap->names_num + 1) * 4;
+
+	if (offs_size > snap->size - SNAPSHOT_FOOTER_SIZE - names_off - 4)
+		return -1;
+
+	snap->blob = (const char *) snap->name_offs + offs_size;
+	snap->blob_size = get_le(snap->name_offs + offs_size - 4, 4);
+
+	return (snap->blob_size > (uint64_t) ((const char *) footer -
+					      snap->blob)) ? -1 : 0;
+}
+
+/*
+ * Map the snapshot file and validate it. The snapshot must 
+ * be closed with close_snapshot() when it's not needed.
+ */
+int open_snapshot(struct snapshot *snap, const char *path)
+{
+	struct stat statbuf;
+	int fd, retval;
+
+	if ((fd = open_file_inf(path)) == -1)
+		return -1;
+
+	retval = -1;
+	snap->path = path;
+
+	if (fstat_inf(fd, &statbuf))
+		goto out_close;
+
+	snap->size = statbuf.st_size;
+
+	if (snap->size < SNAPSHOT_HEADER_SIZE + SNAPSHOT_FOOTER_SIZE) {
+		retval = corrupted_snapshot(path);
+		goto out_close;
+	}
+	if (!(snap->base = mmap_file_inf(fd, snap->size)))
+		goto out_close;
+	if ((retval = parse_snapshot(snap))) {
+		munmap_inf((void *) snap->base, snap->size);
+		corrupted_snapshot(path);
+	}
+out_close:
+	if (close_inf(fd))
+		retval = -1;
+	return retval;
+}
+
+int close_snapshot(struct snapshot *snap)
+{
+	return munmap_inf((void *) snap->base, snap->size);
+}
+
+static int read_varint(struct snap_cursor *cur, uint64_t *val)
+{
+	int shift;
+
+	for (*val=0, shift=0; cur->pos < cur->end && shift < 64; shift+=7) {
+		*val |= (uint64_t) (*cur->pos & 0x7f) << shift;
+
+		if (!(*cur->pos++ & 0x80))
+			return 0;
+	}
+	return -1;
+}
+
+/*
+ * Get the name of the index, the names are null terminated in the blob
+ */
+static const char *get_snapshot_name(const struct snapshot *snap,
+				     uint64_t name_i, size_t *len)
+{
+	uint64_t begin, end;
+
+	if (name_i >= snap->names_num)
+		return NULL;
+
+	begin = get_le(snap->name_offs + name_i * 4, 4);
+	end = get_le(snap->name_offs + (name_i + 1) * 4, 4);
+
+	if (begin >= end || end > snap->blob_size || snap->blob[end - 1])
+		return NULL;
+	*len = end - begin;
+
+	return snap->blob + begin;
+}
+
+static int read_stamp(struct snap_cursor *cur, struct dtree_stamp *stamp)
+{
+	uint64_t dev, ino, mtime_ns, ctime, ctime_ns;
+	
+	if (read_varint(cur, &dev) || read_varint(cur, &ino) ||
+	    read_varint(cur, &mtime_ns) || read_varint(cur, &ctime) ||
+	    read_varint(cur, &ctime_ns))
+		return -1;
+
+	stamp->dev = dev;
+	stamp->ino = ino;
+	stamp->mtime.tv_nsec = mtime_ns;
+	stamp->ctime.tv_sec = zigzag_decode(ctime);
+	stamp->ctime.tv_nsec = ctime_ns;
+
+	return 0;
+}
+
+static int read_link_inode(const struct snapshot *snap,
+			   struct snap_cursor *cur, struct snap_entry *entry)
+{
+	uint64_t dev, ino;
+
+	if (snap->version < 3 || !(entry->flags & DTREE_LINKED))
+		return 0;
+	if (read_varint(cur, &dev) || read_varint(cur, &ino))
+		return -1;
+
+	entry->stamp.dev = dev;
+	entry->stamp.ino = ino;
+
+	return 0;
+}
+
+static int read_entry(const struct snapshot *snap, struct snap_cursor *cur, 
+		      struct snap_entry *entry)
+{
+	uint64_t name_i, mtime;
+
+	if (read_varint(cur, &name_i) || read_varint(cur, &entry->mode) ||
+	    read_varint(cur, &entry->blocks) || read_varint(cur, &mtime) ||
+	    cur->pos == cur->end)
+		return -1;
+	if (!(entry->name = get_snapshot_name(snap, name_i, &entry->name_len)))
+		return -1;
+
+	entry->mtime = zigzag_decode(mtime);
+	entry->flags = *cur->pos++;
+	entry->files_num = 0;
+	entry->dirs_num = 0;
+	entry->child_off = 0;
+	memset(&entry->stamp, 0, sizeof(struct dtree_stamp));
+
+	if (!S_ISDIR(entry->mode))
+		return read_link_inode(snap, cur, entry);
+	if (read_varint(cur, &entry->files_num) ||
+	    read_varint(cur, &entry->dirs_num) ||
+	    read_varint(cur, &entry->child_off))
+		return -1;
+	if (snap->version < 2)
+		return 0;
+	if (read_stamp(cur, &entry->stamp))
+		return -1;
+
+	entry->stamp.mtime.tv_sec = entry->mtime;
+
+	return 0;
+}
+
+/*
+ * Start reading the level at off, the level's entries 
+ * are read one by one with snap_iter_next().
+ */
+int init_snap_iter(struct snap_iter *iter, const struct snapshot *snap,
+		   uint64_t off)
+{
+	iter->snap = snap;
+	iter->cur.end = snap->name_offs - 4;
+
+	if (off < SNAPSHOT_HEADER_SIZE || 
+	    off >= (uint64_t) (iter->cur.end - snap->base))
+		return corrupted_snapshot(snap->path);
+
+	iter->cur.pos = snap->base + off;
+
+	if (read_varint(&iter->cur, &iter->left))
+		return corrupted_snapshot(snap->path);
+	return 0;
+}
+
+/*
+ * Read the level's next entry. Returns 1 when an entry is read, 
+ * 0 at the level's end or -1 when the snapshot is corrupted.
+ */
+int snap_iter_next(struct snap_iter *iter, struct snap_entry *entry)
+{
+	if (!iter->left)
+		return 0;
+	if (read_entry(iter->snap, &iter->cur, entry))
+		return corrupted_snapshot(iter->snap->path);
+	iter->left--;
+
+	return 1;
+}
+
+static struct dtree *alloc_snapshot_node(const struct snap_entry *entry,
+					 struct arena *arena)
+{
+	struct dtree *node;
+
+	if (!(node = alloc_dtree(arena, entry->name_len)))
+		return NULL;
+	if (entry->stamp.ino) {
+		if (!(node->stamp = arena_alloc(arena, 
+						sizeof(struct dtree_stamp))))
+			return NULL;
+		*node->stamp = entry->stamp;
+	}
+	memcpy(node->fname, entry->name, entry->name_len);
+	node->fsize = (off_t) entry->blocks << BLK_SHIFT;
+	node->mtime = entry->mtime;
+	node->mode = entry->mode;
+	node->files_num = entry->files_num;
+	node->dirs_num = entry->dirs_num;
+	node->flags = entry->flags;
+
+	return node;
+}
+
+/*
+ * Decode the level at off out of the arena, without the levels under
+ * it. Their offsets (plus one, zero when there's none) are pushed to
+ * offs in the entries' order. A sub-directory's level always comes 
+ * before its parent's level, which rules out cycles in a corrupted 
+ * snapshot. Returns -1 with ERROR set on failure.
+ */
+static int decode_level(const struct snapshot *snap, uint64_t off,
+			struct dtree *parent, struct arena *arena,
+			struct off_stack *offs, struct dtree **begin)
+{
+	struct dtree *node, *last;
+	struct snap_entry entry;
+	struct snap_iter iter;
+	int retval;
+
+	*begin = last = NULL;
+
+	if (init_snap_iter(&iter, snap, off))
+		return -1;
+
+	while ((retval = snap_iter_next(&iter, &entry)) == 1) {
+		if (entry.child_off && entry.child_off - 1 >= off)
+			return corrupted_snapshot(snap->path);
+		if (!(node = alloc_snapshot_node(&entry, arena)) ||
+		    push_off(offs, entry.child_off))
+			return -1;
+
+		node->parent = parent;
+
+		if (last) {
+			last->next = node;
+			node->prev = last;
+		} else {
+			*begin = node;
+		}
+		last = node;
+	}
+	return retval;
+}
+
+/*
+ * Load the level at off with all the levels under it
+ */
+static int load_level(const struct snapshot *snap, uint64_t off,
+		      struct dtree *parent, struct arena *arena,
+		      struct off_stack *offs, struct dtree **begin)
+{
+	struct dtree *node;
+	size_t base, i;
+
+	base = offs->num;
+
+	if (decode_level(snap, off, parent, arena, offs, begin))
+		return -1;
+
+	for (node=*begin, i=base; node; node=node->next, i++)
+		if (offs->offs[i] &&
+		    load_level(snap, offs->offs[i] - 1, node, arena, 
+			       offs, &node->child))
+			return -1;
+	offs->num = base;
+
+	return 0;
+}
+
+/*
+ * Load a snapshot back into a dtree out of the arena. Returns the first
+ * level's beginning just like get_dir_tree(), and just like it it's up
+ * to the caller to free the arena, even when the loading fails.
+ */
+struct dtree *load_snapshot(const char *path, struct arena *arena)
+{
+	struct off_stack offs;
+	struct snapshot snap;
+	struct dtree *root;
+
+	if (open_snapshot(&snap, path))
+		return NULL;
+
+	ERROR = 0;
+	init_off_stack(&offs);
+
+	if (load_level(&snap, snap.root_off, NULL, arena, &offs, &root) || 
+	    !root) {
+		if (!ERROR)
+			corrupted_snapshot(path);
+		root = NULL;
+	}
+	free(offs.offs);
+
+	if (close_snapshot(&snap))
+		root = NULL;
+
+	return root ? root->child : NULL;
+}
+
+static void free_snap_level(struct snap_level *level)
+{
+	free_arena(&level->arena);
+	free(level->offs.offs);
+}
+
+/*
+ * Materialise the level at off as the view's deepest level
+ */
+static struct dtree *push_snap_level(struct snap_view *view, uint64_t off,
+				     struct dtree *parent)
+{
+	struct snap_level *level;
+
+	if (reserve_array((void **) &view->levels, &view->cap, 
+			  view->depth + 1, sizeof(struct snap_level)))
+		return NULL;
+
+	level = &view->levels[view->depth];
+	init_arena(&level->arena);
+	init_off_stack(&level->offs);
+	ERROR = 0;
+
+	if (decode_level(&view->snap, off, parent, &level->arena, 
+			 &level->offs, &level->begin) || !level->begin) {
+		if (!ERROR)
+			corrupted_snapshot(view->snap.path);
+		free_snap_level(level);
+		return NULL;
+	}
+	view->depth++;
+
+	return level->begin;
+}
+
+static void pop_snap_level(struct snap_view *view)
+{
+	struct snap_level *level;
+
+	level = &view->levels[--view->depth];
+
+	if (level->begin->parent)
+		level->begin->parent->child = NULL;
+	free_snap_level(level);
+}
+
+/*
+ * Map the snapshot and materialise only the root's level and the first
+ * level. Returns the first level's beginning just like load_snapshot().
+ */
+struct dtree *open_snap_view(struct snap_view *view, const char *path)
+{
+	struct dtree *root;
+
+	view->levels = NULL;
+	view->depth = 0;
+	view->cap = 0;
+
+	if (open_snapshot(&view->snap, path))
+		return NULL;
+	if (!(root = push_snap_level(view, view->snap.root_off, NULL)))
+		goto err_close_view;
+	if (!view->levels[0].offs.offs[0]) {
+		corrupted_snapshot(path);
+		goto err_close_view;
+	}
+	if (!(root->child = push_snap_level(view, 
+					    view->levels[0].offs.offs[0] - 1,
+					    root)))
+		goto err_close_view;
+	return root->child;
+
+err_close_view:
+	close_snap_view(view);
+
+	return NULL;
+}
+
+/*
+ * Materialise the directory's level, the directory must be in the
+ * deepest level. Returns NULL when the directory has no level, or
+ * on failure with ERROR set.
+ */
+struct dtree *snap_view_inward(struct snap_view *view, struct dtree *dir)
+{
+	struct snap_level *level;
+	struct dtree *current;
+	size_t i;
+
+	level = &view->levels[view->depth - 1];
+
+	for (current=level->begin, i=0; current != dir; current=current->next)
+		i++;
+	if (!level->offs.offs[i])
+		return NULL;
+
+	return dir->child = push_snap_level(view, level->offs.offs[i] - 1, 
+					    dir);
+}
+
+/*
+ * Free the deepest level when it's left, the root's 
+ * level and the first level are always kept.
+ */
+void snap_view_outward(struct snap_view *view)
+{
+	if (view->depth > 2)
+		pop_snap_level(view);
+}
+
+void close_snap_view(struct snap_view *view)
+{
+	while (view->depth)
+		pop_snap_level(view);
+	free(view->levels);
+	close_snapshot(&view->snap);
+}
@@ -0,0 +1,348 @@
+/*
+---------------------------------------------------------
+| License: GNU GPL-3.0                                  |
+---------------------------------------------------------
+| This source file contains all the necessary functions |
+| for sorting the directories' levels.                  |
+---------------------------------------------------------
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include "general.h"
+#include "informative.h"
+#include "sort.h"
+
+#define SORT_CACHE_INIT_CAP 64
+#define RADIX_BITS 8
+#define RADIX_SIZE (1 << RADIX_BITS)
+#define RADIX_PASSES (64 / RADIX_BITS)
+
+
+int init_sort_cache(struct sort_cache *cache)
+{
+	cache->cap = SORT_CACHE_INIT_CAP;
+	cache->num = 0;
+	/* The slots' zero generation is never the cache's */
+	cache->gen = 1;
+	cache->items = NULL;
+	cache->tmp = NULL;
+	cache->items_cap = 0;
+	cache->tmp_cap = 0;
+
+	cache->levels = calloc_inf(cache->cap, sizeof(struct sorted_level));
+
+	return cache->levels ? 0 : -1;
+}
+
+void destroy_sort_cache(struct sort_cache *cache)
+{
+	size_t i;
+	int key;
+
+	for (i=0; i<cache->cap; i++)
+		for (key=0; key<SORT_KEYS_NUM; key++)
+			free(cache->levels[i].orders[key]);
+	free(cache->levels);
+	free(cache->items);
+	free(cache->tmp);
+}
+
+static inline size_t get_slot_i(const struct sort_cache *cache,
+				const struct dtree *dir)
+{
+	uint64_t h;
+
+	/* The nodes are at least 8 bytes aligned */
+	h = ((uintptr_t) dir >> 3) * 0x9e3779b97f4a7c15ULL;
+
+	return (h >> 32) & (cache->cap - 1);
+}
+
+/*
+ * Find the directory's slot, or the empty slot where it should go
+ */
+static struct sorted_level *find_slot(const struct sort_cache *cache,
+				      const struct dtree *dir)
+{
+	struct sorted_level *level;
+	size_t i;
+
+	for (i=get_slot_i(cache, dir); ; i=(i + 1) & (cache->cap - 1)) {
+		level = &cache->levels[i];
+
+		if (!level->dir || level->dir == dir)
+			return level;
+	}
+}
+
+/*
+ * Double the table's capacity and move the sorted levels over
+ */
+static int grow_sort_cache(struct sort_cache *cache)
+{
+	struct sorted_level *old_levels;
+	size_t old_cap, i;
+
+	old_levels = cache->levels;
+	old_cap = cache->cap;
+	cache->cap = old_cap * 2;
+
+	if (!(cache->levels = calloc_inf(cache->cap,
+					 sizeof(struct sorted_level)))) {
+		cache->levels = old_levels;
+		cache->cap = old_cap;
+		return -1;
+	}
+	for (i=0; i<old_cap; i++)
+		if (old_levels[i].dir)
+			*find_slot(cache, old_levels[i].dir) = old_levels[i];
+	free(old_levels);
+
+	return 0;
+}
+
+/* Keep the load factor under 3/4 */
+static inline bool is_full_cache(const struct sort_cache *cache)
+{
+	return (cache->num + 1) * 4 > cache->cap * 3;
+}
+
+static struct sorted_level *get_slot(struct sort_cache *cache,
+				     const struct dtree *dir)
+{
+	struct sorted_level *level;
+
+	if (is_full_cache(cache) && grow_sort_cache(cache))
+		return NULL;
+	if (!(level = find_slot(cache, dir))->dir) {
+		level->dir = dir;
+		cache->num++;
+	}
+	return level;
+}
+
+/*
+ * The name's first bytes as a big endian integer, which orders the
+ * names like strcmp() does as far as these bytes go.
+ */
+static uint64_t get_name_prefix(const char *name)
+{
+	uint64_t prefix;
+	int i;
+
+	prefix = 0;
+
+	for (i=0; i<8; i++) {
+		prefix <<= 8;
+		if (*name)
+			prefix |= (unsigned char) *name++;
+	}
+	return prefix;
+}
+
+/*
+ * The key as an unsigned integer of the same order, the signed
+ * mtime is biased so the negative ones go first. The names are
+ * ordered by their prefixes first.
+ */
+static uint64_t get_sort_key(const struct dtree *node, enum sort_key key)
+{
+	const uint64_t sign_bit = 1ULL << 63;
+
+	if (key == SORT_BY_NAME)
+		return get_name_prefix(node->fname);
+	else if (key == SORT_BY_SIZE)
+		return node->fsize;
+	else if (key == SORT_BY_MTIME)
+		return (uint64_t) node->mtime ^ sign_bit;
+	else if (S_ISDIR(node->mode))
+		return (uint64_t) node->files_num + node->dirs_num;
+	else
+		return 0;
+}
+
+/*
+ * Stable LSD radix sort of the items by their keys. The passes whose
+ * digit is the same for all the items (e.g. the high bytes of the
+ * sizes) are skipped, so it's usually much less than 8 passes.
+ */
+static void radix_sort_items(struct sort_item *items, struct sort_item *tmp,
+			     size_t num)
+{
+	size_t counts[RADIX_PASSES][RADIX_SIZE];
+	struct sort_item *src, *dst, *swap;
+	size_t i, sum, count;
+	unsigned int shift;
+	int pass, digit;
+
+	memset(counts, 0, sizeof(counts));
+
+	for (i=0; i<num; i++)
+		for (pass=0; pass<RADIX_PASSES; pass++)
+			counts[pass][(items[i].key >> (pass * RADIX_BITS)) &
+				     (RADIX_SIZE - 1)]++;
+	src = items;
+	dst = tmp;
+
+	for (pass=0; pass<RADIX_PASSES; pass++) {
+		shift = pass * RADIX_BITS;
+
+		if (counts[pass][(src[0].key >> shift) & (RADIX_SIZE - 1)] == num)
+			continue;
+		for (digit=0, sum=0; digit<RADIX_SIZE; digit++) {
+			count = counts[pass][digit];
+			counts[pass][digit] = sum;
+			sum += count;
+		}
+		for (i=0; i<num; i++)
+			dst[counts[pass][(src[i].key >> shift) &
+					 (RADIX_SIZE - 1)]++] = src[i];
+		swap = src;
+		src = dst;
+		dst = swap;
+	}
+	if (src != items)
+		memcpy(items, src, num * sizeof(struct sort_item));
+}
+
+static int cmp_items_names(const void *a, const void *b)
+{
+	return strcmp(((const struct sort_item *) a)->node->fname,
+		      ((const struct sort_item *) b)->node->fname);
+}
+
+/*
+ * Collect the level's entries, apart from the dot entries, into the
+ * cache's items. Returns the number of the items or -1 on failure.
+ */
+static long collect_sort_items(struct sort_cache *cache,
+			       const struct dtree *dir, enum sort_key key)
+{
+	struct dtree *current;
+	size_t num;
+
+	num = 0;
+
+	for (current=dir->child; current; current=current->next) {
+		if (is_dot_entry(current->fname))
+			continue;
+		if (reserve_array((void **) &cache->items, &cache->items_cap,
+				  num + 1, sizeof(struct sort_item)))
+			return -1;
+		cache->items[num].key = get_sort_key(current, key);
+		cache->items[num++].node = current;
+	}
+	return num;
+}
+
+/*
+ * The names that were radix sorted by their prefixes are only left
+ * unordered within the runs of a shared full prefix (a prefix that
+ * ends before the name does), these runs are sorted by comparison.
+ */
+static void sort_prefix_runs(struct sort_item *items, size_t num)
+{
+	size_t begin, end;
+
+	for (begin=0; begin<num; begin=end) {
+		for (end=begin+1; end<num; end++)
+			if (items[end].key != items[begin].key)
+				break;
+		if (end - begin > 1 && (items[begin].key & 0xff))
+			qsort(items + begin, end - begin, 
+			      sizeof(struct sort_item), cmp_items_names);
+	}
+}
+
+static void sort_items(struct sort_cache *cache, size_t num,
+		       enum sort_key key)
+{
+	radix_sort_items(cache->items, cache->tmp, num);
+
+	if (key == SORT_BY_NAME)
+		sort_prefix_runs(cache->items, num);
+}
+
+/*
+ * Sort the level's order of the key, the dot entries first and then
+ * the sorted items.
+ */
+static int sort_level(struct sort_cache *cache, struct sorted_level *level,
+		      enum sort_key key)
+{
+	struct dtree *current, **order;
+	size_t i, num;
+	long items_num;
+
+	if ((items_num = collect_sort_items(cache, level->dir, key)) == -1)
+		return -1;
+	if (reserve_array((void **) &cache->tmp, &cache->tmp_cap,
+			  items_num, sizeof(struct sort_item)))
+		return -1;
+	if (items_num)
+		sort_items(cache, items_num, key);
+
+	num = items_num;
+
+	for (current=level->dir->child; current; current=current->next)
+		if (is_dot_entry(current->fname))
+			num++;
+	if (reserve_array((void **) &level->orders[key], &level->caps[key],
+			  num, sizeof(struct dtree *)))
+		return -1;
+	order = level->orders[key];
+
+	for (i=0, current=level->dir->child; current; current=current->next)
+		if (is_dot_entry(current->fname))
+			order[i++] = current;
+	for (num=0; num<(size_t) items_num; num++)
+		order[i++] = cache->items[num].node;
+
+	level->nums[key] = i;
+	level->gens[key] = cache->gen;
+
+	return 0;
+}
+
+/*
+ * Get the directory's sorted level whose order of the key is up to date.
+ * It's sorted only when it's not already cached, or when the cache was
+ * marked dirty since.
+ */
+const struct sorted_level *get_sorted_level(struct sort_cache *cache,
+					    const struct dtree *dir,
+					    enum sort_key key)
+{
+	struct sorted_level *level;
+
+	if (!(level = get_slot(cache, dir)))
+		return NULL;
+	if (level->gens[key] != cache->gen && sort_level(cache, level, key))
+		return NULL;
+
+	return level;
+}
+
+/*
+ * Mark the directory's orders dirty, e.g. once its level
+ * is freed since another level might get its nodes.
+ */
+void forget_sorted_level(struct sort_cache *cache, const struct dtree *dir)
+{
+	struct sorted_level *level;
+	int key;
+
+	if ((level = find_slot(cache, dir))->dir)
+		for (key=0; key<SORT_KEYS_NUM; key++)
+			level->gens[key] = 0;
+}
+
+/*
+ * Mark all the cached orders dirty, the entries' keys have changed
+ */
+void dirty_sort_cache(struct sort_cache *cache)
+{
+	cache->gen++;
+}
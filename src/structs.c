@@ -8,112 +8,329 @@
 */ 
 
 #include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdbool.h>
 #include "general.h"
 #include "informative.h"
 #include "structs.h"
 
+#define ARENA_CHUNK_SIZE (1024 * 1024)
+#define ARENA_ALIGN 8
+#define ALIGN_UP(size) (((size) + ARENA_ALIGN - 1) & ~((size_t) ARENA_ALIGN - 1))
 
-static inline void *alloc_stat()
+
+void init_arena(struct arena *arena)
 {
-        return malloc_inf(sizeof(struct stat));
+	arena->head = NULL;
+	arena->tail = NULL;
 }
 
-static void *alloc_fdata(size_t name_len, size_t path_len)
+static struct arena_chunk *alloc_arena_chunk(size_t min_size)
 {
-	struct fdata *retval;
+	struct arena_chunk *chunk;
+	size_t size;
+
+	size = (min_size > ARENA_CHUNK_SIZE) ? min_size : ARENA_CHUNK_SIZE;
 
-	if ((retval = malloc_inf(sizeof(struct fdata)))) {
-		if (!(retval->fname = malloc_inf(name_len)))
-			goto err_free_fdata;
-		if (!(retval->fpath = malloc_inf(path_len)))
-			goto err_free_fdata_fname;
-		if (!(retval->fstatus = alloc_stat()))
-			goto err_free_fdata_fpath;
+	if ((chunk = malloc_inf(sizeof(struct arena_chunk) + size))) {
+		chunk->next = NULL;
+		chunk->size = size;
+		chunk->used = 0;
 	}
-        return retval;
+	return chunk;
+}
+
+/*
+ * Carve size bytes out of the arena's current chunk, a new chunk 
+ * is started when the current one doesn't have enough room left.
+ */
+void *arena_alloc(struct arena *arena, size_t size)
+{
+	struct arena_chunk *chunk;
+	void *retval;
 
-err_free_fdata_fpath:
-	free(retval->fpath);
-err_free_fdata_fname:
-	free(retval->fname);
-err_free_fdata:
-	free(retval);
+	size = ALIGN_UP(size);
+	chunk = arena->head;
 
-	return NULL;
+	if (!chunk || chunk->size - chunk->used < size) {
+		if (!(chunk = alloc_arena_chunk(size)))
+			return NULL;
+		if (!arena->tail)
+			arena->tail = chunk;
+		chunk->next = arena->head;
+		arena->head = chunk;
+	}
+	retval = chunk->data + chunk->used;
+	chunk->used += size;
+
+	return retval;
 }
 
-static void free_fdata(struct fdata *ptr)
+/*
+ * Move all the chunks of src to dst, leaving src empty. The 
+ * chunks of src are put first so its current chunk keeps 
+ * getting used by dst.
+ */
+void merge_arena(struct arena *dst, struct arena *src)
 {
-	free(ptr->fstatus);
-	free(ptr->fpath);
-	free(ptr->fname);
-	free(ptr);
+	if (!src->head)
+		return;
+	if (dst->head)
+		src->tail->next = dst->head;
+	else
+		dst->tail = src->tail;
+
+	dst->head = src->head;
+	init_arena(src);
 }
 
-static inline void *alloc_cdata()
+/*
+ * Free everything that was allocated out of the arena 
+ * at once, with a single free() for each chunk.
+ */
+void free_arena(struct arena *arena)
 {
-	return malloc_inf(sizeof(struct cdata));
+	struct arena_chunk *current, *next;
+
+	for (current=arena->head; current; current=next) {
+		next = current->next;
+		free(current);
+	}
+	init_arena(arena);
 }
 
-static void *alloc_entry_data(size_t name_len, size_t path_len) 
+static inline void null_dtree_members(struct dtree *node)
 {
-	struct entry_data *retval;
+	node->parent = NULL;
+	node->prev = NULL;
+	node->next = NULL;
+	node->child = NULL;
+	node->stamp = NULL;
+	node->files_num = 0;
+	node->dirs_num = 0;
+	node->flags = 0;
+}
+
+/*
+ * Allocate a node out of the arena, the name is stored right after
+ * its last member (without the struct's tail padding). The node is
+ * freed along with the arena.
+ */
+void *alloc_dtree(struct arena *arena, size_t name_len)
+{
+	struct dtree *node;
+
+	if ((node = arena_alloc(arena, offsetof(struct dtree, fname) +
+				       name_len)))
+		null_dtree_members(node);
+	return node;
+}
+
+void init_path_buf(struct path_buf *pb)
+{
+	pb->buf = NULL;
+	pb->size = 0;
+}
+
+void free_path_buf(struct path_buf *pb)
+{
+	free(pb->buf);
+	init_path_buf(pb);
+}
+
+static int reserve_path_buf(struct path_buf *pb, size_t size)
+{
+	size_t new_size;
+	char *buf;
+
+	if (size <= pb->size)
+		return 0;
+	for (new_size=pb->size ? pb->size : 256; new_size<size; new_size*=2)
+		;
+	if (!(buf = malloc_inf(new_size)))
+		return -1;
+	free(pb->buf);
+	pb->buf = buf;
+	pb->size = new_size;
+
+	return 0;
+}
+
+static inline bool ends_with_slash(const char *str, size_t len)
+{
+	return (len && str[len - 1] == '/');
+}
 
-	if ((retval = malloc_inf(sizeof(struct entry_data)))) {
-		if (!(retval->file = alloc_fdata(name_len, path_len)))
-			goto err_free_entry_data;
-		if (!(retval->curses = alloc_cdata()))
-			goto err_free_fdata;
+/*
+ * Rebuild the path by walking up the node's parents to the root, with
+ * name appended to it unless it's NULL. The path is written backwards 
+ * from the end of the buffer, so the returned address is not always
+ * the buffer's beginning.
+ */
+static const char *build_path(struct path_buf *pb, const struct dtree *node,
+			      const char *name)
+{
+	const struct dtree *current;
+	size_t len, total, name_len;
+	char *end;
+
+	/* The null byte, the root's name and a slash for every other name */
+	name_len = name ? strlen(name) : 0;
+	total = name ? name_len + 2 : 1;
+
+	for (current=node; current->parent; current=current->parent)
+		total += strlen(current->fname) + 1;
+	total += strlen(current->fname);
+
+	if (reserve_path_buf(pb, total))
+		return NULL;
+	end = pb->buf + total - 1;
+	*end = '\0';
+
+	if (name) {
+		end -= name_len;
+		memcpy(end, name, name_len);
+		*--end = '/';
 	}
-	return retval;
+	for (current=node; current->parent; current=current->parent) {
+		len = strlen(current->fname);
+		end -= len;
+		memcpy(end, current->fname, len);
+		*--end = '/';
+	}
+	len = strlen(current->fname);
+	/* Avoid doubling the slash of a root like "/" */
+	if ((current != node || name) && ends_with_slash(current->fname, len))
+		len--;
+	end -= len;
+	memcpy(end, current->fname, len);
 
-err_free_fdata:
-	free_fdata(retval->file);
-err_free_entry_data:
-	free(retval);
+	return end;
+}
 
-	return NULL;
+/*
+ * Rebuild the node's path, it stays valid until 
+ * the next build with the same buffer.
+ */
+const char *build_dtree_path(struct path_buf *pb, const struct dtree *node)
+{
+	return build_path(pb, node, NULL);
 }
 
-static void free_entry_data(struct entry_data *ptr)
+/*
+ * Build the path of the directory's entry named name, for 
+ * the entries that don't have a node (or not yet).
+ */
+const char *build_entry_path(struct path_buf *pb, const struct dtree *dir,
+			     const char *name)
 {
-	free(ptr->curses);
-	free_fdata(ptr->file);
-	free(ptr);
+	return build_path(pb, dir, name);
 }
 
-static inline void null_dtree_members(struct dtree *node)
+/*
+ * Whether the node or any of its ancestors has any of the flags
+ */
+bool is_flagged_dtree(const struct dtree *node, unsigned char flags)
 {
-	node->parent = NULL;
-	node->prev = NULL;
-	node->next = NULL;
-	node->child = NULL;
+	for (; node; node=node->parent)
+		if (node->flags & flags)
+			return true;
+	return false;
+}
+
+/*
+ * Whether the node or any of its ancestors was taken out of the tree
+ */
+bool is_detached_dtree(const struct dtree *node)
+{
+	return is_flagged_dtree(node, DTREE_DETACHED);
 }
 
-void *alloc_dtree(size_t name_len, size_t path_len)
+/*
+ * Add the entry's part of the totals to its directory and
+ * all the directories above it, or take it off (sign < 0).
+ * An unscanned mount point's blocks were never charged, 
+ * it's counted as a directory only.
+ */
+void add_dtree_totals(struct dtree *dir, const struct dtree *node, int sign)
 {
-	struct dtree *retval;
+	unsigned int files_num, dirs_num;
+	off_t fsize;
 
-	if ((retval = malloc_inf(sizeof(struct dtree)))) {
-		if ((retval->data = alloc_entry_data(name_len, path_len)))
-			null_dtree_members(retval);
-		else
-			free_and_null((void **) &retval);
+	if (S_ISDIR(node->mode)) {
+		fsize = (node->flags & DTREE_MOUNT_POINT) ? 0 : node->fsize;
+		files_num = node->files_num;
+		dirs_num = node->dirs_num + 1;
+	} else {
+		fsize = (node->flags & DTREE_UNCHARGED) ? 0 : node->fsize;
+		files_num = 1;
+		dirs_num = 0;
+	}
+	for (; dir; dir=dir->parent) {
+		dir->fsize += sign * fsize;
+		dir->files_num += sign * files_num;
+		dir->dirs_num += sign * dirs_num;
 	}
-	return retval;
 }
 
-void free_dtree(struct dtree *node)
+/*
+ * Take the node (with its tree) out of its level and its part of the
+ * totals off its ancestors, unless it's pending removal since then it's
+ * already off. Its node is left in the arena, flagged as detached.
+ */
+void detach_dtree(struct dtree *node)
 {
-	struct dtree *current, *next;
-	
-	for (current=node; current; current=next) {
-		next = current->next;
+	if (node->prev)
+		node->prev->next = node->next;
+	else
+		node->parent->child = node->next;
+	if (node->next)
+		node->next->prev = node->prev;
 
-		if (current->child)
-			free_dtree(current->child);
-			
-		free_entry_data(current->data);
-		free(current);
+	node->flags |= DTREE_DETACHED;
+	if (!(node->flags & DTREE_PENDING))
+		add_dtree_totals(node->parent, node, -1);
+}
+
+/*
+ * Insert the node (with its tree) into the directory's level right 
+ * after prev, or first when prev is NULL, and add its part of the 
+ * totals to its new ancestors.
+ */
+void insert_dtree(struct dtree *dir, struct dtree *prev, struct dtree *node)
+{
+	/* The queued removals' rescans might walk up from it meanwhile */
+	__atomic_store_n(&node->parent, dir, __ATOMIC_RELEASE);
+	node->prev = prev;
+
+	if (prev) {
+		node->next = prev->next;
+		prev->next = node;
+	} else {
+		node->next = dir->child;
+		dir->child = node;
 	}
+	if (node->next)
+		node->next->prev = node;
+
+	add_dtree_totals(dir, node, 1);
+}
+
+/*
+ * Change the file's size, the charged difference is added up 
+ * to its ancestors. Directories' sizes are their trees' totals.
+ */
+void resize_dtree(struct dtree *node, off_t fsize)
+{
+	struct dtree *dir;
+	off_t delta;
+
+	delta = fsize - node->fsize;
+	node->fsize = fsize;
+
+	if (node->flags & (DTREE_UNCHARGED | DTREE_PENDING))
+		return;
+	for (dir=node->parent; dir; dir=dir->parent)
+		dir->fsize += delta;
 }
@@ -0,0 +1,127 @@
+/*
+---------------------------------------------------------
+| License: GNU GPL-3.0                                  |
+---------------------------------------------------------
+| This source file contains all the necessary functions |
+| for finding the largest entries of the tree.          |
+---------------------------------------------------------
+*/
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include "general.h"
+#include "informative.h"
+#include "disk.h"
+#include "top.h"
+
+
+int init_top_heap(struct top_heap *heap, size_t cap)
+{
+	heap->num = 0;
+	heap->cap = cap;
+	heap->nodes = malloc_inf(cap * sizeof(struct dtree *));
+
+	return heap->nodes ? 0 : -1;
+}
+
+void free_top_heap(struct top_heap *heap)
+{
+	free(heap->nodes);
+}
+
+static inline void swap_nodes(struct dtree **nodes, size_t i, size_t j)
+{
+	struct dtree *tmp;
+
+	tmp = nodes[i];
+	nodes[i] = nodes[j];
+	nodes[j] = tmp;
+}
+
+static void sift_up(struct dtree **nodes, size_t i)
+{
+	size_t parent;
+
+	for (; i; i=parent) {
+		parent = (i - 1) / 2;
+
+		if (nodes[parent]->fsize <= nodes[i]->fsize)
+			break;
+		swap_nodes(nodes, i, parent);
+	}
+}
+
+/*
+ * Move the i'th node down to its place among the first num nodes
+ */
+static void sift_down(struct dtree **nodes, size_t num, size_t i)
+{
+	size_t child;
+
+	for (; (child = 2 * i + 1) < num; i=child) {
+		if (child + 1 < num &&
+		    nodes[child + 1]->fsize < nodes[child]->fsize)
+			child++;
+		if (nodes[i]->fsize <= nodes[child]->fsize)
+			break;
+		swap_nodes(nodes, i, child);
+	}
+}
+
+static void push_top_entry(struct top_heap *heap, struct dtree *node)
+{
+	if (heap->num < heap->cap) {
+		heap->nodes[heap->num] = node;
+		sift_up(heap->nodes, heap->num++);
+	} else if (heap->cap && node->fsize > heap->nodes[0]->fsize) {
+		heap->nodes[0] = node;
+		sift_down(heap->nodes, heap->num, 0);
+	}
+}
+
+/*
+ * Heap sort the kept entries, which leaves the min-heap's
+ * nodes in descending order of their sizes.
+ */
+static void sort_top_heap(struct top_heap *heap)
+{
+	size_t num;
+
+	for (num=heap->num; num>1; num--) {
+		swap_nodes(heap->nodes, 0, num - 1);
+		sift_down(heap->nodes, num - 1, 0);
+	}
+}
+
+/*
+ * The mount points that weren't descended into aren't leaf directories,
+ * they only look empty.
+ */
+static inline bool is_top_entry(const struct dtree *node, enum top_kind kind)
+{
+	if (kind == TOP_FILES)
+		return !S_ISDIR(node->mode);
+	else
+		return S_ISDIR(node->mode) && !node->dirs_num &&
+		       !(node->flags & DTREE_MOUNT_POINT);
+}
+
+/*
+ * Keep the largest entries of the kind under the root in the heap,
+ * in descending order of their sizes. The dot entries are skipped.
+ */
+void collect_top_entries(struct top_heap *heap, const struct dtree *root,
+			 enum top_kind kind)
+{
+	const struct dtree *current;
+
+	heap->num = 0;
+
+	for (current=get_next_dtree(root, root); current;
+	     current=get_next_dtree(current, root))
+		if (!is_dot_entry(current->fname) && 
+		    !(current->flags & DTREE_PENDING) && 
+		    is_top_entry(current, kind))
+			push_top_entry(heap, (struct dtree *) current);
+	sort_top_heap(heap);
+}
@@ -0,0 +1,249 @@
+/*
+---------------------------------------------------------
+| License: GNU GPL-3.0                                  |
+---------------------------------------------------------
+| This source file contains all the necessary functions |
+| for submitting requests in batches through io_uring.  |
+---------------------------------------------------------
+*/
+
+/*
+ * Defining _GNU_SOURCE macro since it achives all the desired
+ * feature test macro requirements, which are:
+ *     1) _DEFAULT_SOURCE for syscall()
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "informative.h"
+#include "uring.h"
+
+
+static inline int sys_io_uring_setup(unsigned int entries, 
+				     struct io_uring_params *params)
+{
+	return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static inline int sys_io_uring_register(int fd, unsigned int opcode,
+					void *arg, unsigned int nr_args)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/*
+ * Check that the running kernel supports the operation, since 
+ * io_uring's operations were added over several kernel releases.
+ */
+static bool is_supported_op(int fd, int op)
+{
+	const unsigned int ops_num = 256;
+	struct io_uring_probe *probe;
+	size_t size;
+	bool retval;
+
+	retval = false;
+	size = sizeof(struct io_uring_probe) + 
+	       ops_num * sizeof(struct io_uring_probe_op);
+
+	if ((probe = malloc_inf(size))) {
+		memset(probe, 0, size);
+		
+		if (!sys_io_uring_register(fd, IORING_REGISTER_PROBE, probe, ops_num))
+			retval = (op <= probe->last_op && 
+				  (probe->ops[op].flags & IO_URING_OP_SUPPORTED));
+		free(probe);
+	}
+	return retval;
+}
+
+static int map_rings(struct uring *ring, const struct io_uring_params *params)
+{
+	const int prot = PROT_READ | PROT_WRITE;
+	const int flags = MAP_SHARED | MAP_POPULATE;
+
+	ring->sq_ring_size = params->sq_off.array + 
+			     params->sq_entries * sizeof(unsigned int);
+	ring->cq_ring_size = params->cq_off.cqes + 
+			     params->cq_entries * sizeof(struct io_uring_cqe);
+	
+	/* Both of the rings can be mapped at once on newer kernels */
+	if (params->features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_ring_size > ring->sq_ring_size)
+			ring->sq_ring_size = ring->cq_ring_size;
+		ring->cq_ring_size = ring->sq_ring_size;
+	}
+	ring->sq_ring = mmap(NULL, ring->sq_ring_size, prot, flags, 
+			     ring->fd, IORING_OFF_SQ_RING);
+	if (ring->sq_ring == MAP_FAILED)
+		return -1;
+
+	if (params->features & IORING_FEAT_SINGLE_MMAP) {
+		ring->cq_ring = ring->sq_ring;
+	} else {
+		ring->cq_ring = mmap(NULL, ring->cq_ring_size, prot, flags, 
+				     ring->fd, IORING_OFF_CQ_RING);
+		if (ring->cq_ring == MAP_FAILED)
+			goto err_unmap_sq_ring;
+	}
+	ring->sqes = mmap(NULL, params->sq_entries * sizeof(struct io_uring_sqe),
+			  prot, flags, ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED)
+		goto err_unmap_cq_ring;
+
+	return 0;
+
+err_unmap_cq_ring:
+	if (ring->cq_ring != ring->sq_ring)
+		munmap(ring->cq_ring, ring->cq_ring_size);
+err_unmap_sq_ring:
+	munmap(ring->sq_ring, ring->sq_ring_size);
+
+	return -1;
+}
+
+static void set_ring_pointers(struct uring *ring, 
+			      const struct io_uring_params *params)
+{
+	char *sq, *cq;
+
+	sq = ring->sq_ring;
+	cq = ring->cq_ring;
+
+	ring->sq_entries = params->sq_entries;
+	ring->sq_head = (unsigned int *) (sq + params->sq_off.head);
+	ring->sq_tail = (unsigned int *) (sq + params->sq_off.tail);
+	ring->sq_mask = (unsigned int *) (sq + params->sq_off.ring_mask);
+	ring->sq_array = (unsigned int *) (sq + params->sq_off.array);
+	ring->cq_head = (unsigned int *) (cq + params->cq_off.head);
+	ring->cq_tail = (unsigned int *) (cq + params->cq_off.tail);
+	ring->cq_mask = (unsigned int *) (cq + params->cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *) (cq + params->cq_off.cqes);
+	ring->sqe_tail = *ring->sq_tail;
+}
+
+/*
+ * Set up a ring of the given number of entries that supports op. 
+ * Failing here is not reported as an error since io_uring is just 
+ * optional, the caller is expected to fall back to system calls.
+ */
+int init_uring(struct uring *ring, unsigned int entries, int op)
+{
+	struct io_uring_params params;
+
+	memset(&params, 0, sizeof(params));
+
+	if ((ring->fd = sys_io_uring_setup(entries, &params)) == -1)
+		return -1;
+	if (!is_supported_op(ring->fd, op) || map_rings(ring, &params)) {
+		close(ring->fd);
+		return -1;
+	}
+	set_ring_pointers(ring, &params);
+
+	return 0;
+}
+
+void destroy_uring(struct uring *ring)
+{
+	munmap(ring->sqes, ring->sq_entries * sizeof(struct io_uring_sqe));
+
+	if (ring->cq_ring != ring->sq_ring)
+		munmap(ring->cq_ring, ring->cq_ring_size);
+	munmap(ring->sq_ring, ring->sq_ring_size);
+	close(ring->fd);
+}
+
+/*
+ * Get the next free submission queue entry or NULL 
+ * if all of them are already prepared.
+ */
+struct io_uring_sqe *uring_get_sqe(struct uring *ring)
+{
+	struct io_uring_sqe *sqe;
+	unsigned int head;
+
+	head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+
+	if (ring->sqe_tail - head >= ring->sq_entries)
+		return NULL;
+
+	sqe = &ring->sqes[ring->sqe_tail & *ring->sq_mask];
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	ring->sqe_tail++;
+
+	return sqe;
+}
+
+void uring_prep_statx(struct io_uring_sqe *sqe, int dir_fd, 
+		      const char *path, int flags, unsigned int mask, 
+		      struct statx *statxbuf, uint64_t user_data)
+{
+	sqe->opcode = IORING_OP_STATX;
+	sqe->fd = dir_fd;
+	sqe->addr = (uintptr_t) path;
+	sqe->len = mask;
+	sqe->off = (uintptr_t) statxbuf;
+	sqe->statx_flags = flags;
+	sqe->user_data = user_data;
+}
+
+/*
+ * Publish the prepared entries to the kernel, returns the number of
+ * entries it didn't consume yet (an interrupted submission may leave
+ * some of them behind).
+ */
+static unsigned int flush_sq(struct uring *ring)
+{
+	unsigned int tail;
+
+	for (tail=*ring->sq_tail; tail != ring->sqe_tail; tail++)
+		ring->sq_array[tail & *ring->sq_mask] = tail & *ring->sq_mask;
+
+	__atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+
+	return tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Submit the prepared entries and wait for at least wait_nr completions
+ */
+int uring_submit_and_wait(struct uring *ring, unsigned int wait_nr)
+{
+	unsigned int flags;
+
+	flags = wait_nr ? IORING_ENTER_GETEVENTS : 0;
+
+	while (io_uring_enter_inf(ring->fd, flush_sq(ring), wait_nr, flags) == -1) {
+		if (ERROR != EINTR)
+			return -1;
+		ERROR = 0;
+	}
+	return 0;
+}
+
+/*
+ * Returns the next completion queue entry or NULL if there isn't any.
+ * uring_cqe_seen() should be called once the entry is handled.
+ */
+struct io_uring_cqe *uring_peek_cqe(struct uring *ring)
+{
+	unsigned int head;
+
+	head = *ring->cq_head;
+
+	if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+		return NULL;
+	else
+		return &ring->cqes[head & *ring->cq_mask];
+}
+
+void uring_cqe_seen(struct uring *ring)
+{
+	__atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
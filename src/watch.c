@@ -0,0 +1,692 @@
+/*
+---------------------------------------------------------
+| License: GNU GPL-3.0                                  |
+---------------------------------------------------------
+| This source file contains all the necessary functions |
+| for keeping the scanned tree up to date.              |
+---------------------------------------------------------
+*/
+
+/*
+ * Defining _GNU_SOURCE macro since it achives all the desired
+ * feature test macro requirements, which are:
+ *     1) _GNU_SOURCE for name_to_handle_at()
+ *     2) _DEFAULT_SOURCE for syscall()
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/syscall.h>
+#include <linux/fanotify.h>
+#include "general.h"
+#include "informative.h"
+#include "disk.h"
+#include "watch.h"
+
+#define WATCH_TABLE_INIT_CAP 1024
+#define FSID_SIZE 8
+#define HANDLE_KEY_MAX_SIZE (FSID_SIZE + sizeof(int) + MAX_HANDLE_SZ)
+
+#define INOTIFY_MASK (IN_CREATE | IN_DELETE | IN_MODIFY | IN_MOVED_FROM | \
+		      IN_MOVED_TO | IN_ONLYDIR | IN_DONT_FOLLOW | \
+		      IN_EXCL_UNLINK)
+
+#ifdef FAN_REPORT_DFID_NAME
+#define FANOTIFY_MASK (FAN_CREATE | FAN_DELETE | FAN_MODIFY | \
+		       FAN_MOVED_FROM | FAN_MOVED_TO | FAN_ONDIR)
+#endif
+
+/* What happened to a directory's entry */
+enum WATCH_KINDS {
+	ENTRY_GONE = 0x01,
+	ENTRY_NEW = 0x02,
+	ENTRY_MODIFIED = 0x04
+};
+
+
+static inline uint64_t hash_key(const unsigned char *key, size_t len)
+{
+	uint64_t hash;
+	size_t i;
+
+	for (hash=14695981039346656037ULL, i=0; i<len; i++)
+		hash = (hash ^ key[i]) * 1099511628211ULL;
+	return hash;
+}
+
+static int init_watch_table(struct watch_table *table)
+{
+	if (!(table->slots = calloc_inf(WATCH_TABLE_INIT_CAP,
+					sizeof(struct watch_slot))))
+		return -1;
+	table->cap = WATCH_TABLE_INIT_CAP;
+	table->num = 0;
+
+	return 0;
+}
+
+/*
+ * Find the key's slot, or the empty slot where it would be inserted
+ */
+static struct watch_slot *find_watch_slot(const struct watch_table *table,
+					  const void *key, size_t len)
+{
+	struct watch_slot *slot;
+	size_t i;
+
+	i = hash_key(key, len) & (table->cap - 1);
+
+	for (;; i=(i + 1) & (table->cap - 1)) {
+		slot = &table->slots[i];
+
+		if (!slot->key ||
+		    (slot->len == len && !memcmp(slot->key, key, len)))
+			return slot;
+	}
+}
+
+static int grow_watch_table(struct watch_table *table)
+{
+	struct watch_table grown;
+	size_t i;
+
+	if (!(grown.slots = calloc_inf(table->cap * 2,
+				       sizeof(struct watch_slot))))
+		return -1;
+	grown.cap = table->cap * 2;
+	grown.num = table->num;
+
+	for (i=0; i<table->cap; i++)
+		if (table->slots[i].key)
+			*find_watch_slot(&grown, table->slots[i].key,
+					 table->slots[i].len) = table->slots[i];
+	free(table->slots);
+	*table = grown;
+
+	return 0;
+}
+
+/*
+ * Map the key to the directory's node, a key that is already
+ * there (a reused watch descriptor) is remapped to the node.
+ */
+static int insert_watch_key(struct dtree_watch *w, const void *key,
+			    size_t len, struct dtree *node)
+{
+	struct watch_slot *slot;
+	unsigned char *copy;
+
+	slot = find_watch_slot(&w->table, key, len);
+
+	if (!slot->key) {
+		if (!(copy = arena_alloc(&w->keys, len)))
+			return -1;
+		memcpy(copy, key, len);
+		slot->key = copy;
+		slot->len = len;
+		w->table.num++;
+	}
+	slot->node = node;
+
+	/* Keep the load factor under 3/4 */
+	if (w->table.num * 4 >= w->table.cap * 3)
+		return grow_watch_table(&w->table);
+	return 0;
+}
+
+static inline struct dtree *find_watch_key(const struct dtree_watch *w,
+					   const void *key, size_t len)
+{
+	return find_watch_slot(&w->table, key, len)->node;
+}
+
+/*
+ * A directory that inotify can't watch (e.g. once the user's watches
+ * run out) is skipped, it only leaves the tree not to be trusted.
+ */
+static int inotify_watch_dir(struct dtree_watch *w, struct dtree *dir,
+			     const char *path)
+{
+	int wd;
+
+	if ((wd = inotify_add_watch(w->fd, path, INOTIFY_MASK)) == -1) {
+		w->lost = true;
+		return 0;
+	}
+	return insert_watch_key(w, &wd, sizeof(wd), dir);
+}
+
+#ifdef FAN_REPORT_DFID_NAME
+static inline int sys_fanotify_init(unsigned int flags,
+				    unsigned int event_f_flags)
+{
+	return syscall(__NR_fanotify_init, flags, event_f_flags);
+}
+
+static inline int sys_fanotify_mark(int fd, unsigned int flags,
+				    uint64_t mask, const char *path)
+{
+	return syscall(__NR_fanotify_mark, fd, flags, mask, AT_FDCWD, path);
+}
+
+/*
+ * The fanotify key of a directory is its file system's id,
+ * followed by its file handle's type and bytes.
+ */
+static size_t make_handle_key(unsigned char *key, const void *fsid,
+			      const struct file_handle *handle)
+{
+	memcpy(key, fsid, FSID_SIZE);
+	memcpy(key + FSID_SIZE, &handle->handle_type, sizeof(int));
+	memcpy(key + FSID_SIZE + sizeof(int), handle->f_handle,
+	       handle->handle_bytes);
+
+	return FSID_SIZE + sizeof(int) + handle->handle_bytes;
+}
+
+static struct watch_fs *find_watch_fs(const struct dtree_watch *w, dev_t dev)
+{
+	size_t i;
+
+	for (i=0; i<w->fss_num; i++)
+		if (w->fss[i].dev == dev)
+			return &w->fss[i];
+	return NULL;
+}
+
+/*
+ * Get the file system of the directory, marking it the first time
+ * it's seen. Like all the fanotify failures it's not reported, the
+ * caller falls back to inotify.
+ */
+static struct watch_fs *get_watch_fs(struct dtree_watch *w,
+				     const struct dtree *dir,
+				     const char *path)
+{
+	struct watch_fs *fs;
+	struct statfs statfsbuf;
+	struct stat statbuf;
+	dev_t dev;
+
+	if (dir->stamp)
+		dev = dir->stamp->dev;
+	else if (!lstat(path, &statbuf))
+		dev = statbuf.st_dev;
+	else
+		return NULL;
+
+	if ((fs = find_watch_fs(w, dev)))
+		return fs;
+	if (statfs(path, &statfsbuf) ||
+	    sys_fanotify_mark(w->fd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM,
+			      FANOTIFY_MASK, path))
+		return NULL;
+
+	if (reserve_array((void **) &w->fss, &w->fss_cap, w->fss_num + 1,
+			  sizeof(struct watch_fs)))
+		return NULL;
+	fs = &w->fss[w->fss_num++];
+	fs->dev = dev;
+	fs->fsid = statfsbuf.f_fsid;
+
+	return fs;
+}
+
+static int fanotify_watch_dir(struct dtree_watch *w, struct dtree *dir,
+			      const char *path)
+{
+	union {
+		struct file_handle handle;
+		unsigned char buf[sizeof(struct file_handle) + MAX_HANDLE_SZ];
+	} fh;
+	unsigned char key[HANDLE_KEY_MAX_SIZE];
+	struct watch_fs *fs;
+	int mount_id;
+
+	fh.handle.handle_bytes = MAX_HANDLE_SZ;
+
+	if (!(fs = get_watch_fs(w, dir, path)) ||
+	    name_to_handle_at(AT_FDCWD, path, &fh.handle, &mount_id, 0))
+		return -1;
+	return insert_watch_key(w, key, make_handle_key(key, &fs->fsid,
+							&fh.handle), dir);
+}
+
+static int init_fanotify(struct dtree_watch *w)
+{
+	w->fd = sys_fanotify_init(FAN_CLASS_NOTIF | FAN_CLOEXEC |
+				  FAN_NONBLOCK | FAN_REPORT_DFID_NAME,
+				  O_RDONLY);
+	return (w->fd == -1) ? -1 : 0;
+}
+#else
+static inline int fanotify_watch_dir(struct dtree_watch *w,
+				     struct dtree *dir, const char *path)
+{
+	(void) w;
+	(void) dir;
+	(void) path;
+	return -1;
+}
+
+static inline int init_fanotify(struct dtree_watch *w)
+{
+	(void) w;
+	return -1;
+}
+#endif
+
+static int watch_dir(struct dtree_watch *w, struct dtree *dir)
+{
+	const char *path;
+
+	if (!(path = build_dtree_path(&w->path_buf, dir)))
+		return -1;
+	if (w->fanotify)
+		return fanotify_watch_dir(w, dir, path);
+	else
+		return inotify_watch_dir(w, dir, path);
+}
+
+static inline bool is_watched_dir(const struct dtree *node)
+{
+	return (S_ISDIR(node->mode) && node->child &&
+		!(node->flags & DTREE_MOUNT_POINT) &&
+		!is_dot_entry(node->fname));
+}
+
+/*
+ * Watch the directory and all the directories of its tree
+ */
+static int watch_dtree(struct dtree_watch *w, struct dtree *dir)
+{
+	struct dtree *current;
+
+	if (watch_dir(w, dir))
+		return -1;
+
+	for (current=dir->child; current; current=current->next)
+		if (is_watched_dir(current) && watch_dtree(w, current))
+			return -1;
+	return 0;
+}
+
+/*
+ * Find the directory's entry named name, and its level's last entry
+ */
+static struct dtree *find_entry(struct dtree *dir, const char *name,
+				struct dtree **last)
+{
+	struct dtree *current, *found;
+
+	found = NULL;
+	*last = dir->child;
+
+	for (current=dir->child; current; current=current->next) {
+		if (!found && efficient_strcmp(current->fname, name) == 0)
+			found = current;
+		*last = current;
+	}
+	return found;
+}
+
+/*
+ * An entry that is gone by the time its event is applied
+ * is not an error, a later event takes care of it.
+ */
+static inline int ignore_vanished_entry()
+{
+	if (ERROR != ENOENT && ERROR != ENOTDIR && ERROR != EACCES)
+		return -1;
+	ERROR = 0;
+
+	return 0;
+}
+
+/*
+ * A directory that can't be watched doesn't stop the rest,
+ * the tree just can't be trusted to be current anymore.
+ */
+static inline void watch_new_dtree(struct dtree_watch *w, struct dtree *dir)
+{
+	if (is_watched_dir(dir) && watch_dtree(w, dir)) {
+		w->lost = true;
+		ERROR = 0;
+	}
+}
+
+/*
+ * Watch the entry's tree again after it was rescanned in place, the
+ * directories that were already watched are remapped to their nodes.
+ */
+void rewatch_dtree(struct dtree_watch *w, struct dtree *node)
+{
+	watch_new_dtree(w, node);
+}
+
+static int add_entry(struct dtree_watch *w, struct dtree *dir,
+		     const char *name, struct dtree *last,
+		     const struct dtree *replaced)
+{
+	struct dtree *node;
+	const char *path;
+
+	if (!(path = build_entry_path(&w->path_buf, dir, name)))
+		return -1;
+	if (!(node = get_new_entry(path, name, &w->opts, w->root_dev,
+				   replaced, w->arena)))
+		return ignore_vanished_entry();
+
+	insert_dtree(dir, last, node);
+	watch_new_dtree(w, node);
+
+	return 0;
+}
+
+static int update_entry(struct dtree_watch *w, struct dtree *node)
+{
+	const char *path;
+
+	if (S_ISDIR(node->mode))
+		return 0;
+	if (!(path = build_dtree_path(&w->path_buf, node)))
+		return -1;
+
+	return restat_entry(node, path) ? ignore_vanished_entry() : 0;
+}
+
+/*
+ * Apply the event to the directory's entry named name. A new entry
+ * replaces an old one of the same name (and takes its hard links'
+ * charges over), and a directory that shows up is scanned with its
+ * whole tree. A gone entry's charges are released, they're handed over
+ * to the other links once all the read events are applied.
+ */
+static int apply_event(struct dtree_watch *w, struct dtree *dir,
+		       const char *name, int kind)
+{
+	struct dtree *node, *last, *replaced;
+
+	if (!dir->child || is_dot_entry(name) ||
+	    is_flagged_dtree(dir, DTREE_DETACHED | DTREE_PENDING))
+		return 0;
+
+	node = find_entry(dir, name, &last);
+	replaced = NULL;
+	/* The entry is settled once its pending removal is done */
+	if (node && (node->flags & DTREE_PENDING))
+		return 0;
+	if (node && kind != ENTRY_MODIFIED) {
+		if (node == last)
+			last = node->prev;
+		detach_dtree(node);
+		if (w->opts.links_once && w->opts.links &&
+		    release_dtree_links(w->opts.links, node))
+			w->released = true;
+		replaced = node;
+		node = NULL;
+	}
+	if (kind == ENTRY_GONE)
+		return 0;
+	else if (node)
+		return update_entry(w, node);
+	else
+		return add_entry(w, dir, name, last, replaced);
+}
+
+static int get_inotify_kind(uint32_t mask)
+{
+	int kind;
+
+	kind = 0;
+
+	if (mask & (IN_DELETE | IN_MOVED_FROM))
+		kind |= ENTRY_GONE;
+	if (mask & (IN_CREATE | IN_MOVED_TO))
+		kind |= ENTRY_NEW;
+	if (mask & IN_MODIFY)
+		kind |= ENTRY_MODIFIED;
+	return kind;
+}
+
+static int apply_inotify_events(struct dtree_watch *w, size_t len)
+{
+	const struct inotify_event *event;
+	struct watch_slot *slot;
+	struct dtree *dir;
+	size_t pos;
+	int applied;
+
+	for (pos=0, applied=0; pos<len; pos+=sizeof(*event) + event->len) {
+		event = (const struct inotify_event *) (w->buf + pos);
+
+		if (event->mask & IN_Q_OVERFLOW) {
+			w->lost = true;
+		} else if (event->mask & IN_IGNORED) {
+			slot = find_watch_slot(&w->table, &event->wd,
+					       sizeof(event->wd));
+			slot->node = NULL;
+		} else if (event->len &&
+			   (dir = find_watch_key(w, &event->wd,
+						 sizeof(event->wd)))) {
+			if (apply_event(w, dir, event->name,
+					get_inotify_kind(event->mask)))
+				return -1;
+			applied++;
+		}
+	}
+	return applied;
+}
+
+#ifdef FAN_REPORT_DFID_NAME
+static int get_fanotify_kind(uint64_t mask)
+{
+	int kind;
+
+	kind = 0;
+
+	if (mask & (FAN_DELETE | FAN_MOVED_FROM))
+		kind |= ENTRY_GONE;
+	if (mask & (FAN_CREATE | FAN_MOVED_TO))
+		kind |= ENTRY_NEW;
+	if (mask & FAN_MODIFY)
+		kind |= ENTRY_MODIFIED;
+	return kind;
+}
+
+/*
+ * Get the event's directory and the entry's name out of its DFID_NAME
+ * record (of rec_len bytes), NULL when it's not a watched directory.
+ */
+static struct dtree *get_fanotify_dir(const struct dtree_watch *w,
+				      const unsigned char *rec, size_t rec_len,
+				      const char **name)
+{
+	const struct fanotify_event_info_fid *fid;
+	const struct file_handle *handle;
+	unsigned char key[HANDLE_KEY_MAX_SIZE];
+
+	fid = (const struct fanotify_event_info_fid *) rec;
+
+	if (rec_len < sizeof(*fid) + sizeof(*handle) ||
+	    fid->hdr.info_type != FAN_EVENT_INFO_TYPE_DFID_NAME)
+		return NULL;
+
+	handle = (const struct file_handle *) fid->handle;
+
+	if (handle->handle_bytes > MAX_HANDLE_SZ ||
+	    sizeof(*fid) + sizeof(*handle) + handle->handle_bytes >= rec_len)
+		return NULL;
+
+	*name = (const char *) handle->f_handle + handle->handle_bytes;
+
+	return find_watch_key(w, key, make_handle_key(key, &fid->fsid,
+						      handle));
+}
+
+/*
+ * The events are only 4 bytes aligned, so their 
+ * metadata is copied out before it's looked at.
+ */
+static int apply_fanotify_events(struct dtree_watch *w, size_t len)
+{
+	struct fanotify_event_metadata meta;
+	struct dtree *dir;
+	const char *name;
+	size_t pos;
+	int applied;
+
+	for (pos=0, applied=0; len - pos >= sizeof(meta); pos+=meta.event_len) {
+		memcpy(&meta, w->buf + pos, sizeof(meta));
+
+		if (meta.event_len < meta.metadata_len ||
+		    meta.metadata_len < sizeof(meta) ||
+		    meta.event_len > len - pos)
+			break;
+
+		if (meta.mask & FAN_Q_OVERFLOW) {
+			w->lost = true;
+		} else if ((dir = get_fanotify_dir(w, w->buf + pos + 
+						   meta.metadata_len,
+						   meta.event_len - 
+						   meta.metadata_len,
+						   &name))) {
+			if (apply_event(w, dir, name,
+					get_fanotify_kind(meta.mask)))
+				return -1;
+			applied++;
+		}
+	}
+	return applied;
+}
+#else
+static inline int apply_fanotify_events(struct dtree_watch *w, size_t len)
+{
+	(void) w;
+	(void) len;
+	return 0;
+}
+#endif
+
+/*
+ * Apply all the pending events without blocking. Returns the number
+ * of the applied events, or -1 on failure.
+ */
+int apply_watch_events(struct dtree_watch *w)
+{
+	int applied, retval;
+	ssize_t len;
+
+	applied = 0;
+
+	while ((len = read_inf(w->fd, w->buf, WATCH_BUF_SIZE)) > 0) {
+		if (w->fanotify)
+			retval = apply_fanotify_events(w, len);
+		else
+			retval = apply_inotify_events(w, len);
+		if (retval == -1)
+			return -1;
+		applied += retval;
+	}
+	if (ERROR != EAGAIN)
+		return -1;
+	ERROR = 0;
+
+	if (w->released) {
+		recharge_dtree_links(w->opts.links, w->root);
+		w->released = false;
+	}
+	return applied;
+}
+
+static void reset_watch_keys(struct dtree_watch *w)
+{
+	if (w->fd != -1)
+		close(w->fd);
+	free(w->table.slots);
+	free_arena(&w->keys);
+	free(w->fss);
+}
+
+static int init_watch_keys(struct dtree_watch *w)
+{
+	w->fd = -1;
+	w->fss = NULL;
+	w->fss_num = 0;
+	w->fss_cap = 0;
+	init_arena(&w->keys);
+
+	return init_watch_table(&w->table);
+}
+
+/*
+ * Watch the whole tree with fanotify (which marks whole file systems
+ * and needs CAP_SYS_ADMIN), or with inotify (a watch per directory)
+ * when it isn't available.
+ */
+static int watch_root(struct dtree_watch *w)
+{
+	if (init_watch_keys(w))
+		return -1;
+
+	w->fanotify = true;
+
+	if (!init_fanotify(w) && !watch_dtree(w, w->root))
+		return 0;
+
+	reset_watch_keys(w);
+
+	if (init_watch_keys(w))
+		return -1;
+
+	w->fanotify = false;
+	ERROR = 0;
+
+	if ((w->fd = inotify_init_inf()) != -1 && !watch_dtree(w, w->root))
+		return 0;
+
+	reset_watch_keys(w);
+
+	return -1;
+}
+
+/*
+ * Watch the scanned tree (its first level's beginning as returned by
+ * get_dir_tree()) for changes. The new entries' nodes are allocated
+ * out of the scan's arena and new directories are scanned with opts,
+ * whose hard links (opts->links) should be the scan's. A new directory
+ * is watched only after it's scanned, so its changes meanwhile are 
+ * missed.
+ */
+int init_dtree_watch(struct dtree_watch *w, struct dtree *begin,
+		     const struct scan_opts *opts, struct arena *arena)
+{
+	w->root = begin->parent;
+	w->root_dev = w->root->stamp ? w->root->stamp->dev : 0;
+	w->opts = *opts;
+	w->opts.prev_snap = NULL;
+	w->opts.progress = NULL;
+	w->arena = arena;
+	w->lost = false;
+	w->released = false;
+	init_path_buf(&w->path_buf);
+
+	if (!(w->buf = malloc_inf(WATCH_BUF_SIZE)))
+		return -1;
+	if (watch_root(w)) {
+		free(w->buf);
+		return -1;
+	}
+	return 0;
+}
+
+void destroy_dtree_watch(struct dtree_watch *w)
+{
+	reset_watch_keys(w);
+	free_path_buf(&w->path_buf);
+	free(w->buf);
+}